@@ -0,0 +1,425 @@
+#define _POSIX_C_SOURCE 200809L  // for mkdtemp, clock_gettime, dup, fdopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <glob.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "job_queue.h"
+#include "thread_pool.h"
+#include "search_engine.h"
+#include "util.h"
+
+// Ingest benchmark: index a corpus through the real thread pool at 1..N
+// workers and print one tab-separated row per (corpus, workers) to stdout,
+// so runs can be diffed across releases.  Two corpora: synthetic files
+// with a Zipfian vocabulary, and the files of a replay pattern (data/).
+//
+//   bench/ingest_bench [-m MiB] [-v vocab] [-z exponent] [-n files]
+//                      [-t max_workers] [-i iterations] [-s seed]
+//                      [-r replay_glob] [-c censored_list]
+
+// Defaults
+#define BENCH_MIB     8
+#define BENCH_VOCAB   50000
+#define BENCH_ZIPF    1.0
+#define BENCH_FILES   8
+#define BENCH_ITERS   3
+#define BENCH_REPLAY  "data/file*.txt"
+
+typedef struct {
+    size_t   mib, vocab, files, max_workers, iters;
+    double   zipf;
+    unsigned seed;
+    const char *replay, *censored;
+} Options;
+
+typedef struct {
+    const char  *name;
+    char       **paths;
+    size_t       n;
+    uint64_t     bytes;
+} Corpus;
+
+// One indexing run's measurements
+typedef struct {
+    double   seconds;
+    uint64_t tokens;
+    long     peak_rss_kb;
+} Run;
+
+// Files of a run still being indexed
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    size_t          left;
+} Pending;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// xorshift64*: fast, and the same corpus for the same seed everywhere
+static uint64_t rng_next(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(uint64_t *s)
+{
+    return (double)(rng_next(s) >> 11) / (double)(1ULL << 53);
+}
+
+// ------- Peak RSS -------
+
+// Reset the kernel's high-water mark, so each run reports its own peak
+static void rss_reset(void)
+{
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (!f) return;
+    fputs("5", f);
+    fclose(f);
+}
+
+// Peak RSS in KiB since rss_reset (VmHWM), else since the process started
+static long rss_peak_kb(void)
+{
+    long  kb = -1;
+    char  line[256];
+    FILE *f = fopen("/proc/self/status", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+    }
+    if (f) fclose(f);
+    if (kb >= 0) return kb;
+
+    struct rusage ru;
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : -1;
+}
+
+// ------- Corpora -------
+
+static void corpus_free(Corpus *c)
+{
+    for (size_t i = 0; i < c->n; i++) free(c->paths[i]);
+    free(c->paths);
+}
+
+// Word of a vocabulary rank: the rank in bijective base 26, so every
+// rank gets its own word and the frequent ones are the short ones
+static size_t rank_word(size_t rank, char *out)
+{
+    char   tmp[16];
+    size_t len = 0;
+    for (size_t r = rank + 1; r; r = (r - 1) / 26) {
+        tmp[len++] = (char)('a' + (r - 1) % 26);
+    }
+    for (size_t i = 0; i < len; i++) out[i] = tmp[len - 1 - i];
+    return len;
+}
+
+// Write one synthetic file of about `bytes` bytes: sentences of 5-24
+// words drawn from the Zipf CDF, wrapped at 80 columns
+static bool write_synthetic(const char *path, uint64_t bytes,
+                            const double *cdf, size_t vocab, uint64_t *rng)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("ingest_bench: fopen");
+        return false;
+    }
+    uint64_t written = 0;
+    size_t   col = 0;
+    while (written < bytes) {
+        size_t words = 5 + (size_t)(rng_next(rng) % 20);
+        for (size_t w = 0; w < words; w++) {
+            /* the rank whose CDF first reaches u */
+            double u  = rng_unit(rng);
+            size_t lo = 0, hi = vocab - 1;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (cdf[mid] < u) lo = mid + 1;
+                else              hi = mid;
+            }
+            char   word[18];
+            size_t len = rank_word(lo, word);
+            if (w == 0) word[0] = (char)(word[0] - 'a' + 'A');
+            if (w + 1 == words) word[len++] = '.';
+
+            if (col && col + len + 1 > 80) {
+                fputc('\n', f);
+                col = 0;
+            } else if (col) {
+                fputc(' ', f);
+                col++;
+            }
+            fwrite(word, 1, len, f);
+            col     += len;
+            written += len + 1;
+        }
+    }
+    fputc('\n', f);
+    if (fclose(f) != 0) {
+        perror("ingest_bench: fclose");
+        return false;
+    }
+    return true;
+}
+
+// Generate the synthetic corpus under dir
+static bool make_synthetic(const Options *o, const char *dir, Corpus *c)
+{
+    double *cdf = malloc(o->vocab * sizeof(*cdf));
+    c->paths    = calloc(o->files, sizeof(*c->paths));
+    if (!cdf || !c->paths) {
+        perror("ingest_bench: malloc");
+        free(cdf);
+        return false;
+    }
+    double sum = 0;
+    for (size_t r = 0; r < o->vocab; r++) {
+        sum   += 1.0 / pow((double)(r + 1), o->zipf);
+        cdf[r] = sum;
+    }
+    for (size_t r = 0; r < o->vocab; r++) cdf[r] /= sum;
+
+    uint64_t rng  = o->seed ? o->seed : 1;
+    uint64_t each = ((uint64_t)o->mib << 20) / o->files;
+    bool     ok   = true;
+    for (size_t i = 0; ok && i < o->files; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/zipf%03zu.txt", dir, i);
+        ok = (c->paths[i] = strdup(path)) &&
+             write_synthetic(path, each, cdf, o->vocab, &rng);
+        if (c->paths[i]) c->n++;
+        c->bytes += each;
+    }
+    free(cdf);
+    return ok;
+}
+
+// The replay corpus: every regular file matching the pattern
+static bool make_replay(const char *pattern, Corpus *c)
+{
+    glob_t g;
+    if (glob(pattern, 0, NULL, &g) != 0) {
+        fprintf(stderr, "ingest_bench: nothing matches '%s'\n", pattern);
+        return false;
+    }
+    c->paths = calloc(g.gl_pathc, sizeof(*c->paths));
+    bool ok  = c->paths != NULL;
+    for (size_t i = 0; ok && i < g.gl_pathc; i++) {
+        struct stat st;
+        if (stat(g.gl_pathv[i], &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (!(c->paths[c->n] = strdup(g.gl_pathv[i]))) {
+            perror("ingest_bench: strdup");
+            ok = false;
+            break;
+        }
+        c->n++;
+        c->bytes += (uint64_t)st.st_size;
+    }
+    globfree(&g);
+    return ok && c->n > 0;
+}
+
+// ------- Runs -------
+
+static void file_done(void *arg)
+{
+    Pending *p = arg;
+    pthread_mutex_lock(&p->lock);
+    if (--p->left == 0) pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Words indexed by a run, summed over the file registry: the index may
+// have written part of them out to on-disk segments by now
+static uint64_t count_words(HashMap *m)
+{
+    uint64_t n = 0;
+    for (uint32_t id = 0; id < fr_count(&m->files); id++) {
+        n += atomic_load(&fr_get(&m->files, id)->words);
+    }
+    return n;
+}
+
+// Index the whole corpus into a fresh map with `workers` threads
+static bool run_once(const Corpus *c, size_t workers,
+                     CensoredSet *censored, Run *out)
+{
+    HashMap *m = create_hash_map(0);
+    if (!m) return false;
+
+    JobQueue   q;
+    ThreadPool pool;
+    Pending    p = { .left = 0 };
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    jq_init(&q, 0);
+    tp_init(&pool, workers, &q);
+    rss_reset();
+
+    double t0 = now_s();
+    pthread_mutex_lock(&p.lock);
+    p.left = c->n + 1;                  // +1: ours, until every file is in
+    pthread_mutex_unlock(&p.lock);
+    for (size_t i = 0; i < c->n; i++) {
+        if (!tp_submit_cb(&pool, c->paths[i], m, censored,
+                          file_done, &p)) {
+            file_done(&p);
+        }
+    }
+    pthread_mutex_lock(&p.lock);
+    p.left--;
+    while (p.left) pthread_cond_wait(&p.cond, &p.lock);
+    pthread_mutex_unlock(&p.lock);
+    out->seconds     = now_s() - t0;
+    out->peak_rss_kb = rss_peak_kb();
+
+    jq_shutdown(&q);
+    tp_destroy(&pool);
+    jq_destroy(&q);
+
+    out->tokens = count_words(m);
+
+    free_hash_map(m);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    return true;
+}
+
+// Sweep 1, 2, 4, ... workers up to (and including) max, best of `iters`
+// runs each, one row per worker count
+static bool sweep(const Corpus *c, const Options *o,
+                  CensoredSet *censored, FILE *out)
+{
+    double base = 0;                    // tokens/s with one worker
+    for (size_t w = 1;; w = 2 * w < o->max_workers ? 2 * w : o->max_workers) {
+        Run best = { .seconds = 0 };
+        for (size_t i = 0; i < o->iters; i++) {
+            Run r;
+            if (!run_once(c, w, censored, &r)) return false;
+            if (!i || r.seconds < best.seconds) best = r;
+            fprintf(stderr, "  %s: %zu worker%s, run %zu: %.3f s\n", c->name,
+                    w, w == 1 ? "" : "s", i + 1, r.seconds);
+        }
+        double tps = best.seconds > 0 ? (double)best.tokens / best.seconds : 0;
+        if (w == 1) base = tps;
+        fprintf(out, "%s\t%zu\t%zu\t%llu\t%llu\t%.4f\t%.2f\t%.0f\t%ld\t%.3f\n",
+                c->name, w, c->n, (unsigned long long)c->bytes,
+                (unsigned long long)best.tokens, best.seconds,
+                best.seconds > 0 ? (double)c->bytes / 1048576.0 / best.seconds
+                                 : 0.0,
+                tps, best.peak_rss_kb,
+                base > 0 ? tps / ((double)w * base) : 0.0);
+        fflush(out);
+        if (w == o->max_workers) break;
+    }
+    return true;
+}
+
+// ------- Main -------
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-m MiB] [-v vocab] [-z exponent] [-n files]\n"
+            "          [-t max_workers] [-i iterations] [-s seed]\n"
+            "          [-r replay_glob] [-c censored_list]\n", prog);
+}
+
+static bool parse_size(const char *s, size_t *out)
+{
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v == 0) return false;
+    *out = (size_t)v;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    Options o = {
+        .mib = BENCH_MIB, .vocab = BENCH_VOCAB, .files = BENCH_FILES,
+        .max_workers = cpus > 0 ? (size_t)cpus : 1, .iters = BENCH_ITERS,
+        .zipf = BENCH_ZIPF, .seed = 1, .replay = BENCH_REPLAY
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "m:v:z:n:t:i:s:r:c:h")) != -1) {
+        size_t v = 0;
+        bool   ok = true;
+        switch (opt) {
+        case 'm': ok = parse_size(optarg, &o.mib);         break;
+        case 'v': ok = parse_size(optarg, &o.vocab);       break;
+        case 'n': ok = parse_size(optarg, &o.files);       break;
+        case 't': ok = parse_size(optarg, &o.max_workers); break;
+        case 'i': ok = parse_size(optarg, &o.iters);       break;
+        case 's': ok = parse_size(optarg, &v); o.seed = (unsigned)v; break;
+        case 'z': o.zipf = atof(optarg); ok = o.zipf > 0;  break;
+        case 'r': o.replay   = optarg;                     break;
+        case 'c': o.censored = optarg;                     break;
+        default:  ok = false;                              break;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    CensoredSet *censored = NULL;
+    if (o.censored && !(censored = load_censored_set(o.censored))) {
+        return EXIT_FAILURE;
+    }
+
+    /* the workers' progress lines go to /dev/null; results keep stdout */
+    int   fd  = dup(STDOUT_FILENO);
+    FILE *out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!out || !freopen("/dev/null", "w", stdout)) {
+        perror("ingest_bench: stdout");
+        return EXIT_FAILURE;
+    }
+
+    char tmpl[] = "/tmp/ingest_bench.XXXXXX";
+    char *dir   = mkdtemp(tmpl);
+    if (!dir) {
+        perror("ingest_bench: mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "# ingest_bench cpus=%ld mib=%zu vocab=%zu zipf=%.2f "
+                 "files=%zu iters=%zu seed=%u replay=%s\n",
+            cpus, o.mib, o.vocab, o.zipf, o.files, o.iters, o.seed, o.replay);
+    fprintf(out, "corpus\tworkers\tfiles\tbytes\ttokens\tseconds\tmb_s"
+                 "\ttokens_s\tpeak_rss_kb\tefficiency\n");
+
+    bool   ok  = true;
+    Corpus zipf = { .name = "zipf" };
+    fprintf(stderr, "Generating %zu MiB in %zu files under %s ...\n",
+            o.mib, o.files, dir);
+    if (make_synthetic(&o, dir, &zipf)) ok &= sweep(&zipf, &o, censored, out);
+    else                                ok = false;
+
+    Corpus replay = { .name = "replay" };
+    if (make_replay(o.replay, &replay)) ok &= sweep(&replay, &o, censored, out);
+
+    for (size_t i = 0; i < zipf.n; i++) unlink(zipf.paths[i]);
+    rmdir(dir);
+    corpus_free(&zipf);
+    corpus_free(&replay);
+    free_censored_set(censored);
+    fclose(out);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,45 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint64_t
+#include <pthread.h>   // pthread_mutex_t
+
+#include "mem.h"       // MemCat
+
+// A bump allocator over large mmap'd blocks.  Nothing is freed on its own;
+// the whole arena goes away at once with a handful of munmaps.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    char          *cur, *end;  // free space in the current block
+    ArenaBlock    *blocks;     // every block owned by the arena
+    struct Arena  *next;       // sibling arenas in the same ArenaSet
+    size_t         charged[MEM_COUNT];  // bytes this arena put on mem.h
+} Arena;
+
+// All arenas of one owner (e.g. a HashMap): one per thread that allocates.
+typedef struct {
+    pthread_mutex_t  lock;     // protects `arenas`
+    Arena           *arenas;
+    uint64_t         id;       // unique per set, keys the per-thread cache
+} ArenaSet;
+
+// Initialise an empty set.
+void arena_set_init(ArenaSet *s);
+
+// The calling thread's private arena in `s` (created on first use).
+// Returns NULL on allocation failure.
+Arena *arena_set_local(ArenaSet *s);
+
+// Unmap every block of every arena in `s`, releasing their charges.
+void arena_set_release(ArenaSet *s);
+
+// Allocate `size` bytes (16-byte aligned) from `a` for category `cat`,
+// or NULL.  Mapped space not handed out yet counts as MEM_ARENA_SPARE.
+void *arena_alloc(Arena *a, size_t size, MemCat cat);
+
+// Copy s[0..len) into `a` as a NUL-terminated string, or NULL.
+char *arena_strndup(Arena *a, const char *s, size_t len, MemCat cat);
+
+#endif // ARENA_H
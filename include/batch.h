@@ -0,0 +1,37 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>     // FILE
+#include <stddef.h>    // size_t
+#include <stdbool.h>   // bool
+
+#include "thread_pool.h"   // ThreadPool
+#include "search_engine.h" // HashMap
+#include "util.h"          // CensoredSet
+#include "query_cache.h"   // QueryCache
+
+// Non-interactive query replay: one query per line (as typed after
+// _search_, which may also be spelt out), blank and '#' lines skipped.
+// Queries run concurrently on the pool's workers, up to BATCH_WINDOW at
+// a time, and their outputs are written in input order.
+
+// What a batch run did
+typedef struct {
+    size_t queries, failed;     // failed: syntax errors, censored terms
+    size_t cache_hits;
+    double seconds;             // wall clock, first read to last write
+    double p50_ms, p95_ms, p99_ms, max_ms;  // per-query service time
+} BatchStats;
+
+/**
+ * Run every query read from `in` against `m` on `pool` and write the
+ * results to `out`, in order; fill *st.  Returns false on a read, write
+ * or allocation error (the queries before it are still written).
+ */
+bool batch_run(ThreadPool *pool, HashMap *m, const CensoredSet *censored,
+               QueryCache *cache, FILE *in, FILE *out, BatchStats *st);
+
+/** Print st as a throughput and latency summary to `f`. */
+void batch_print_stats(FILE *f, const BatchStats *st);
+
+#endif // BATCH_H
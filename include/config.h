@@ -1,19 +1,103 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-// Number of buckets in the initial hash map
+// Number of slots in the initial hash map (rounded up to a power of two)
 #define DEFAULT_BUCKETS      4096
 
+// Striped locks serialising writers of a word's posting list
+#define ENTRY_LOCK_STRIPES   1024
+
 // Load factor threshold for triggering rehash (> LOAD_FACTOR_REHASH × buckets)
 #define LOAD_FACTOR_REHASH   4
 
-// Capacity of the circular buffer for the job queue
+// Jobs waiting in the queue before a push from outside the pool blocks
 #define QUEUE_CAPACITY       128
 
 // Number of worker threads: 0 ⇒ use sysconf(_SC_NPROCESSORS_ONLN)
+#ifndef DEFAULT_NTHREADS
 #define DEFAULT_NTHREADS     0
+#endif
 
 // Timeout in seconds after which jq_push logs back-pressure warning
 #define QUEUE_BLOCK_TIMEOUT  1.0
 
+// Files larger than this are split into sentence-aligned chunks.  The
+// tests build with small chunks on a fixed pool (-DCHUNK_MIN_BYTES=...,
+// -DCONTENT_HASH_BLOCK=..., -DDEFAULT_NTHREADS=...).
+#ifndef CHUNK_MIN_BYTES
+#define CHUNK_MIN_BYTES      (256 * 1024)
+#endif
+
+// Target number of chunks per worker thread for one large file
+#define CHUNKS_PER_THREAD    4
+
+// Block size of the per-file content hash; chunk sizes are multiples of it
+#ifndef CONTENT_HASH_BLOCK
+#define CONTENT_HASH_BLOCK   (64 * 1024)
+#endif
+
+// Files an _index_ of a directory or pattern keeps queued or being
+// indexed, and their total size; the walk pauses at either limit
+#define WALK_MAX_FILES       256
+#define WALK_MAX_BYTES       (64u << 20)
+
+// Files listed by _search_ unless the query ends in a count
+#define DEFAULT_TOP_K        10
+
+// Sentences shown per listed file (the ones with the most matches)
+#define SNIPPETS_PER_FILE    3
+
+// BM25 parameters: term-frequency saturation and length normalisation
+#define BM25_K1              1.2
+#define BM25_B               0.75
+
+// Finished _search_ outputs kept by the query cache (power of two), and
+// their total size; an output over 1/8 of the budget is not kept
+#define QUERY_CACHE_ENTRIES  64
+#define QUERY_CACHE_BYTES    (8u << 20)
+
+// Queries a batch run keeps in flight; a finished one waits here until
+// every query before it has been written
+#define BATCH_WINDOW         256
+
+// Postings per compressed block of a term's live posting list; queries
+// skip whole blocks by their first posting and decode one at a time
+#define POSTING_BLOCK        128
+
+// Size of one arena block backing index entries, words and contexts
+#define ARENA_BLOCK_BYTES    (1u << 20)
+
+// Memory the index may hold, in MiB (see mem.h).  At the budget the live
+// segment is frozen and new files wait until writing segments out brings
+// memory back under it; with nothing left to write out they are refused.
+// Files already admitted are indexed whole, so it is exceeded by at most
+// what they add.  0 ⇒ unlimited; -M sets it from the command line.
+#define MEM_BUDGET_MB        0
+
+// Text indexed into the live in-memory segment before it is frozen and
+// written out as an on-disk segment (see segment.h); 0 ⇒ everything
+// stays in memory.  Once SEGMENT_MAX_FROZEN frozen segments wait to be
+// written out, new files wait for one of them to go; a pool worker
+// submitting them (a directory walk) runs queued jobs meanwhile, checking
+// back every SEGMENT_WAIT_MS.  The tests build with tiny segments
+// (-DSEGMENT_FLUSH_BYTES=...).
+#ifndef SEGMENT_FLUSH_BYTES
+#define SEGMENT_FLUSH_BYTES  (64u << 20)
+#endif
+#define SEGMENT_MAX_FROZEN   2
+#define SEGMENT_WAIT_MS      10
+
+// On-disk segments of one size class merged into one, and the largest
+// merge (total size of its inputs)
+#ifndef SEGMENT_MERGE_FANIN
+#define SEGMENT_MERGE_FANIN      4
+#endif
+#define SEGMENT_MERGE_MAX_BYTES  (1ull << 30)
+
+// Per-thread hot-path counters and timers behind _stats_ (see stats.h);
+// 0 compiles them out.  `make STATS=0` sets it from the command line.
+#ifndef STATS_ENABLED
+#define STATS_ENABLED        1
+#endif
+
 #endif // CONFIG_H
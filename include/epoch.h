@@ -0,0 +1,22 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// Epoch-based reclamation.  Readers bracket every access to shared,
+// replaceable structures with epoch_enter/epoch_exit; writers that unlink
+// such a structure hand it to epoch_retire, and it is freed only once every
+// thread that could still see it has left its critical section.
+
+// Enter a read-side critical section (may nest).
+void epoch_enter(void);
+
+// Leave the innermost critical section.
+void epoch_exit(void);
+
+// Free `p` with `free_fn` once no reader can still hold it.
+void epoch_retire(void *p, void (*free_fn)(void *));
+
+// Wait until everything retired so far has been freed.  Must not be
+// called from inside a critical section.
+void epoch_barrier(void);
+
+#endif // EPOCH_H
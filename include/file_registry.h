@@ -0,0 +1,72 @@
+#ifndef FILE_REGISTRY_H
+#define FILE_REGISTRY_H
+
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint32_t, uint64_t
+#include <stdbool.h>   // bool
+#include <stdatomic.h> // atomic_uint
+#include <pthread.h>   // pthread_mutex_t
+
+// Files per registry page; pages are never moved once published
+#define FR_PAGE_SIZE   1024
+#define FR_MAX_PAGES   4096
+
+struct FileTerms;       // defined by the index (search_engine.h)
+
+// Indexing state of a file.  New records start FR_PENDING, owned by the
+// thread that created them; whoever moves a record from FR_INDEXED back
+// to FR_PENDING owns it until its jobs finish.
+enum { FR_PENDING = 0, FR_INDEXED = 1 };
+
+// One registered file.  Postings refer to it by its index (file ID).
+// size/mtime/content/words describe the version that was indexed; they
+// are written by the owner of the record and published by `state`.
+typedef struct {
+    char                      *path;
+    uint64_t                   hash;     // fnv1a(path)
+    atomic_int                 state;    // FR_PENDING or FR_INDEXED
+    uint64_t                   size;
+    int64_t                    mtime_ns;
+    _Atomic uint64_t           content;  // content_hash, summed over chunks
+    _Atomic uint64_t           words;    // words indexed, summed over chunks
+    struct FileTerms *_Atomic  terms;    // entries it has postings in
+    struct FileTerms *_Atomic  unfolded; // ... left to fold (chunked file)
+    atomic_bool                dropped;  // a range could not be stored
+    _Atomic uint64_t           seg;      // in-memory segment holding its
+                                         // postings (segment.h), 0 ⇒ none
+} FileInfo;
+
+// Path → compact uint32_t ID registry.  Interning is serialised by `lock`;
+// fr_get/fr_path are lock-free because pages never move.
+typedef struct {
+    FileInfo *_Atomic pages[FR_MAX_PAGES];
+    atomic_uint       n;        // number of registered files
+    uint32_t         *slots;    // open addressing: id+1, 0 ⇒ empty
+    size_t            cap;      // power of two
+    pthread_mutex_t   lock;
+} FileRegistry;
+
+// Initialise an empty registry.
+void fr_init(FileRegistry *r);
+
+// Free every path and the registry's tables.
+void fr_destroy(FileRegistry *r);
+
+// Return the ID of `path`, registering it first if it is new.
+// *created (optional) tells which case happened.  Returns false on OOM.
+bool fr_intern(FileRegistry *r, const char *path,
+               uint32_t *id, bool *created);
+
+// Look up `path` without registering it.
+bool fr_lookup(FileRegistry *r, const char *path, uint32_t *id);
+
+// Record for a registered ID (NULL if out of range).
+FileInfo *fr_get(FileRegistry *r, uint32_t id);
+
+// Path of a registered ID (NULL if out of range).
+const char *fr_path(FileRegistry *r, uint32_t id);
+
+// Number of registered files.
+uint32_t fr_count(FileRegistry *r);
+
+#endif // FILE_REGISTRY_H
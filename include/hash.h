@@ -0,0 +1,66 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint64_t
+#include <string.h>    // memcpy
+
+#include "config.h"    // CONTENT_HASH_BLOCK
+
+// FNV-1a 64-bit hash for strings
+static inline uint64_t fnv1a(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// FNV-1a over an explicit length (word spans are not NUL-terminated)
+static inline uint64_t fnv1a_n(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Final avalanche of a 64-bit value (murmur3 fmix64)
+static inline uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Hash of file bytes data[off..end), where data[i] is file byte i: the
+// sum of a hash per CONTENT_HASH_BLOCK-byte block, keyed by block number.
+// Ranges starting on block boundaries can be hashed separately (e.g. one
+// per chunk) and added up to the hash of the whole file.
+static inline uint64_t content_hash(const char *data, size_t off, size_t end) {
+    uint64_t sum = 0;
+    while (off < end) {
+        size_t blk = off / CONTENT_HASH_BLOCK;
+        size_t lim = (blk + 1) * CONTENT_HASH_BLOCK;
+        if (lim > end) lim = end;
+
+        uint64_t h = 14695981039346656037ULL ^ (uint64_t)blk;
+        for (; off + 8 <= lim; off += 8) {      // eight bytes per step
+            uint64_t w;
+            memcpy(&w, data + off, sizeof w);
+            h = (h ^ w) * 0x100000001b3ULL;
+            h ^= h >> 29;
+        }
+        for (; off < lim; off++) {
+            h = (h ^ (unsigned char)data[off]) * 1099511628211ULL;
+        }
+        sum += hash_mix(h ^ (lim - blk * CONTENT_HASH_BLOCK));
+    }
+    return sum;
+}
+
+#endif // HASH_H
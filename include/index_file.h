@@ -0,0 +1,189 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint32_t, uint64_t
+#include <stdbool.h>   // bool
+
+#include "search_engine.h" // HashMap, WordOccurrence
+
+// On-disk index, format version IX_VERSION.  All integers are in host
+// byte order; a file written on a machine of the other endianness is
+// rejected by its magic.  Layout (every section 8-byte aligned), in the
+// order the sections are written -- a file is streamed out as it is
+// built and the header filled in last:
+//
+//   IxHeader
+//   char      texts[]             NUL-terminated paths and sentences,
+//                                 each file's sentences together
+//   uint8_t   postings[]          every term's postings as blocks of up to
+//                                 POSTING_BLOCK, encoded as in postings.h
+//                                 with contexts as offsets into texts[]
+//   IxFile    files[n_files]      file table, index = file ID
+//   IxTerm    terms[n_terms]      term dictionary, sorted by word bytes
+//   IxBlock   blocks[n_blocks]    every term's blocks, in term order
+//   char      words[]             the terms' NUL-terminated words
+#define IX_MAGIC    "MWFINDEX"
+#define IX_VERSION  6
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t n_files;
+    uint64_t n_terms;
+    uint64_t n_blocks;
+    uint64_t texts_off;
+    uint64_t n_text_bytes;
+    uint64_t postings_off;
+    uint64_t n_posting_bytes;
+    uint64_t files_off;
+    uint64_t terms_off;
+    uint64_t blocks_off;
+    uint64_t words_off;
+    uint64_t n_word_bytes;
+    uint64_t size;          // total file size
+} IxHeader;
+
+typedef struct {
+    uint64_t path;          // offset of the path in texts[]
+    uint64_t size;          // indexed version of the file (see FileInfo)
+    int64_t  mtime_ns;
+    uint64_t content;
+    uint64_t words;         // words indexed (for ranking)
+    uint64_t text;          // its sentences: texts[text .. text + text_len)
+    uint64_t text_len;
+} IxFile;
+
+typedef struct {
+    uint64_t word;          // offset of the word in words[]
+    uint64_t first;         // index of its first block; the next term's
+                            // first ends them
+    uint32_t len;           // word length in bytes
+    uint32_t n_postings;
+} IxTerm;
+
+typedef struct {
+    uint32_t file_id;       // first posting's key
+    uint32_t start;         // postings of the term before it
+    uint64_t sent;
+    uint64_t off;           // its bytes in postings[], up to the next one's
+} IxBlock;
+
+// A loaded index file: read-only, mapped, and attached to a HashMap whose
+// searches consult it next to the in-memory segments.  Its file IDs are
+// remapped to the map's registry; files the map already knew are shadowed
+// by it.  An on-disk segment (segment.h) is the same thing written by the
+// map itself, so its file IDs are the map's.
+typedef struct IndexSnapshot {
+    char                 *path;
+    const char           *base;     // the mapping
+    size_t                size;
+    const IxHeader       *hdr;
+    const char           *texts;
+    const uint8_t        *postings;
+    const IxFile         *files;
+    const IxTerm         *terms;
+    const IxBlock        *blocks;
+    const char           *words;
+    _Atomic uint32_t     *remap;    // snapshot file ID → map file ID
+    bool                  segment;  // an on-disk segment: remap[i] is i
+} IndexSnapshot;
+
+// Remap value of a snapshot file whose postings are hidden
+#define IX_SHADOWED UINT32_MAX
+
+// One term's postings in an index file, read a block at a time like a
+// PostingView (postings.h).  Decoded postings carry the snapshot's own
+// file IDs (see ix_file) and point into its mapping; a context that lies
+// outside it decodes as NULL.
+typedef struct {
+    const IndexSnapshot *snap;
+    const IxBlock       *blocks;    // the term's
+    size_t               n_blocks;
+    size_t               n;         // postings
+} IxView;
+
+/**
+ * Write everything `m` can answer (every segment and loaded index file)
+ * to `path`.  The file is written next to it and renamed into place.
+ */
+bool ix_save(HashMap *m, const char *path);
+
+/**
+ * Write the sources of `ss` to `path` as ix_save does; m supplies the
+ * file table.  A segment file leaves paths and versions out: its file IDs
+ * are m's own.  The caller keeps the sources alive.
+ *
+ * The terms are merged from the sources' sorted dictionaries and every
+ * section goes to disk as it is produced, so the memory it takes (charged
+ * to MEM_WRITER) is a block per source plus, for in-memory segments, a
+ * table of their sentences -- not the size of the output.  A loaded index
+ * file's postings are read a term at a time: its file IDs change order.
+ */
+bool ix_write(HashMap *m, const SegSet *ss, const char *path, bool segment);
+
+/**
+ * Map the index file at `path` and attach it to `m`.  *n_files (optional)
+ * receives the number of files it added.  Returns false on a missing,
+ * truncated or incompatible file.
+ */
+bool ix_load(HashMap *m, const char *path, uint32_t *n_files);
+
+/** Map a segment file written by ix_write, or NULL (after saying why). */
+IndexSnapshot *ix_open_segment(const char *path);
+
+/**
+ * View the postings of word[0..len) in `s` into *v, in (snapshot file ID,
+ * sent) order; empty if s lacks the word or its blocks are damaged.
+ */
+void ix_view(const IndexSnapshot *s, const char *word, size_t len, IxView *v);
+
+/**
+ * Call fn for every term of `s` that starts with prefix[0..len), in byte
+ * order, with its postings (as from ix_view).  Binary-searches the first
+ * match, so the cost follows the number of matches.
+ */
+void ix_for_each_prefix(const IndexSnapshot *s, const char *prefix,
+                        size_t len,
+                        void (*fn)(const char *word, const IxView *v,
+                                   void *arg),
+                        void *arg);
+
+/** Block b of v holds postings [ixv_block_start, ixv_block_end). */
+size_t ixv_block_start(const IxView *v, size_t b);
+size_t ixv_block_end(const IxView *v, size_t b);
+
+/** The block holding posting i (< v->n). */
+size_t ixv_block_of(const IxView *v, size_t i);
+
+/** As pv_find_block (postings.h), over v's block headers. */
+size_t ixv_find_block(const IxView *v, size_t from, uint32_t file_id,
+                      uint64_t sent);
+
+/**
+ * Decode block b of v into out (room for POSTING_BLOCK); returns its
+ * length.  A damaged block reads as its good part followed by postings
+ * without context or positions, so it keeps its length and order.
+ */
+size_t ixv_decode_block(const IxView *v, size_t b, WordOccurrence *out);
+
+/**
+ * Decode v into out (room for v->n) as map occurrences: file IDs go
+ * through ix_file, and shadowed files and unreadable postings are left
+ * out.  Returns how many there are.
+ */
+size_t ix_occurrences(const IxView *v, WordOccurrence *out);
+
+/** Map file ID of snapshot file snap_id, or IX_SHADOWED. */
+uint32_t ix_file(const IndexSnapshot *s, uint32_t snap_id);
+
+/**
+ * Hide every posting `s` holds for map file ID file_id.  Callers other
+ * than ix_load hold the map's seg_lock (see segment.h).
+ */
+void ix_shadow_file(IndexSnapshot *s, uint32_t file_id);
+
+/** Unmap a snapshot and free it. */
+void ix_close(IndexSnapshot *s);
+
+#endif // INDEX_FILE_H
@@ -3,40 +3,79 @@
 
 #include <stdbool.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "search_engine.h"  // for HashMap
 #include "util.h"           // for CensoredSet
 
-// A unit of work: index this file into the shared map,
-// using the provided censored‐word set.
+// A unit of work: index this file (or one byte range of it) into the
+// shared map, using the provided censored‐word set -- or, when `run` is
+// set, call run(arg) instead (the other fields are unused).
 typedef struct {
-    char         *filename;  // path to file
-    HashMap      *map;       // shared index
-    CensoredSet  *censored;  // which words to skip
+    char          *filename; // path to file
+    uint32_t       file_id;  // its ID in map->files
+    size_t         off, len; // byte range to index (len==0 ⇒ whole file)
+    atomic_size_t *pending;  // chunks of this file still running (NULL ⇒ unchunked)
+    HashMap       *map;      // shared index
+    CensoredSet   *censored; // which words to skip
+    void         (*run)(void *arg);  // task to run instead (NULL ⇒ index)
+    void          *arg;
+    void         (*done)(void *arg); // called once the whole file is indexed
+    void          *done_arg;
 } Job;
 
+// Scheduler for the pool's workers.  Jobs pushed from outside the pool
+// go to a bounded lock-free ring; each worker also owns a Chase–Lev deque
+// for jobs it pushes itself, pops its newest job there and, with nothing
+// local, takes from the ring or steals the oldest job of another worker.
+// A mutex and condvars are only touched to park an idle worker or a
+// pusher held back by back-pressure.
+typedef struct JqCell  JqCell;
+typedef struct JqDeque JqDeque;
+
 typedef struct {
-    Job             *buf;        // circular buffer of Jobs
-    size_t           cap;        // total slots
-    size_t           head, tail; // next pop / push
-    bool             closed;     // set when shutting down
-    pthread_mutex_t  mtx;        // protects head/tail/closed
-    pthread_cond_t   not_empty;  // signaled when buf goes non-empty
-    pthread_cond_t   not_full;   // signaled when buf goes non-full
+    JqCell          *ring;       // injection ring, mask+1 cells
+    size_t           mask;
+    atomic_size_t    enq, deq;   // next ring push / pop position
+    JqDeque         *deques;     // one per worker (see jq_set_workers)
+    size_t           n_workers;
+    size_t           cap;        // queued jobs an outside push waits below
+    atomic_size_t    queued;     // jobs pushed and not yet popped
+    atomic_bool      closed;     // set when shutting down
+    atomic_uint_fast64_t pushes; // event count: bumped after every push
+    atomic_uint      idle;       // workers parked or about to park
+    atomic_uint      full;       // pushers waiting for room
+    pthread_mutex_t  mtx;        // parking only
+    pthread_cond_t   not_empty;  // a job was pushed (or shutdown)
+    pthread_cond_t   not_full;   // queued dropped below cap
 } JobQueue;
 
 // Initialize queue (cap==0 ⇒ use default QUEUE_CAPACITY)
 void jq_init(JobQueue *q, size_t cap);
 
-// Push one job (blocks if full; logs on timeout)
+// Give the queue n worker deques; worker i then pops with jq_pop(q, i, ..).
+// Call before the workers start.
+void jq_set_workers(JobQueue *q, size_t n);
+
+// Push one job.  From outside the pool, blocks while cap jobs are waiting
+// (logging every QUEUE_BLOCK_TIMEOUT); a worker pushes onto its own
+// deque and never blocks.
 void jq_push(JobQueue *q, Job j);
 
-// Pop one job into *out; returns false if closed & empty
-bool jq_pop(JobQueue *q, Job *out);
+// Pop a job for worker `self` into *out, waiting for one; returns false
+// once the queue is closed and empty
+bool jq_pop(JobQueue *q, size_t self, Job *out);
+
+// Pop a job into *out without waiting, if the caller is one of q's
+// workers and there is one; false otherwise
+bool jq_try_pop(JobQueue *q, Job *out);
+
+// Whether the calling thread is one of q's workers
+bool jq_is_worker(const JobQueue *q);
 
 // Mark queue closed and wake all waiters
 void jq_shutdown(JobQueue *q);
 
-// Destroy queue: free buffer & sync primitives
+// Destroy queue: free buffers & sync primitives (workers must be joined)
 void jq_destroy(JobQueue *q);
 
 #endif // JOB_QUEUE_H
@@ -0,0 +1,49 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdio.h>      // FILE
+#include <stddef.h>     // size_t
+#include <stdint.h>     // int64_t
+#include <stdbool.h>    // bool
+
+// ------- Memory accounting -------
+// Every allocation the index keeps is charged to a category here: arena
+// bytes when they are handed out, malloc'd structures when they are made
+// and freed.  The totals are global relaxed counters, so a reading is
+// exact once writers stop and close enough while they run.
+
+typedef enum {
+    MEM_TABLE,          // hash map slot arrays
+    MEM_TERMS,          // entries, words and their TST nodes (arenas)
+    MEM_POSTINGS,       // compressed posting lists and blocks
+    MEM_CONTEXTS,       // sentence snippets (arenas)
+    MEM_FILE_TERMS,     // per-file entry lists (arenas)
+    MEM_REGISTRY,       // file records, paths and the path table
+    MEM_ARENA_SPARE,    // arena space mapped but not handed out yet
+    MEM_WRITER,         // buffers of an index file being written
+    MEM_COUNT
+} MemCat;
+
+/** Charge delta bytes (negative to release) to category c. */
+void mem_add(MemCat c, int64_t delta);
+
+/** Bytes charged to c right now. */
+size_t mem_bytes(MemCat c);
+
+/** Bytes charged to every category. */
+size_t mem_total(void);
+
+/** Budget in bytes; 0 (the default) means unlimited. */
+void   mem_set_budget(size_t bytes);
+size_t mem_budget(void);
+
+/** Is there a budget and is the index at or past it? */
+bool mem_over_budget(void);
+
+/** Print the categories as a table for _mem_. */
+void mem_report(FILE *out);
+
+/** Append the categories to the activity log as one key=value line. */
+void mem_log(FILE *log);
+
+#endif // MEM_H
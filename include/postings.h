@@ -0,0 +1,115 @@
+#ifndef POSTINGS_H
+#define POSTINGS_H
+
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint32_t, uint64_t
+#include <stdbool.h>   // bool
+
+// One occurrence of a word, with its file (registry ID) and snippet.
+// The context is shared by every word of the sentence; `sent` identifies
+// the sentence within its file (its byte offset), and `pos` lists the
+// word's positions in it (see varint.h; NULL if unknown).
+typedef struct {
+    char           *context;
+    uint32_t        file_id;
+    int             count;
+    uint64_t        sent;
+    const uint8_t  *pos;
+} WordOccurrence;
+
+// ------- Compressed posting lists -------
+// A term's live postings in (file_id, sent) order, cut into blocks of up
+// to POSTING_BLOCK.  A block keeps its first posting's key in the clear and
+// encodes each posting as varints relative to the one before it: file
+// gap, sentence (a gap within a file, absolute after a file change),
+// count, context address gap (zigzag), then the position list inline.
+// That is about ten bytes a posting instead of a WordOccurrence and a
+// separate position list.
+//
+// Writers append to the last block in place and release its count;
+// anything else (postings out of order, removing a file) re-encodes just
+// the blocks it touches and publishes a new list, so blocks before the
+// last may be short.  Replaced lists and blocks go through
+// epoch_retire, so readers must stay inside epoch_enter/epoch_exit while
+// they hold a view or anything decoded from one.
+
+typedef struct PostingList  PostingList;
+typedef struct PostingBlock PostingBlock;
+
+// A reader's snapshot of a list: the postings published when it was taken
+typedef struct {
+    PostingList  *list;
+    PostingBlock *last;         // the list's last block at the time
+    size_t        n_blocks;
+    size_t        n;            // postings
+} PostingView;
+
+/**
+ * Add occ[0..n), all of one file, to the list at *list (NULL for an empty
+ * one).  A posting with the same file and context as the one before it
+ * in the list is merged into that one, keeping the earlier sentence's ID
+ * and positions.  A file merged in ranges, in any order, cannot do that
+ * yet (which postings end up next to each other is only known once all
+ * are in): it passes `unfolded`, which is set instead if any posting was
+ * left next to a repeat, and folds the list with pl_fold later.  Position
+ * lists are copied.  Writers of *list must be serialised (the entry's
+ * stripe lock).  Returns false on allocation failure, with the postings
+ * before the one that failed added.
+ */
+bool pl_append(PostingList *_Atomic *list, const WordOccurrence *occ,
+               size_t n, bool *unfolded);
+
+/** Fold file_id's postings in *list as pl_append does; same rules. */
+bool pl_fold(PostingList *_Atomic *list, uint32_t file_id);
+
+/** Drop every posting of file_id from *list; same rules as pl_append. */
+bool pl_remove_file(PostingList *_Atomic *list, uint32_t file_id);
+
+/** Free l and its blocks now (no reader may still hold them). */
+void pl_free(PostingList *l);
+
+/** Snapshot l (NULL ⇒ empty) into *v.  Caller is inside an epoch. */
+void pl_view(PostingList *l, PostingView *v);
+
+/**
+ * The last block at or after `from` whose first posting is <= (file_id,
+ * sent), or `from` if there is none: the first posting >= the key is in
+ * that block or starts the next one.  Gallops over the block headers.
+ */
+size_t pv_find_block(const PostingView *v, size_t from, uint32_t file_id,
+                     uint64_t sent);
+
+/** Block b of v holds postings [pv_block_start, pv_block_end) of the view. */
+size_t pv_block_start(const PostingView *v, size_t b);
+size_t pv_block_end(const PostingView *v, size_t b);
+
+/** The block holding posting i (< v->n). */
+size_t pv_block_of(const PostingView *v, size_t i);
+
+/** Decode block b of v into out (room for POSTING_BLOCK); returns its length. */
+size_t pv_decode_block(const PostingView *v, size_t b, WordOccurrence *out);
+
+/** Decode all v->n postings of v into out. */
+void pv_decode(const PostingView *v, WordOccurrence *out);
+
+// ------- Block bytes -------
+// The encoding of one block, on its own: index files (index_file.h) store
+// their postings the same way.  The first posting's key is kept next to
+// the bytes, and its context is encoded relative to NULL.
+
+/** Bytes v[0..n) (n <= POSTING_BLOCK, in order) take as one block. */
+size_t pl_block_size(const WordOccurrence *v, size_t n);
+
+/** Encode v[0..n) at dst (pl_block_size bytes); returns the length. */
+size_t pl_block_encode(uint8_t *dst, const WordOccurrence *v, size_t n);
+
+/**
+ * Decode n postings from the block bytes at p, whose first posting's key
+ * is (file_id, sent), into out.  end bounds the bytes (NULL ⇒ trusted);
+ * returns how many decoded before they ran out or went wrong.  Position
+ * lists point into the bytes.
+ */
+size_t pl_block_decode(const uint8_t *p, const uint8_t *end, uint32_t file_id,
+                       uint64_t sent, size_t n, WordOccurrence *out);
+
+#endif // POSTINGS_H
@@ -0,0 +1,43 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdio.h>     // FILE
+#include <stdbool.h>
+
+#include "search_engine.h" // HashMap
+#include "util.h"          // CensoredSet
+#include "query_cache.h"   // QueryCache
+
+// Boolean queries over sentences.  A term is a word, a wildcard pattern
+// or a quoted phrase; terms are joined by AND (also implied between
+// adjacent terms), OR, and a leading NOT on a term; AND binds tighter
+// than OR:
+//
+//     war AND peace    war peace    war OR peace    war NOT "civil war"
+//     dino* OR q?een
+//
+// Each OR-group needs at least one term without NOT.  A sentence matches
+// a group when it contains all of the group's plain terms and none of its
+// NOT terms; it contains a phrase when the phrase's words appear in it at
+// consecutive word positions, and a pattern when it contains any word the
+// pattern matches ('*' any run of letters, '?' one letter).  Patterns are
+// expanded through the ordered term dictionaries, visiting only the terms
+// that share the pattern's literal prefix.
+
+// Longest phrase accepted, in words
+#define QUERY_MAX_PHRASE 16
+
+/**
+ * Evaluate `query` against `m` and print the files with matching
+ * sentences to `out`, best first (rank.h), like search_word; a single
+ * plain word is exactly search_word.  A trailing number is the count of
+ * files to list (0 ⇒ all, with every sentence), DEFAULT_TOP_K without
+ * one.  With a `cache`, output is kept per query and index generation,
+ * and a repeated query is answered from it.  Returns false, after
+ * printing why to `out`, on a syntax error or a censored term.  Safe to
+ * call from several threads at once.
+ */
+bool search_query(HashMap *m, const char *query, const CensoredSet *censored,
+                  QueryCache *cache, FILE *out);
+
+#endif // QUERY_H
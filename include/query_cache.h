@@ -0,0 +1,52 @@
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+
+#include <stdio.h>     // FILE
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint64_t
+#include <stdbool.h>   // bool
+#include <pthread.h>   // pthread_mutex_t
+
+// LRU cache of finished query output, keyed by the normalised query and
+// valid for one index generation (see index_generation).  Every entry
+// belongs to the same generation: seeing a newer one drops them all, so
+// a hit is never stale.
+typedef struct QcEntry QcEntry;
+
+typedef struct {
+    pthread_mutex_t  lock;
+    QcEntry        **slots;     // chained hash table, QC_SLOTS heads
+    QcEntry         *head;      // most recently used
+    QcEntry         *tail;      // least recently used
+    size_t           n, bytes;
+    uint64_t         gen;       // generation of every entry
+    size_t           hits, misses;
+} QueryCache;
+
+/** Initialise an empty cache. */
+void qc_init(QueryCache *c);
+
+/** Drop every entry (e.g. when the index they came from is freed). */
+void qc_clear(QueryCache *c);
+
+/** Drop every entry and free the cache's tables. */
+void qc_destroy(QueryCache *c);
+
+/** Hits and misses of qc_write so far. */
+void qc_counts(QueryCache *c, size_t *hits, size_t *misses);
+
+/**
+ * Write the cached output for `key` at generation gen to `out` and return
+ * true, or return false on a miss.
+ */
+bool qc_write(QueryCache *c, const char *key, uint64_t gen, FILE *out);
+
+/**
+ * Remember text[0..len) as the output for `key`, computed at generation
+ * gen.  Output too large to be worth keeping, or from an older
+ * generation, is ignored.
+ */
+void qc_put(QueryCache *c, const char *key, uint64_t gen,
+            const char *text, size_t len);
+
+#endif // QUERY_CACHE_H
@@ -0,0 +1,70 @@
+#ifndef RANK_H
+#define RANK_H
+
+#include <stdio.h>     // FILE
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint32_t, uint64_t
+#include <stdbool.h>   // bool
+
+#include "search_engine.h" // HashMap, WordOccurrence
+
+// Relevance ranking of files with Okapi BM25.  A query's matches in a
+// file score
+//
+//     idf(df) · tf·(k1+1) / (tf + k1·(1 − b + b·words/avg_words))
+//
+// where tf is the matches' total count, words the file's indexed words
+// and df the number of files with a match (see config.h for k1 and b).
+
+// The matches of a query in one file, as a range of postings
+typedef struct {
+    double                score;
+    uint32_t              file_id;  // map file ID
+    uint64_t              tf;
+    const WordOccurrence *occ;
+    size_t                n;
+} FileHits;
+
+// Corpus figures the scores need, taken once per query
+typedef struct {
+    FileRegistry *files;
+    uint32_t      n_files;          // files with indexed words
+    double        avg_words;
+    uint32_t      df;               // files with a match, set by the caller
+} RankStats;
+
+// The best k candidates offered so far: a min-heap on score, so a new one
+// only has to beat the current worst.  k == 0 keeps every candidate.
+typedef struct {
+    FileHits *v;
+    size_t    n, cap, k;
+    size_t    seen;                 // candidates offered
+} TopK;
+
+/** Fill st from m's registry (df = 0). */
+void rank_stats(HashMap *m, RankStats *st);
+
+/** Number of distinct files in postings sorted by file. */
+uint32_t rank_count_files(const WordOccurrence *occ, size_t n);
+
+/** Start an empty TopK keeping the best k (all if k == 0). */
+void topk_init(TopK *t, size_t k);
+
+/** Free t's candidates. */
+void topk_free(TopK *t);
+
+/**
+ * Score every file of occ[0..n) (sorted by file) and offer it to t.
+ * Returns false on allocation failure.
+ */
+bool rank_postings(TopK *t, const RankStats *st,
+                   const WordOccurrence *occ, size_t n);
+
+/**
+ * Print t's files best first under `label` to `out`, each with its top
+ * SNIPPETS_PER_FILE sentences (all of them when t->k == 0).  Only the
+ * printed sentences are looked at past their counts.
+ */
+void print_ranked(FILE *out, HashMap *m, const char *label, TopK *t);
+
+#endif // RANK_H
@@ -9,74 +9,256 @@
 #define _XOPEN_SOURCE   700
 #endif
 
+#include <stdio.h>     // FILE
 #include <stddef.h>    // size_t
 #include <stdint.h>    // uint64_t
 #include <pthread.h>   // pthread_rwlock_t, pthread_mutex_t
 #include <stdbool.h>   // bool
+#include <stdatomic.h> // atomic_size_t
 
-// ------- Data structures for word indexing -------
+#include "file_registry.h" // FileRegistry
+#include "postings.h"      // WordOccurrence, PostingList
+#include "arena.h"         // ArenaSet
+#include "config.h"        // ENTRY_LOCK_STRIPES
 
-// One occurrence of a word, with its file and snippet.
-typedef struct {
-    char *filename;
-    char *context;
-    int   count;
-} WordOccurrence;
+// ------- Data structures for word indexing -------
 
-// Hash map entry: a word and its occurrences.
+// Hash map entry: a word and its postings.
 typedef struct HashEntry {
-    char            *word;
-    WordOccurrence  *occ;       // dynamic array
-    int              occ_cnt;
-    int              occ_cap;
-    struct HashEntry *next;
+    char                  *word;
+    PostingList *_Atomic   postings;    // NULL until the first one
 } HashEntry;
 
-// A bucket holds a chain of entries plus a rwlock.
-typedef struct {
-    HashEntry       *head;
-    pthread_rwlock_t lock;
-} HashBucket;
+// Node of the ordered term dictionary: a ternary search tree over the
+// words' bytes, grown lock-free next to the hash table.  Terms are never
+// removed (an entry outlives its postings), so nodes need no reclamation.
+typedef struct TermNode {
+    unsigned char             c;
+    struct TermNode *_Atomic  lo;       // words with a smaller byte here
+    struct TermNode *_Atomic  eq;       // ... with this byte, next byte on
+    struct TermNode *_Atomic  hi;       // ... with a greater byte here
+    HashEntry *_Atomic        entry;    // the word ending here, or NULL
+} TermNode;
+
+// Entries that one merge added postings to, kept so the file's postings
+// can be found and removed again.  A file's batches form a list hung off
+// its FileInfo.
+typedef struct FileTerms {
+    struct FileTerms *next;
+    size_t            n;
+    HashEntry        *entries[];
+} FileTerms;
+
+// One generation of the term dictionary: open addressing with linear
+// probing, laid out as parallel arrays so a probe scans packed hash tags
+// and only dereferences an entry once its tag and key prefix match.
+// While `prev` is set, a resize is in progress: prev's slots are copied
+// into this table a few at a time, and lookups consult both.
+typedef struct HashTable {
+    size_t                    cap;          // slots, power of two
+    _Atomic uint64_t         *hashes;       // cached word hash, 0 ⇒ empty
+    uint64_t                 *prefix;       // first 8 bytes of the word
+    HashEntry *_Atomic       *entries;      // published after hash/prefix
+    struct HashTable *_Atomic prev;         // table being drained, or NULL
+    atomic_size_t             migrate_next; // next prev slot to claim
+    atomic_size_t             migrated;     // prev slots drained so far
+} HashTable;
+
+// An in-memory segment: a hash table and term tree indexing writes to,
+// and the arenas behind its entries, words, term nodes and contexts.
+// segment.h says how segments are frozen, written out and merged.
+typedef struct MemSegment {
+    uint64_t           id;          // unique in its map, from 1
+    HashTable *_Atomic table;       // current generation (epoch-protected)
+    atomic_size_t      n_items;     // distinct words
+    pthread_mutex_t    resize_lock; // serialises starting a resize
+    TermNode *_Atomic  terms;       // the same words in byte order
+    ArenaSet           arenas;      // per-thread arenas holding every entry,
+                                    // word, term node and context
+    atomic_size_t      pins;        // files being indexed into it
+    uint64_t           bytes;       // text submitted to it (seg_lock)
+    atomic_bool        frozen;      // takes no new files
+    bool               flushing;    // being written out (seg_lock)
+    bool               stuck;       // could not be: stays here (seg_lock)
+    uint32_t          *removed;     // files removed from it while frozen
+    size_t             n_removed, cap_removed;   // (seg_lock)
+} MemSegment;
 
-// Hash map with optional file deduplication.
+// Everything a search consults: the live segment and frozen ones still in
+// memory (live first), then on-disk segments and loaded index files.  A
+// file's postings are in exactly one of them.  A set is never modified:
+// it is replaced whole, and the old one retired through the epoch.
+typedef struct SegSet {
+    size_t                 n_mem, n_snap;
+    MemSegment           **mem;
+    struct IndexSnapshot **snap;
+} SegSet;
+
+// The index: its segments plus the registry of files it has indexed.
 typedef struct {
-    HashBucket     *buckets;      // buckets array
-    size_t           cap;         // number of buckets
-    size_t           n_items;     // distinct words
-    pthread_mutex_t  resize_lock; // protects rehash
-
-    // Track already indexed files
-    pthread_mutex_t  file_set_lock;
-    char           **indexed_files;
-    size_t           n_files;
-    size_t           cap_files;
+    SegSet *_Atomic  segs;        // what searches see (epoch-protected)
+    pthread_mutex_t  entry_locks[ENTRY_LOCK_STRIPES]; // serialise writers of posting lists
+
+    FileRegistry     files;       // path ⇔ file ID, also dedups submissions
+    _Atomic uint64_t generation;  // bumped after every change searches see
+
+    /* segments (segment.c) */
+    pthread_mutex_t  seg_lock;    // serialises replacing `segs`, pinning
+                                  // and removing files
+    pthread_cond_t   seg_cond;    // work for the segment thread, or a
+                                  // segment written out (broadcast)
+    pthread_t        seg_thread;  // writes out and merges segments
+    bool             seg_running, seg_stop;
+    bool             seg_freeing;  // a written-out segment not freed yet
+    bool             merge_failed; // no merges until the next write-out
+    uint64_t         next_seg_id;
+    size_t           seg_buckets; // initial slots of a new segment
 } HashMap;
 
 // -------- Public API --------
-/** Create a new hash map (use DEFAULT_BUCKETS if cap==0). */
+/**
+ * Create a new map with one empty live segment of cap slots (use
+ * DEFAULT_BUCKETS if cap==0), and start its segment thread.
+ */
 HashMap *create_hash_map(size_t cap);
 
-/** Add one occurrence of word (from filename/context). */
-void add_word_occurrence(HashMap *m,
+/** Create an empty in-memory segment, or NULL on allocation failure. */
+MemSegment *mem_segment_create(size_t cap, uint64_t id);
+
+/** Free a segment and everything in it (no reader may still hold it). */
+void mem_segment_free(void *seg);
+
+/**
+ * Add one occurrence of word (from file file_id / context) to the file's
+ * segment, pinning it for the call.  Returns false if it could not be
+ * stored.
+ */
+bool add_word_occurrence(HashMap *m,
                          const char *word,
-                         const char *filename,
+                         uint32_t    file_id,
                          const char *context);
 
 /**
- * Get all occurrences of word. Returns malloc'd array and sets *out_n,
- * or NULL if word not found.
+ * Private, unsynchronised term→occurrences buffer owned by one worker.
+ * A job fills it token by token and then merges it into the shared map in
+ * one batch, taking each bucket lock once per distinct term.
+ */
+typedef struct LocalIndex LocalIndex;
+
+/** Create an empty local index, or NULL on allocation failure. */
+LocalIndex *local_index_create(void);
+
+/**
+ * Buffer one occurrence of word[0..len), the pos-th word (from 0) of the
+ * raw sentence ctx[0..ctx_len).  Both spans are borrowed (e.g. from a file
+ * mapping) and must stay valid until the next merge; line breaks in ctx
+ * are collapsed when it is stored.
+ */
+void local_index_add(LocalIndex *li,
+                     const char *word,
+                     size_t      len,
+                     const char *ctx,
+                     size_t      ctx_len,
+                     uint32_t    pos);
+
+/**
+ * Merge everything buffered in `li` into `m` for file_id, then reset `li`.
+ * The file must be pinned (segments_pin_file): it goes to its segment.
+ * Sentence IDs are the offsets of the buffered spans from `base`, the
+ * address of the file's first byte.  `fold` is false for one range of a
+ * file merged in several: repeated contexts are then left for
+ * fold_file_postings (see pl_append).  Returns false, with errno set, if
+ * the range was dropped because its contexts could not be stored.
+ */
+bool merge_local_index(HashMap *m, LocalIndex *li, uint32_t file_id,
+                       const char *base, bool fold);
+
+/**
+ * Fold the repeated contexts the merges of file_id's ranges left (pl_fold),
+ * once all of them are in: the index then holds what one pass over the
+ * file would have built, whatever order they went in.  The file must
+ * still be pinned.
+ */
+void fold_file_postings(HashMap *m, uint32_t file_id);
+
+/** Free the local index and anything still buffered in it. */
+void local_index_free(LocalIndex *li);
+
+/**
+ * Get all occurrences of word, from every segment and loaded index file.
+ * Returns malloc'd array and sets *out_n, or NULL if word not found.
+ * Never blocks on concurrent indexing.  The occurrences point into the
+ * segments: read them only inside an epoch entered before the call.
  */
 WordOccurrence *get_word_occurrences(HashMap *m,
                                      const char *word,
                                      int *out_n);
 
-/** Free the map and all data. */
+/**
+ * Same for the sources of `ss` only, which the caller keeps alive (an
+ * epoch around the call, or owning them).  Shadowed files are skipped.
+ */
+WordOccurrence *set_word_occurrences(const SegSet *ss, const char *word,
+                                     int *out_n);
+
+/**
+ * Snapshot segment s's postings of word, in (file_id, sent) order, into
+ * *v (empty if s lacks the word).  Call inside epoch_enter/epoch_exit:
+ * the view, and anything decoded from it, is valid until the epoch is
+ * left -- contexts too, once s may be written out.
+ */
+void seg_postings(MemSegment *s, const char *word, PostingView *v);
+
+/**
+ * Drop every posting of file_id ahead of re-indexing it: from the
+ * in-memory segment holding it, or by shadowing it in the on-disk
+ * segments and loaded index files.  Costs one copy-on-write per word the
+ * file contained (re-encoding the blocks that hold the file's postings).
+ * The caller must own the file's record (FR_PENDING).
+ */
+void remove_file_postings(HashMap *m, uint32_t file_id);
+
+/**
+ * Call fn for every word of segment s.  Words stay valid as long as s;
+ * some may be seen twice while the table is being resized.
+ */
+void seg_for_each_word(MemSegment *s,
+                       void (*fn)(const char *word, void *arg),
+                       void *arg);
+
+/**
+ * Call fn for every word of segment s that starts with prefix[0..len), in
+ * byte order.  Walks the term dictionary, so the cost follows the prefix
+ * length and the number of matches, not the table.
+ */
+void seg_for_each_prefix(MemSegment *s, const char *prefix, size_t len,
+                         void (*fn)(const char *word, void *arg),
+                         void *arg);
+
+/**
+ * Current generation of m.  Anything computed from the index after
+ * reading generation g is still exact while it reads g.
+ */
+static inline uint64_t index_generation(HashMap *m) {
+    return atomic_load_explicit(&m->generation, memory_order_acquire);
+}
+
+/** Mark a change to m's searchable contents as complete. */
+static inline void index_changed(HashMap *m) {
+    atomic_fetch_add_explicit(&m->generation, 1, memory_order_acq_rel);
+}
+
+/** Stop its segment thread and free the map, its segments and all data. */
 void free_hash_map(HashMap *m);
 
-/** Compare two WordOccurrence by count (desc) for qsort. */
+/** Compare two WordOccurrence by count (desc), then position, for qsort. */
 int cmp_occ(const void *a, const void *b);
 
-/** Find word and print its occurrences to stdout. */
-void search_word(HashMap *m, const char *word);
+/**
+ * Find word and print the k files it is most relevant to (BM25, see
+ * rank.h) with their best sentences to `out`; k == 0 prints every file
+ * and sentence.  Every source's postings are decoded once.
+ */
+void search_word(HashMap *m, const char *word, size_t k, FILE *out);
 
 #endif // SEARCH_ENGINE_H
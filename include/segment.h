@@ -0,0 +1,75 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdio.h>      // FILE
+#include <stdint.h>     // uint32_t, uint64_t
+#include <stdbool.h>    // bool
+
+#include "search_engine.h" // HashMap, MemSegment, SegSet
+#include "index_file.h"    // IndexSnapshot
+
+// ------- Index segments -------
+// Files are indexed into the live in-memory segment.  Once the text
+// submitted to it reaches SEGMENT_FLUSH_BYTES it is frozen and a fresh
+// one takes new files; a background thread writes each frozen segment out
+// as an index file (index_file.h) once the files still being indexed into
+// it are done, maps it, and swaps it in for the segment, whose memory
+// goes.  The same thread merges on-disk segments of similar size into
+// one, so a search consults a handful of them.  Segment files are
+// unlinked as soon as they are mapped: nothing is left behind on exit.
+//
+// A file's postings are in exactly one segment.  Re-indexing it removes
+// them from its in-memory segment, or shadows them on disk, first.
+
+/** Directory segment files are written to (default: $TMPDIR or /tmp). */
+void segments_set_dir(const char *dir);
+
+/**
+ * Give m its first live segment and, unless SEGMENT_FLUSH_BYTES is 0,
+ * start its segment thread.  Returns false (after saying why) on failure.
+ */
+bool segments_init(HashMap *m);
+
+/** Stop m's segment thread and free every segment it holds. */
+void segments_destroy(HashMap *m);
+
+/** m's current segments.  Caller is inside an epoch and keeps to it. */
+SegSet *segments_acquire(HashMap *m);
+
+/** The in-memory segment of ss holding fi's postings, or NULL. */
+MemSegment *segments_of_file(const SegSet *ss, const FileInfo *fi);
+
+/** Same for m's current segments; fi must be pinned. */
+MemSegment *segments_file_segment(HashMap *m, const FileInfo *fi);
+
+/**
+ * Pin the segment fi is to be indexed into, freezing the live one first
+ * if it is full, and count `bytes` of text against it.  The segment is
+ * not written out until segments_unpin_file.  A file goes back to the
+ * segment already holding it while that one is still in memory.  Never
+ * fails: if the live segment cannot be frozen, it keeps taking files.
+ */
+MemSegment *segments_pin_file(HashMap *m, FileInfo *fi, uint64_t bytes);
+void        segments_unpin_file(HashMap *m, FileInfo *fi);
+
+/**
+ * Back-pressure for new files: while the live segment is full and
+ * SEGMENT_MAX_FROZEN frozen ones are waiting for the segment thread, wait
+ * until it has written one out -- at most max_ms (0 ⇒ no limit).  Returns
+ * whether there is room now.
+ */
+bool segments_wait_room(HashMap *m, unsigned max_ms);
+
+/**
+ * Remember that file_id was removed from frozen segment s, so the file
+ * it is written to shadows it.  Caller holds m->seg_lock.
+ */
+void segments_note_removed(MemSegment *s, uint32_t file_id);
+
+/** Add a loaded index file to m's segments. */
+bool segments_attach(HashMap *m, IndexSnapshot *snap);
+
+/** Print m's segments as a line for _mem_. */
+void segments_report(HashMap *m, FILE *out);
+
+#endif // SEGMENT_H
@@ -0,0 +1,103 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>      // FILE
+#include <stdint.h>     // uint64_t
+#include <stdbool.h>    // bool
+#include <stdatomic.h>  // atomic_uint_fast64_t
+#include <pthread.h>    // pthread_mutex_t
+
+#include "config.h"     // STATS_ENABLED
+
+// ------- Hot-path counters -------
+// Every thread adds to its own record (no shared cache lines, no locked
+// instructions); _stats_ sums the records on demand.  With STATS_ENABLED
+// 0 the macros below expand to nothing and the records are never made.
+
+typedef enum {
+    ST_FILES_READ,          // ranges opened and mapped ...
+    ST_READ_NS,             // ... and the time to read them in
+    ST_RANGES_TOKENIZED,
+    ST_TOKENIZE_NS,
+    ST_TOKENS,              // words buffered for the index
+    ST_CENSORED_SENTENCES,  // sentences skipped for a censored word
+    ST_MERGES,              // per-range merges into the map ...
+    ST_INSERT_NS,           // ... and their time, waits included
+    ST_LOCK_WAITS,          // stripe locks found taken ...
+    ST_LOCK_WAIT_NS,        // ... and the time waited for them
+    ST_RESIZES,             // table doublings started
+    ST_RESIZE_NS,           // time writers spent migrating slots
+    ST_PUSH_WAITS,          // outside pushes held back by a full queue ...
+    ST_PUSH_WAIT_NS,
+    ST_POP_WAITS,           // workers parked for want of a job ...
+    ST_POP_WAIT_NS,
+    ST_SEG_WAITS,           // new files held back by the segment thread ...
+    ST_SEG_WAIT_NS,
+    ST_COUNT
+} StatId;
+
+#if STATS_ENABLED
+
+typedef struct StatsRec {
+    atomic_uint_fast64_t  v[ST_COUNT];  // written by the owner only
+    atomic_bool           in_use;
+    struct StatsRec      *next;
+} StatsRec;
+
+extern _Thread_local StatsRec *stats_tl;
+
+// The calling thread's record, made on first use
+StatsRec *stats_rec(void);
+
+uint64_t stats_now_ns(void);
+
+static inline void stats_add(StatId id, uint64_t v)
+{
+    StatsRec *r = stats_tl ? stats_tl : stats_rec();
+    atomic_store_explicit(&r->v[id],
+        atomic_load_explicit(&r->v[id], memory_order_relaxed) + v,
+        memory_order_relaxed);
+}
+
+// Lock mx, counting and timing the wait if it is taken
+static inline void stats_lock(pthread_mutex_t *mx, StatId waits, StatId ns)
+{
+    if (pthread_mutex_trylock(mx) == 0) return;
+    uint64_t t0 = stats_now_ns();
+    pthread_mutex_lock(mx);
+    stats_add(waits, 1);
+    stats_add(ns, stats_now_ns() - t0);
+}
+
+#define STATS_ADD(id, v)          stats_add((id), (v))
+#define STATS_START(t)            uint64_t t = stats_now_ns()
+#define STATS_STOP(id, t)         stats_add((id), stats_now_ns() - (t))
+#define STATS_LOCK(mx, waits, ns) stats_lock((mx), (waits), (ns))
+
+#else
+
+#define STATS_ADD(id, v)          ((void)0)
+#define STATS_START(t)            ((void)0)
+#define STATS_STOP(id, t)         ((void)0)
+#define STATS_LOCK(mx, waits, ns) pthread_mutex_lock(mx)
+
+#endif // STATS_ENABLED
+
+/** Sum every thread's counters into out (all zero when compiled out). */
+void stats_snapshot(uint64_t out[ST_COUNT]);
+
+/** Print the counters as a table for _stats_. */
+void stats_report(FILE *out);
+
+/** Append the counters to the activity log as one key=value line. */
+void stats_log(FILE *log);
+
+/**
+ * Log the counters every `seconds` from a background thread until
+ * stats_stop_logger.  Returns false (after saying why) if they are
+ * compiled out or the thread cannot start.
+ */
+bool stats_start_logger(FILE *log, unsigned seconds);
+void stats_stop_logger(void);
+
+#endif // STATS_H
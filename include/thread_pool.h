@@ -9,25 +9,52 @@
 #include "search_engine.h"// HashMap  (for dedup set)
 #include "util.h"         // CensoredSet
 
+// One worker thread and its deque in the queue
+typedef struct {
+    pthread_t   thread;
+    JobQueue   *queue;
+    size_t      id;        // index of its deque
+} Worker;
+
 // Fixed-size pool of worker threads consuming Jobs from a JobQueue
 typedef struct {
-    pthread_t  *workers;   // thread IDs
+    Worker     *workers;
     size_t      n;         // number of threads
     JobQueue   *queue;     // shared queue
 } ThreadPool;
 
-// Start n_threads workers (0 ⇒ #CPU cores) pulling from `q`
+// Start n_threads workers (0 ⇒ #CPU cores) pulling from `q`, one deque
+// each (jq_set_workers)
 void tp_init(ThreadPool *pool, size_t n_threads, JobQueue *q);
 
-/*  Enqueue one file-to-index job.
+/*  Enqueue one file-to-index job.  A file indexed before is checked
+ *  against the recorded size, mtime and content hash: an unchanged one
+ *  is skipped, a changed one loses its old postings and is re-tokenized.
  *  Returns true  – job pushed
- *          false – file was already queued/indexed OR allocation error.
+ *          false – file queued, unchanged, OR allocation error.
  */
 bool tp_submit(ThreadPool   *pool,
                const char   *filename,
                HashMap      *map,
                CensoredSet  *censored);
 
+// Same as tp_submit, and once every chunk of the file has been indexed
+// the worker that finished it calls done(done_arg) -- exactly once if
+// (and only if) this returns true.
+bool tp_submit_cb(ThreadPool   *pool,
+                  const char   *filename,
+                  HashMap      *map,
+                  CensoredSet  *censored,
+                  void        (*done)(void *arg),
+                  void         *done_arg);
+
+// printf to stdout, whole and flushed, under the lock the workers'
+// messages share
+void tp_log(const char *fmt, ...);
+
+// Queue fn(arg) to run on a worker (blocks while the queue is full)
+void tp_run(ThreadPool *pool, void (*fn)(void *arg), void *arg);
+
 // Gracefully signal shutdown, join workers & free resources
 void tp_destroy(ThreadPool *pool);
 
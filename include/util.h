@@ -2,7 +2,9 @@
 #define UTIL_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <sys/stat.h>       // struct stat
 #include "search_engine.h"  // for HashMap
 
 // ----------------------------------------------------------------------------
@@ -19,6 +21,9 @@ CensoredSet *load_censored_set(const char *filepath);
 // Returns true if `word` is in `set`.  Safe to call with set==NULL.
 bool is_censored(const CensoredSet *set, const char *word);
 
+// Same as is_censored for the unterminated span word[0..len).
+bool is_censored_span(const CensoredSet *set, const char *word, size_t len);
+
 // Free all memory held by the set.
 void free_censored_set(CensoredSet *set);
 
@@ -27,13 +32,37 @@ void free_censored_set(CensoredSet *set);
 // TOKENIZATION & FILE I/O
 // ----------------------------------------------------------------------------
 
-// Read the file at `filepath` line‐by‐line; skip any line containing a
-// censored word, otherwise index every word in the line using the
-// entire line as context.
+// Map the file at `filepath` and walk it sentence-by-sentence; skip any
+// sentence containing a censored word, otherwise index every word in it
+// using the whole sentence (line breaks collapsed) as context.  Files
+// already in the map's registry are left alone.
 void tokenize_file(const char        *filepath,
                    HashMap           *map,
                    const CensoredSet *censored);
 
+// Like tokenize_file for an already registered file_id, but index only the sentences that start inside the
+// byte range [off, off+len).  Range edges are snapped forward to the byte
+// after the next sentence terminator, so adjacent ranges partition the file
+// exactly as a whole-file pass would.  len==0 ⇒ up to end of file.
+// Words are buffered in `scratch` (NULL ⇒ a temporary LocalIndex) and
+// merged into `map` once the range is done.  The range's content_hash is
+// added to the file's record, so off must be a multiple of
+// CONTENT_HASH_BLOCK.
+void tokenize_range(const char        *filepath,
+                    uint32_t           file_id,
+                    size_t             off,
+                    size_t             len,
+                    HashMap           *map,
+                    const CensoredSet *censored,
+                    LocalIndex        *scratch);
+
+// Modification time of `st` in nanoseconds since the epoch.
+int64_t file_mtime_ns(const struct stat *st);
+
+// content_hash of the whole file at `filepath` (what the indexer records
+// for it).  Returns false if the file can't be read.
+bool file_content_hash(const char *filepath, uint64_t *out);
+
 // Trim trailing newline or carriage‐return from `s` in‐place.
 void trim_nl(char *s);
 
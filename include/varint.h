@@ -0,0 +1,103 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint8_t, uint32_t, uint64_t
+#include <stdbool.h>   // bool
+
+// LEB128 varints: 7 bits per byte, low bits first, high bit set on every
+// byte but the last.
+#define VARINT_MAX 10   // bytes for a full uint64_t
+
+static inline size_t varint_put(uint8_t *dst, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    dst[n++] = (uint8_t)v;
+    return n;
+}
+
+// Decode one varint at *p, advancing it.  end==NULL ⇒ trusted input.
+static inline bool varint_get(const uint8_t **p, const uint8_t *end,
+                              uint64_t *v) {
+    uint64_t x = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (end && *p >= end) return false;
+        uint8_t b = *(*p)++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Zigzag: signed values as unsigned ones, small magnitudes staying small
+static inline uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t z) {
+    return (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+}
+
+// ------- Position lists -------
+// The word positions of one occurrence: varint count, then the ascending
+// positions as varint gaps (the first one absolute).
+
+// Bytes needed at most to encode n positions
+static inline size_t poslist_bound(size_t n) {
+    return (n + 1) * 5;         // positions are uint32_t
+}
+
+static inline size_t poslist_encode(uint8_t *dst, const uint32_t *pos,
+                                    size_t n) {
+    size_t   len  = varint_put(dst, n);
+    uint32_t prev = 0;
+    for (size_t i = 0; i < n; i++) {
+        len += varint_put(dst + len, pos[i] - prev);
+        prev = pos[i];
+    }
+    return len;
+}
+
+typedef struct {
+    const uint8_t *p, *end;     // end==NULL ⇒ trusted input
+    uint64_t       left;        // positions not yet returned
+    uint64_t       cur;
+} PosIter;
+
+static inline bool pos_iter_init(PosIter *it, const uint8_t *list,
+                                 const uint8_t *end) {
+    it->p   = list;
+    it->end = end;
+    it->cur = 0;
+    return list && varint_get(&it->p, end, &it->left);
+}
+
+// Next position, or false at the end (or on malformed input)
+static inline bool pos_iter_next(PosIter *it, uint32_t *pos) {
+    uint64_t gap;
+    if (!it->left || !varint_get(&it->p, it->end, &gap)) return false;
+    it->left--;
+    it->cur += gap;
+    if (it->cur > UINT32_MAX) return false;
+    *pos = (uint32_t)it->cur;
+    return true;
+}
+
+// Encoded size of a position list, or 0 if it overruns `end`
+static inline size_t poslist_len(const uint8_t *list, const uint8_t *end) {
+    PosIter  it;
+    uint32_t pos;
+    if (!pos_iter_init(&it, list, end)) return 0;
+    while (it.left) {
+        if (!pos_iter_next(&it, &pos)) return 0;
+    }
+    return (size_t)(it.p - list);
+}
+
+#endif // VARINT_H
@@ -0,0 +1,30 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdbool.h>
+
+#include "thread_pool.h"   // ThreadPool
+#include "search_engine.h" // HashMap
+#include "util.h"          // CensoredSet
+
+// Characters that make an _index_ argument a glob(3) pattern
+#define WALK_GLOB_CHARS "*?["
+
+/**
+ * Index every file under `pattern` -- a directory, or a glob pattern
+ * whose matches may be files or directories -- recursively and in the
+ * background.  Directories are read by tasks on the pool (up to one per
+ * worker), which feed it the files themselves, so the walk never waits
+ * on the queue's back-pressure.  At most WALK_MAX_FILES files and
+ * WALK_MAX_BYTES bytes are queued or being indexed at once; a walk at
+ * either limit pauses until files finish.  Paths already in the
+ * registry and hidden entries ('.' names) are skipped, and symlinked
+ * directories are not followed.  A line is printed when the walk ends.
+ * Returns false, after printing why, if nothing matched.
+ */
+bool walk_index(ThreadPool  *pool,
+                const char  *pattern,
+                HashMap     *map,
+                CensoredSet *censored);
+
+#endif // WALK_H
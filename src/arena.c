@@ -0,0 +1,150 @@
+#define _DEFAULT_SOURCE          // for MAP_ANONYMOUS
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "config.h"
+
+#define ARENA_ALIGN        16
+#define ARENA_TL_CACHE     4    // sets a thread can hop between cheaply
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t      size;           // bytes mapped, header included
+};
+
+#define HDR_SIZE ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static atomic_uint_fast64_t next_set_id = 1;
+
+/* per-thread cache: ArenaSet id → this thread's arena in it */
+static _Thread_local struct {
+    uint64_t  id;
+    Arena    *arena;
+} tl_cache[ARENA_TL_CACHE];
+static _Thread_local unsigned tl_victim;
+
+static inline size_t align_up(size_t n, size_t a) {
+    return (n + a - 1) & ~(a - 1);
+}
+
+// Put n bytes (negative to give back) on cat, remembering them for release
+static inline void charge(Arena *a, MemCat cat, int64_t n)
+{
+    a->charged[cat] += (size_t)n;
+    mem_add(cat, n);
+}
+
+static ArenaBlock *map_block(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("arena: mmap");
+        return NULL;
+    }
+    ArenaBlock *b = p;
+    b->size = size;
+    return b;
+}
+
+void *arena_alloc(Arena *a, size_t size, MemCat cat)
+{
+    size = align_up(size ? size : 1, ARENA_ALIGN);
+
+    if ((size_t)(a->end - a->cur) >= size) {
+        void *p = a->cur;
+        a->cur += size;
+        charge(a, MEM_ARENA_SPARE, -(int64_t)size);
+        charge(a, cat, (int64_t)size);
+        return p;
+    }
+
+    /* big requests get a block of their own; the current one stays open */
+    if (size > ARENA_BLOCK_BYTES / 4) {
+        ArenaBlock *b = map_block(align_up(HDR_SIZE + size, 4096));
+        if (!b) return NULL;
+        b->next   = a->blocks;
+        a->blocks = b;
+        charge(a, MEM_ARENA_SPARE, (int64_t)(b->size - HDR_SIZE - size));
+        charge(a, cat, (int64_t)size);
+        return (char *)b + HDR_SIZE;
+    }
+
+    ArenaBlock *b = map_block(ARENA_BLOCK_BYTES);
+    if (!b) return NULL;
+    b->next   = a->blocks;
+    a->blocks = b;
+    a->cur    = (char *)b + HDR_SIZE + size;
+    a->end    = (char *)b + ARENA_BLOCK_BYTES;
+    charge(a, MEM_ARENA_SPARE, (int64_t)(a->end - a->cur));
+    charge(a, cat, (int64_t)size);
+    return (char *)b + HDR_SIZE;
+}
+
+char *arena_strndup(Arena *a, const char *s, size_t len, MemCat cat)
+{
+    char *p = arena_alloc(a, len + 1, cat);
+    if (!p) return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+void arena_set_init(ArenaSet *s)
+{
+    pthread_mutex_init(&s->lock, NULL);
+    s->arenas = NULL;
+    s->id     = atomic_fetch_add(&next_set_id, 1);
+}
+
+Arena *arena_set_local(ArenaSet *s)
+{
+    for (unsigned i = 0; i < ARENA_TL_CACHE; i++) {
+        if (tl_cache[i].id == s->id) return tl_cache[i].arena;
+    }
+
+    /* first allocation by this thread: the arena lives in its own block */
+    ArenaBlock *b = map_block(ARENA_BLOCK_BYTES);
+    if (!b) return NULL;
+    b->next = NULL;
+    Arena *a  = (Arena *)((char *)b + HDR_SIZE);
+    a->blocks = b;
+    a->cur    = (char *)a + align_up(sizeof(*a), ARENA_ALIGN);
+    a->end    = (char *)b + ARENA_BLOCK_BYTES;
+    charge(a, MEM_ARENA_SPARE, (int64_t)(a->end - a->cur));  // charged[]: zeroed by mmap
+
+    pthread_mutex_lock(&s->lock);
+    a->next   = s->arenas;
+    s->arenas = a;
+    pthread_mutex_unlock(&s->lock);
+
+    unsigned v = tl_victim++ % ARENA_TL_CACHE;
+    tl_cache[v].id    = s->id;
+    tl_cache[v].arena = a;
+    return a;
+}
+
+void arena_set_release(ArenaSet *s)
+{
+    pthread_mutex_lock(&s->lock);
+    Arena *a = s->arenas;
+    s->arenas = NULL;
+    pthread_mutex_unlock(&s->lock);
+
+    while (a) {
+        Arena      *next = a->next;
+        ArenaBlock *b    = a->blocks;   // the arena itself lives in the last one
+        for (int c = 0; c < MEM_COUNT; c++) mem_add(c, -(int64_t)a->charged[c]);
+        while (b) {
+            ArenaBlock *bn = b->next;
+            munmap(b, b->size);
+            b = bn;
+        }
+        a = next;
+    }
+    pthread_mutex_destroy(&s->lock);
+}
@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L  // for getline, open_memstream, clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "batch.h"
+#include "config.h"
+#include "query.h"
+
+// ANSI escape codes for styling
+#define BOLD  "\033[1m"
+#define CYAN  "\033[36m"
+#define RESET "\033[0m"
+
+typedef struct Batch Batch;
+
+// One query in flight and, once done, its rendered output
+typedef struct {
+    Batch  *b;
+    char   *query;
+    char   *text;
+    size_t  len;
+    double  ms;                 // service time on the worker
+    bool    ok;
+    bool    done;               // guarded by b->lock
+} Slot;
+
+// The window of queries in flight: slots[head .. head+n) mod BATCH_WINDOW,
+// oldest first
+struct Batch {
+    pthread_mutex_t    lock;
+    pthread_cond_t     done;    // a slot finished
+    Slot               slots[BATCH_WINDOW];
+    size_t             head, n;
+    HashMap           *m;
+    const CensoredSet *censored;
+    QueryCache        *cache;
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Worker side: render one query into its slot's buffer
+static void run_slot(void *arg)
+{
+    Slot  *s  = arg;
+    Batch *b  = s->b;
+    double t0 = now_ms();
+
+    FILE *mem = open_memstream(&s->text, &s->len);
+    if (mem) {
+        fprintf(mem, "\n" BOLD CYAN "_search_ %s" RESET "\n\n", s->query);
+        s->ok = search_query(b->m, s->query, b->censored, b->cache, mem);
+        if (fclose(mem) != 0) {
+            perror("batch_run: open_memstream");
+            s->ok  = false;
+            s->len = 0;
+        }
+    } else {
+        perror("batch_run: open_memstream");
+    }
+    s->ms = now_ms() - t0;
+
+    pthread_mutex_lock(&b->lock);
+    s->done = true;
+    pthread_cond_signal(&b->done);      // only the reader waits
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Latencies of the written queries, for the percentiles
+typedef struct {
+    double *v;
+    size_t  n, cap;
+} Latencies;
+
+static bool lat_push(Latencies *l, double ms)
+{
+    if (l->n == l->cap) {
+        size_t  new_cap = l->cap ? l->cap * 2 : 1024;
+        double *tmp     = realloc(l->v, new_cap * sizeof(*tmp));
+        if (!tmp) {
+            perror("batch_run: realloc");
+            return false;
+        }
+        l->v   = tmp;
+        l->cap = new_cap;
+    }
+    l->v[l->n++] = ms;
+    return true;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile p of sorted v[0..n)
+static double percentile(const double *v, size_t n, double p)
+{
+    return n ? v[(size_t)(p * (double)(n - 1) + 0.5)] : 0.0;
+}
+
+// Wait for the oldest query in flight, write it and free its slot
+static bool write_oldest(Batch *b, FILE *out, Latencies *lat, BatchStats *st)
+{
+    Slot *s = &b->slots[b->head];
+
+    pthread_mutex_lock(&b->lock);
+    while (!s->done) pthread_cond_wait(&b->done, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+
+    bool ok = s->len == 0 || fwrite(s->text, 1, s->len, out) == s->len;
+    if (!ok) perror("batch_run: fwrite");
+    if (!s->ok) st->failed++;
+    ok = lat_push(lat, s->ms) && ok;
+
+    free(s->text);
+    free(s->query);
+    b->head = (b->head + 1) % BATCH_WINDOW;
+    b->n--;
+    return ok;
+}
+
+bool batch_run(ThreadPool *pool, HashMap *m, const CensoredSet *censored,
+               QueryCache *cache, FILE *in, FILE *out, BatchStats *st)
+{
+    *st = (BatchStats){ 0 };
+    Batch *b = calloc(1, sizeof(*b));
+    if (!b) {
+        perror("batch_run: calloc");
+        return false;
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->done, NULL);
+    b->m        = m;
+    b->censored = censored;
+    b->cache    = cache;
+
+    size_t hits0 = 0, misses = 0;
+    if (cache) qc_counts(cache, &hits0, &misses);
+
+    Latencies lat  = { 0 };
+    char     *line = NULL;
+    size_t    cap  = 0;
+    bool      ok   = true;
+    double    t0   = now_ms();
+
+    while (ok && getline(&line, &cap, in) >= 0) {
+        trim_nl(line);
+        char *q = line;
+        while (*q == ' ' || *q == '\t') q++;
+        if (strncmp(q, "_search_ ", 9) == 0) q += 9;
+        if (!*q || *q == '#') continue;
+
+        /* a full window waits for its oldest query, keeping output in order */
+        if (b->n == BATCH_WINDOW && !write_oldest(b, out, &lat, st)) {
+            ok = false;
+            break;
+        }
+        Slot *s = &b->slots[(b->head + b->n) % BATCH_WINDOW];
+        *s = (Slot){ .b = b, .query = strdup(q) };
+        if (!s->query) {
+            perror("batch_run: strdup");
+            ok = false;
+            break;
+        }
+        b->n++;
+        st->queries++;
+        tp_run(pool, run_slot, s);
+    }
+    if (ferror(in)) {
+        perror("batch_run: getline");
+        ok = false;
+    }
+    while (b->n) ok = write_oldest(b, out, &lat, st) && ok;
+    if (fflush(out) != 0) ok = false;
+    st->seconds = (now_ms() - t0) / 1e3;
+
+    if (cache) {
+        size_t hits = 0;
+        qc_counts(cache, &hits, &misses);
+        st->cache_hits = hits - hits0;
+    }
+    if (lat.n) {
+        qsort(lat.v, lat.n, sizeof(*lat.v), cmp_double);
+        st->p50_ms = percentile(lat.v, lat.n, 0.50);
+        st->p95_ms = percentile(lat.v, lat.n, 0.95);
+        st->p99_ms = percentile(lat.v, lat.n, 0.99);
+        st->max_ms = lat.v[lat.n - 1];
+    }
+
+    free(lat.v);
+    free(line);
+    pthread_cond_destroy(&b->done);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+    return ok;
+}
+
+void batch_print_stats(FILE *f, const BatchStats *st)
+{
+    double qps = st->seconds > 0 ? (double)st->queries / st->seconds : 0.0;
+    fprintf(f, "\n" BOLD "Batch:" RESET " %zu quer%s (%zu failed) in %.3f s"
+            " — %.1f queries/s\n", st->queries,
+            st->queries == 1 ? "y" : "ies", st->failed, st->seconds, qps);
+    fprintf(f, BOLD "Latency:" RESET " p50 %.3f ms, p95 %.3f ms, p99 %.3f ms,"
+            " max %.3f ms; %zu cache hit%s\n\n", st->p50_ms, st->p95_ms,
+            st->p99_ms, st->max_ms, st->cache_hits,
+            st->cache_hits == 1 ? "" : "s");
+}
@@ -0,0 +1,182 @@
+#define _POSIX_C_SOURCE 200809L  // for sched_yield
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "epoch.h"
+
+// One record per thread that has ever entered; recycled after thread exit.
+typedef struct EpochRec {
+    atomic_uint_fast64_t  local;    // announced epoch, 0 ⇒ quiescent
+    atomic_bool           in_use;
+    struct EpochRec      *next;
+} EpochRec;
+
+typedef struct Retired {
+    void            *p;
+    void           (*free_fn)(void *);
+    uint64_t         epoch;         // global epoch when it was retired
+    struct Retired  *next;
+} Retired;
+
+static atomic_uint_fast64_t g_epoch = 1;
+static EpochRec *_Atomic    g_recs  = NULL;
+
+static pthread_mutex_t      retired_mtx = PTHREAD_MUTEX_INITIALIZER;
+static Retired             *retired     = NULL;
+static atomic_size_t        n_retired   = 0;  // pending, checked on exit
+static atomic_uint_fast64_t collected   = 0;  // epoch of the last scan
+
+static pthread_once_t       key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t        rec_key;
+
+static _Thread_local EpochRec *tl_rec;
+static _Thread_local unsigned  tl_depth;
+
+static void release_rec(void *arg)
+{
+    EpochRec *r = arg;
+    atomic_store(&r->local, 0);
+    atomic_store(&r->in_use, false);
+}
+
+static void make_key(void) { pthread_key_create(&rec_key, release_rec); }
+
+static EpochRec *my_rec(void)
+{
+    if (tl_rec) return tl_rec;
+
+    /* reuse a record freed by an exited thread, or push a new one */
+    EpochRec *r;
+    for (r = atomic_load(&g_recs); r; r = r->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, true)) break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r) {
+            perror("epoch: calloc");
+            exit(EXIT_FAILURE);
+        }
+        atomic_init(&r->in_use, true);
+        r->next = atomic_load(&g_recs);
+        while (!atomic_compare_exchange_weak(&g_recs, &r->next, r)) { }
+    }
+
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(rec_key, r);
+    tl_rec = r;
+    return r;
+}
+
+void epoch_enter(void)
+{
+    if (tl_depth++) return;
+    EpochRec *r = my_rec();
+    uint64_t e = atomic_load(&g_epoch);
+    for (;;) {
+        atomic_store(&r->local, e);               // seq_cst: announce first
+        uint64_t now = atomic_load(&g_epoch);
+        if (now == e) break;
+        e = now;
+    }
+}
+
+static bool try_advance(void);
+static bool collect(void);
+
+void epoch_exit(void)
+{
+    if (--tl_depth) return;
+    atomic_store_explicit(&tl_rec->local, 0, memory_order_release);
+
+    /* retirements made inside critical sections are reclaimed here */
+    if (atomic_load_explicit(&n_retired, memory_order_relaxed)) {
+        try_advance();
+        collect();
+    }
+}
+
+// Move the global epoch forward if every active thread has caught up.
+static bool try_advance(void)
+{
+    uint64_t e = atomic_load(&g_epoch);
+    for (EpochRec *r = atomic_load(&g_recs); r; r = r->next) {
+        uint64_t l = atomic_load(&r->local);
+        if (l && l != e) return false;
+    }
+    return atomic_compare_exchange_strong(&g_epoch, &e, e + 1);
+}
+
+// Detach and free everything retired at least two epochs ago.  Nothing
+// becomes safe until the epoch moves, so the list is scanned once per
+// epoch, not on every exit.
+static bool collect(void)
+{
+    uint64_t e = atomic_load(&g_epoch);
+    Retired *ready = NULL;
+
+    if (atomic_exchange(&collected, e) == e) {
+        return atomic_load(&n_retired) == 0;
+    }
+
+    pthread_mutex_lock(&retired_mtx);
+    for (Retired **pp = &retired; *pp; ) {
+        Retired *n = *pp;
+        if (n->epoch + 2 <= e) {
+            *pp     = n->next;
+            n->next = ready;
+            ready   = n;
+        } else {
+            pp = &n->next;
+        }
+    }
+    bool empty = retired == NULL;
+    pthread_mutex_unlock(&retired_mtx);
+
+    while (ready) {
+        Retired *next = ready->next;
+        ready->free_fn(ready->p);
+        free(ready);
+        atomic_fetch_sub(&n_retired, 1);
+        ready = next;
+    }
+    return empty;
+}
+
+void epoch_retire(void *p, void (*free_fn)(void *))
+{
+    Retired *n = malloc(sizeof(*n));
+    if (!n) {
+        /* cannot defer it safely: leak rather than free under readers */
+        perror("epoch_retire: malloc");
+        return;
+    }
+    n->p       = p;
+    n->free_fn = free_fn;
+    n->epoch   = atomic_load(&g_epoch);
+
+    pthread_mutex_lock(&retired_mtx);
+    n->next = retired;
+    retired = n;
+    pthread_mutex_unlock(&retired_mtx);
+    atomic_fetch_add(&n_retired, 1);
+
+    if (tl_depth == 0) {
+        try_advance();
+        collect();
+    }
+}
+
+void epoch_barrier(void)
+{
+    for (;;) {
+        try_advance();
+        if (collect()) return;
+        sched_yield();
+    }
+}
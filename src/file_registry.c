@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200809L  // for strdup
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_registry.h"
+#include "hash.h"
+#include "mem.h"
+
+#define FR_INITIAL_SLOTS 64   // power of two
+
+void fr_init(FileRegistry *r)
+{
+    for (size_t i = 0; i < FR_MAX_PAGES; i++) {
+        atomic_init(&r->pages[i], NULL);
+    }
+    atomic_init(&r->n, 0);
+    r->cap   = FR_INITIAL_SLOTS;
+    r->slots = calloc(r->cap, sizeof(*r->slots));
+    if (!r->slots) {
+        perror("fr_init: calloc");
+        exit(EXIT_FAILURE);
+    }
+    mem_add(MEM_REGISTRY, (int64_t)(r->cap * sizeof(*r->slots)));
+    pthread_mutex_init(&r->lock, NULL);
+}
+
+void fr_destroy(FileRegistry *r)
+{
+    uint32_t n = atomic_load(&r->n);
+    size_t   bytes = r->cap * sizeof(*r->slots);
+    for (uint32_t id = 0; id < n; id++) {
+        bytes += strlen(fr_get(r, id)->path) + 1;
+        free(fr_get(r, id)->path);
+    }
+    for (size_t i = 0; i < FR_MAX_PAGES; i++) {
+        FileInfo *page = atomic_load(&r->pages[i]);
+        if (page) bytes += FR_PAGE_SIZE * sizeof(*page);
+        free(page);
+    }
+    free(r->slots);
+    mem_add(MEM_REGISTRY, -(int64_t)bytes);
+    pthread_mutex_destroy(&r->lock);
+}
+
+FileInfo *fr_get(FileRegistry *r, uint32_t id)
+{
+    if (id >= atomic_load_explicit(&r->n, memory_order_acquire)) return NULL;
+    FileInfo *page = atomic_load_explicit(&r->pages[id / FR_PAGE_SIZE],
+                                          memory_order_acquire);
+    return &page[id % FR_PAGE_SIZE];
+}
+
+const char *fr_path(FileRegistry *r, uint32_t id)
+{
+    FileInfo *fi = fr_get(r, id);
+    return fi ? fi->path : NULL;
+}
+
+uint32_t fr_count(FileRegistry *r)
+{
+    return atomic_load(&r->n);
+}
+
+// Probe for `path`; returns its slot index (occupied or the empty slot
+// where it would go).  Caller holds r->lock.
+static size_t probe_locked(FileRegistry *r, const char *path, uint64_t h)
+{
+    size_t i = h & (r->cap - 1);
+    for (;; i = (i + 1) & (r->cap - 1)) {
+        uint32_t s = r->slots[i];
+        if (!s) return i;
+        FileInfo *fi = fr_get(r, s - 1);
+        if (fi->hash == h && strcmp(fi->path, path) == 0) return i;
+    }
+}
+
+static bool grow_locked(FileRegistry *r)
+{
+    size_t    new_cap = r->cap * 2;
+    uint32_t *slots   = calloc(new_cap, sizeof(*slots));
+    if (!slots) {
+        perror("fr_intern: calloc slots");
+        return false;
+    }
+    uint32_t n = atomic_load(&r->n);
+    for (uint32_t id = 0; id < n; id++) {
+        size_t i = fr_get(r, id)->hash & (new_cap - 1);
+        while (slots[i]) i = (i + 1) & (new_cap - 1);
+        slots[i] = id + 1;
+    }
+    free(r->slots);
+    mem_add(MEM_REGISTRY, (int64_t)((new_cap - r->cap) * sizeof(*slots)));
+    r->slots = slots;
+    r->cap   = new_cap;
+    return true;
+}
+
+bool fr_lookup(FileRegistry *r, const char *path, uint32_t *id)
+{
+    uint64_t h = fnv1a(path);
+    pthread_mutex_lock(&r->lock);
+    uint32_t s = r->slots[probe_locked(r, path, h)];
+    pthread_mutex_unlock(&r->lock);
+    if (s && id) *id = s - 1;
+    return s != 0;
+}
+
+bool fr_intern(FileRegistry *r, const char *path,
+               uint32_t *id, bool *created)
+{
+    uint64_t h = fnv1a(path);
+    pthread_mutex_lock(&r->lock);
+
+    size_t i = probe_locked(r, path, h);
+    if (r->slots[i]) {
+        *id = r->slots[i] - 1;
+        if (created) *created = false;
+        pthread_mutex_unlock(&r->lock);
+        return true;
+    }
+
+    uint32_t n = atomic_load(&r->n);
+    if (n == (uint32_t)FR_PAGE_SIZE * FR_MAX_PAGES) {
+        fprintf(stderr, "fr_intern: file registry full\n");
+        pthread_mutex_unlock(&r->lock);
+        return false;
+    }
+
+    /* make room: a bigger probe table, a fresh page for the record */
+    if (2 * (size_t)(n + 1) > r->cap) {
+        if (!grow_locked(r)) {
+            pthread_mutex_unlock(&r->lock);
+            return false;
+        }
+        i = probe_locked(r, path, h);
+    }
+    FileInfo *page = atomic_load(&r->pages[n / FR_PAGE_SIZE]);
+    if (!page) {
+        page = calloc(FR_PAGE_SIZE, sizeof(*page));
+        if (!page) {
+            perror("fr_intern: calloc page");
+            pthread_mutex_unlock(&r->lock);
+            return false;
+        }
+        mem_add(MEM_REGISTRY, (int64_t)(FR_PAGE_SIZE * sizeof(*page)));
+        atomic_store_explicit(&r->pages[n / FR_PAGE_SIZE], page,
+                              memory_order_release);
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        perror("fr_intern: strdup");
+        pthread_mutex_unlock(&r->lock);
+        return false;
+    }
+    mem_add(MEM_REGISTRY, (int64_t)(strlen(copy) + 1));
+    FileInfo *fi = &page[n % FR_PAGE_SIZE];
+    fi->path = copy;
+    fi->hash = h;
+    atomic_init(&fi->state, FR_PENDING);
+    atomic_init(&fi->content, 0);
+    atomic_init(&fi->words, 0);
+    atomic_init(&fi->terms, NULL);
+    atomic_init(&fi->unfolded, NULL);
+    atomic_init(&fi->dropped, false);
+    atomic_init(&fi->seg, 0);
+    atomic_store_explicit(&r->n, n + 1, memory_order_release);
+    r->slots[i] = n + 1;
+
+    *id = n;
+    if (created) *created = true;
+    pthread_mutex_unlock(&r->lock);
+    return true;
+}
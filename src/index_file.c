@@ -0,0 +1,1049 @@
+#define _POSIX_C_SOURCE 200809L  // for strdup, posix_madvise, mkstemp
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "index_file.h"
+#include "config.h"
+#include "epoch.h"
+#include "segment.h"
+#include "mem.h"
+
+// ------- Saving -------
+
+// Growable array of `size`-byte records, charged to MEM_WRITER
+typedef struct {
+    void   *p;
+    size_t  n, cap;
+} IxVec;
+
+static void *vec_push(IxVec *v, size_t size, size_t k)
+{
+    if (v->n + k > v->cap) {
+        size_t new_cap = v->cap ? v->cap : 256;
+        while (new_cap < v->n + k) new_cap *= 2;
+        void *tmp = realloc(v->p, new_cap * size);
+        if (!tmp) {
+            perror("ix_save: realloc");
+            return NULL;
+        }
+        mem_add(MEM_WRITER, (int64_t)((new_cap - v->cap) * size));
+        v->p   = tmp;
+        v->cap = new_cap;
+    }
+    void *slot = (char *)v->p + v->n * size;
+    v->n += k;
+    return slot;
+}
+
+static void vec_free(IxVec *v, size_t size)
+{
+    mem_add(MEM_WRITER, -(int64_t)(v->cap * size));
+    free(v->p);
+    *v = (IxVec){ 0 };
+}
+
+// The in-memory segments' sentences, found by walking their postings:
+// where each context went in texts[].  They are sorted by (file,
+// sentence) before being written, so a file's sentences go out together.
+typedef struct {
+    const char *ctx;
+    uint32_t    file_id;
+    uint64_t    sent;
+    uint64_t    off;        // in texts[], once written
+} Sent;
+
+typedef struct {
+    IxVec     v;            // Sent
+    uint32_t *slots;        // index + 1 into v, by context address
+    size_t    cap;          // power of two
+} SentTable;
+
+static inline size_t ptr_hash(const char *p)
+{
+    uint64_t x = (uint64_t)(uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (size_t)x;
+}
+
+// Index v afresh into cap slots
+static bool sents_rehash(SentTable *t, size_t cap)
+{
+    uint32_t *slots = calloc(cap, sizeof(*slots));
+    if (!slots) {
+        perror("ix_save: calloc sentences");
+        return false;
+    }
+    const Sent *v = t->v.p;
+    for (size_t k = 0; k < t->v.n; k++) {
+        size_t i = ptr_hash(v[k].ctx) & (cap - 1);
+        while (slots[i]) i = (i + 1) & (cap - 1);
+        slots[i] = (uint32_t)(k + 1);
+    }
+    mem_add(MEM_WRITER, ((int64_t)cap - (int64_t)t->cap) * (int64_t)sizeof(*slots));
+    free(t->slots);
+    t->slots = slots;
+    t->cap   = cap;
+    return true;
+}
+
+static Sent *sents_find(const SentTable *t, const char *ctx)
+{
+    Sent *v = t->v.p;
+    for (size_t i = t->cap ? ptr_hash(ctx) & (t->cap - 1) : 0;
+         t->cap && t->slots[i]; i = (i + 1) & (t->cap - 1)) {
+        if (v[t->slots[i] - 1].ctx == ctx) return &v[t->slots[i] - 1];
+    }
+    return NULL;
+}
+
+// Add o's sentence unless it is there already
+static bool sents_add(SentTable *t, const WordOccurrence *o)
+{
+    if (sents_find(t, o->context)) return true;
+    if (t->v.n == UINT32_MAX - 1) {
+        fprintf(stderr, "ix_save: too many sentences\n");
+        return false;
+    }
+    if (2 * (t->v.n + 1) > t->cap && !sents_rehash(t, t->cap ? 2 * t->cap : 4096))
+        return false;
+    Sent *e = vec_push(&t->v, sizeof(*e), 1);
+    if (!e) return false;
+    *e = (Sent){ .ctx = o->context, .file_id = o->file_id, .sent = o->sent };
+
+    size_t i = ptr_hash(o->context) & (t->cap - 1);
+    while (t->slots[i]) i = (i + 1) & (t->cap - 1);
+    t->slots[i] = (uint32_t)t->v.n;
+    return true;
+}
+
+static int cmp_sents(const void *a, const void *b)
+{
+    const Sent *x = a, *y = b;
+    if (x->file_id != y->file_id) return x->file_id < y->file_id ? -1 : 1;
+    if (x->sent != y->sent) return x->sent < y->sent ? -1 : 1;
+    return (x->ctx > y->ctx) - (x->ctx < y->ctx);
+}
+
+// The snapshot holding a file's postings (in-memory segments' files are
+// known by their sentences), and how far its sentences moved
+typedef struct {
+    int32_t  snap;          // index in the set, -1 ⇒ none
+    uint32_t id;            // its file ID there
+    int64_t  shift;         // offset in the new texts[] minus the old
+} Owner;
+
+// A section produced while another one is being written: it collects in
+// a scratch file next to the index (unlinked at once) and is copied into
+// place at the end
+typedef struct {
+    FILE    *f;
+    uint64_t n;             // bytes
+} Spill;
+
+// One source's postings of the current term, translated for the new
+// file: map file IDs, contexts as offsets into its texts[]
+typedef struct {
+    int32_t         snap;   // snapshot index, -1 ⇒ in-memory segment
+    PostingView     pv;
+    IxView          iv;
+    size_t          b;      // next block to decode
+    WordOccurrence *buf;    // postings [i, n) still to go
+    size_t          i, n;
+    IxVec           all;    // a loaded index file's, sorted
+} Stream;
+
+typedef struct {
+    const SegSet   *ss;
+    bool            segment;
+    bool            failed;     // an error was reported: give up
+    FILE           *out;
+    uint64_t        pos;        // bytes written to out
+    IxHeader        h;
+    Spill           files, terms, blocks, words;
+    uint32_t        n_files;
+    Owner          *owner;      // [n_files]
+    IxVec          *mem_words;  // each in-memory segment's, in byte order
+    SentTable       sents;
+    WordOccurrence  blk[POSTING_BLOCK];  // block being filled
+    size_t          nb;
+    IxVec           bytes;      // its encoding
+    uint64_t        term_n;     // postings of the current term so far
+} Writer;
+
+static inline size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+static void put(Writer *w, const void *p, size_t len)
+{
+    if (w->failed || !len) return;
+    if (fwrite(p, 1, len, w->out) != len) {
+        perror("ix_save: write");
+        w->failed = true;
+        return;
+    }
+    w->pos += len;
+}
+
+// Zero padding up to an 8-byte boundary
+static void pad8(Writer *w)
+{
+    static const char pad[8];
+    put(w, pad, align8(w->pos) - w->pos);
+}
+
+static bool spill_open(Spill *s, const char *near)
+{
+    size_t len  = strlen(near);
+    char  *name = malloc(len + sizeof ".XXXXXX");
+    int    fd   = -1;
+    if (name) {
+        memcpy(name, near, len);
+        memcpy(name + len, ".XXXXXX", sizeof ".XXXXXX");
+        if ((fd = mkstemp(name)) >= 0) unlink(name);
+    }
+    free(name);
+    if (fd < 0 || !(s->f = fdopen(fd, "w+b"))) {
+        perror("ix_save: scratch file");
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    s->n = 0;
+    return true;
+}
+
+static void spill_put(Writer *w, Spill *s, const void *p, size_t len)
+{
+    if (w->failed) return;
+    if (fwrite(p, 1, len, s->f) != len) {
+        perror("ix_save: write scratch file");
+        w->failed = true;
+        return;
+    }
+    s->n += len;
+}
+
+// Copy s to the end of the index file as the section at *off
+static void spill_copy(Writer *w, Spill *s, uint64_t *off)
+{
+    char buf[1 << 16];
+    pad8(w);
+    *off = w->pos;
+    if (w->failed) return;
+    if (fflush(s->f) != 0 || fseek(s->f, 0, SEEK_SET) != 0) {
+        perror("ix_save: rewind scratch file");
+        w->failed = true;
+        return;
+    }
+    for (uint64_t left = s->n; left && !w->failed; ) {
+        size_t chunk = left < sizeof buf ? (size_t)left : sizeof buf;
+        if (fread(buf, 1, chunk, s->f) != chunk) {
+            perror("ix_save: read scratch file");
+            w->failed = true;
+            return;
+        }
+        put(w, buf, chunk);
+        left -= chunk;
+    }
+}
+
+static void collect_word(const char *word, void *arg)
+{
+    const char **slot = vec_push(arg, sizeof(*slot), 1);
+    if (slot) *slot = word;
+}
+
+// Every sentence the in-memory segments' postings point to, sorted
+static void collect_sentences(Writer *w)
+{
+    WordOccurrence *buf = malloc(POSTING_BLOCK * sizeof(*buf));
+    if (!buf) {
+        perror("ix_save: malloc");
+        w->failed = true;
+        return;
+    }
+    for (size_t k = 0; !w->failed && k < w->ss->n_mem; k++) {
+        const char **wv = w->mem_words[k].p;
+        for (size_t i = 0; !w->failed && i < w->mem_words[k].n; i++) {
+            PostingView v;
+            epoch_enter();
+            seg_postings(w->ss->mem[k], wv[i], &v);
+            for (size_t b = 0; !w->failed && b < v.n_blocks; b++) {
+                size_t n = pv_decode_block(&v, b, buf);
+                for (size_t j = 0; j < n; j++) {
+                    if (buf[j].file_id < w->n_files && !sents_add(&w->sents, &buf[j])) {
+                        w->failed = true;
+                        break;
+                    }
+                }
+            }
+            epoch_exit();
+        }
+    }
+    free(buf);
+
+    /* sorting moves them: index them again */
+    if (!w->failed && w->sents.v.n) {
+        qsort(w->sents.v.p, w->sents.v.n, sizeof(Sent), cmp_sents);
+        w->failed = !sents_rehash(&w->sents, w->sents.cap);
+    }
+}
+
+// The file table and texts[]: each file's path, then its sentences, from
+// the in-memory segments or copied from the snapshot holding it
+static void write_files(Writer *w, HashMap *m)
+{
+    const SegSet *ss = w->ss;
+    if (w->failed) return;
+    for (uint32_t id = 0; id < w->n_files; id++) w->owner[id] = (Owner){ .snap = -1 };
+    for (size_t k = 0; k < ss->n_snap; k++) {
+        const IndexSnapshot *s = ss->snap[k];
+        for (uint32_t sid = 0; sid < s->hdr->n_files; sid++) {
+            /* a segment lists every file; only those with text are its own */
+            uint32_t mid = ix_file(s, sid);
+            if (mid < w->n_files && s->files[sid].text_len)
+                w->owner[mid] = (Owner){ .snap = (int32_t)k, .id = sid };
+        }
+    }
+
+    /* offset 0 is the empty string */
+    w->h.texts_off = w->pos;
+    put(w, "", 1);
+
+    Sent  *sv = w->sents.v.p;
+    size_t si = 0;
+    for (uint32_t id = 0; id < w->n_files && !w->failed; id++) {
+        IxFile fi = { .mtime_ns = -1 };
+        if (!w->segment) {              // a segment's IDs are the map's own
+            FileInfo *info = fr_get(&m->files, id);
+            fi.path = w->pos - w->h.texts_off;
+            put(w, info->path, strlen(info->path) + 1);
+            /* files still being indexed are saved without a version, so
+             * the next _index_ of them after a load re-indexes them */
+            bool done = atomic_load_explicit(&info->state, memory_order_acquire)
+                        == FR_INDEXED;
+            fi.size     = done ? info->size : 0;
+            fi.mtime_ns = done ? info->mtime_ns : -1;
+            fi.content  = done ? atomic_load(&info->content) : 0;
+            fi.words    = atomic_load(&info->words);
+        }
+
+        fi.text = w->pos - w->h.texts_off;
+        for (; si < w->sents.v.n && sv[si].file_id == id; si++) {
+            sv[si].off = w->pos - w->h.texts_off;
+            put(w, sv[si].ctx, strlen(sv[si].ctx) + 1);
+        }
+        Owner *o = &w->owner[id];
+        if (o->snap >= 0) {
+            const IndexSnapshot *s  = ss->snap[o->snap];
+            const IxFile        *sf = &s->files[o->id];
+            uint64_t             nt = s->hdr->n_text_bytes;
+            if (sf->text <= nt && sf->text_len <= nt - sf->text &&
+                (!sf->text_len || s->texts[sf->text + sf->text_len - 1] == '\0')) {
+                o->shift = (int64_t)(w->pos - w->h.texts_off) - (int64_t)sf->text;
+                put(w, s->texts + sf->text, sf->text_len);
+            } else {
+                o->snap = -1;           // damaged: its postings are dropped
+            }
+        }
+        fi.text_len = w->pos - w->h.texts_off - fi.text;
+        spill_put(w, &w->files, &fi, sizeof fi);
+    }
+    w->h.n_text_bytes = w->pos - w->h.texts_off;
+}
+
+// Make o, from the in-memory segments (snap < 0) or snapshot `snap`, a
+// posting of the new file; false if it has no place there
+static bool translate(Writer *w, int32_t snap, WordOccurrence *o)
+{
+    if (snap < 0) {
+        /* a sentence added since they were collected is left out */
+        const Sent *e = sents_find(&w->sents, o->context);
+        if (!e) return false;
+        o->context = (char *)(uintptr_t)e->off;
+        return true;
+    }
+    const IndexSnapshot *s   = w->ss->snap[snap];
+    uint32_t             mid = ix_file(s, o->file_id);
+    if (mid >= w->n_files || !o->context) return false;
+    const Owner *own = &w->owner[mid];
+    if (own->snap != snap || own->id != o->file_id) return false;
+
+    const IxFile *sf  = &s->files[o->file_id];
+    uint64_t      off = (uint64_t)(o->context - s->texts);
+    if (off < sf->text || off - sf->text >= sf->text_len) return false;
+    o->context = (char *)(uintptr_t)(off + (uint64_t)own->shift);
+    o->file_id = mid;
+    return true;
+}
+
+static inline bool key_less(const WordOccurrence *x, const WordOccurrence *y)
+{
+    return x->file_id != y->file_id ? x->file_id < y->file_id : x->sent < y->sent;
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+    const WordOccurrence *x = a, *y = b;
+    return key_less(x, y) ? -1 : key_less(y, x);
+}
+
+static const char *term_word(const IndexSnapshot *s, const IxTerm *t);
+static bool        term_view(const IndexSnapshot *s, const IxTerm *t, IxView *v);
+
+// Start st on the postings of source k's term t (snapshots) or word
+static bool stream_open(Writer *w, Stream *st, size_t k, const char *word,
+                        const IxTerm *t)
+{
+    const SegSet *ss = w->ss;
+    st->b = st->i = st->n = 0;
+    if (k < ss->n_mem) {
+        st->snap = -1;
+        seg_postings(ss->mem[k], word, &st->pv);
+        return true;
+    }
+    st->snap = (int32_t)(k - ss->n_mem);
+    const IndexSnapshot *s = ss->snap[st->snap];
+    if (!term_view(s, t, &st->iv)) st->iv = (IxView){ 0 };
+    if (s->segment || !st->iv.n) return true;
+
+    /* a loaded file's IDs change order: the whole term, sorted */
+    st->all.n = 0;
+    WordOccurrence *all = vec_push(&st->all, sizeof(*all), st->iv.n);
+    if (!all) return false;
+    size_t kept = 0;
+    for (size_t b = 0; b < st->iv.n_blocks; b++) {
+        size_t from = kept, n = ixv_decode_block(&st->iv, b, all + from);
+        for (size_t j = 0; j < n; j++) {
+            WordOccurrence o = all[from + j];
+            if (translate(w, st->snap, &o)) all[kept++] = o;
+        }
+    }
+    qsort(all, kept, sizeof(*all), cmp_keys);
+    st->buf = all;
+    st->n   = kept;
+    st->b   = st->iv.n_blocks;
+    return true;
+}
+
+// The next posting of st, or NULL at its end
+static WordOccurrence *stream_peek(Writer *w, Stream *st, WordOccurrence *buf)
+{
+    while (st->i == st->n) {
+        size_t nb = st->snap < 0 ? st->pv.n_blocks : st->iv.n_blocks;
+        if (st->b == nb) return NULL;
+        size_t n = st->snap < 0 ? pv_decode_block(&st->pv, st->b, buf)
+                                : ixv_decode_block(&st->iv, st->b, buf);
+        st->buf = buf;
+        st->b++;
+        st->i = st->n = 0;
+        for (size_t j = 0; j < n; j++) {
+            if (translate(w, st->snap, &buf[j])) buf[st->n++] = buf[j];
+        }
+    }
+    return &st->buf[st->i];
+}
+
+// Write out the block being filled
+static void flush_block(Writer *w)
+{
+    if (!w->nb || w->failed) return;
+    if (w->term_n + w->nb > UINT32_MAX) {
+        fprintf(stderr, "ix_save: too many postings for one term\n");
+        w->failed = true;
+        return;
+    }
+    size_t size = pl_block_size(w->blk, w->nb);
+    w->bytes.n = 0;
+    if (!vec_push(&w->bytes, 1, size)) {
+        w->failed = true;
+        return;
+    }
+    pl_block_encode(w->bytes.p, w->blk, w->nb);
+
+    IxBlock b = {
+        .file_id = w->blk[0].file_id,
+        .start   = (uint32_t)w->term_n,
+        .sent    = w->blk[0].sent,
+        .off     = w->pos - w->h.postings_off
+    };
+    spill_put(w, &w->blocks, &b, sizeof b);
+    put(w, w->bytes.p, size);
+    w->h.n_blocks++;
+    w->term_n += w->nb;
+    w->nb = 0;
+}
+
+// Merge the postings of `word` from sources k[0..n) into the new file.
+// Caller is inside an epoch.
+static void write_term(Writer *w, const char *word, const size_t *k,
+                       const IxTerm *const *t, size_t n, Stream *st,
+                       WordOccurrence *bufs)
+{
+    uint64_t first = w->h.n_blocks;
+    w->term_n = 0;
+    for (size_t j = 0; j < n && !w->failed; j++) {
+        w->failed = !stream_open(w, &st[j], k[j], word, t[j]);
+    }
+
+    /* the sources hold disjoint files: a merge by (file, sentence) */
+    while (!w->failed) {
+        WordOccurrence *best = NULL;
+        size_t          from = 0;
+        for (size_t j = 0; j < n; j++) {
+            WordOccurrence *o = stream_peek(w, &st[j], bufs + j * POSTING_BLOCK);
+            if (o && (!best || key_less(o, best))) {
+                best = o;
+                from = j;
+            }
+        }
+        if (!best) break;
+        w->blk[w->nb++] = *best;
+        st[from].i++;
+        if (w->nb == POSTING_BLOCK) flush_block(w);
+    }
+    flush_block(w);
+    if (!w->term_n || w->failed) return;
+
+    size_t len = strlen(word);
+    IxTerm term = {
+        .word       = w->words.n,
+        .first      = first,
+        .len        = (uint32_t)len,
+        .n_postings = (uint32_t)w->term_n
+    };
+    spill_put(w, &w->terms, &term, sizeof term);
+    spill_put(w, &w->words, word, len + 1);
+    w->h.n_terms++;
+}
+
+// The word under source k's cursor at[k], or NULL past its end
+static const char *cursor_word(Writer *w, size_t k, size_t *at,
+                               const IxTerm **t)
+{
+    const SegSet *ss = w->ss;
+    if (k < ss->n_mem) {
+        *t = NULL;
+        return at[k] < w->mem_words[k].n ? ((const char **)w->mem_words[k].p)[at[k]] : NULL;
+    }
+    const IndexSnapshot *s = ss->snap[k - ss->n_mem];
+    for (; at[k] < s->hdr->n_terms; at[k]++) {
+        const char *word = term_word(s, &s->terms[at[k]]);
+        *t = &s->terms[at[k]];
+        if (word) return word;          // a damaged one is skipped
+    }
+    return NULL;
+}
+
+// The term dictionary and postings: the sources' sorted dictionaries
+// merged, each term's postings written as they are merged
+static void write_terms(Writer *w)
+{
+    size_t          n_src = w->ss->n_mem + w->ss->n_snap;
+    size_t         *at    = calloc(n_src + 1, sizeof(*at));
+    size_t         *k     = calloc(n_src + 1, sizeof(*k));
+    const IxTerm  **t     = calloc(n_src + 1, sizeof(*t));
+    Stream         *st    = calloc(n_src + 1, sizeof(*st));
+    WordOccurrence *bufs  = malloc((n_src + 1) * POSTING_BLOCK * sizeof(*bufs));
+    size_t          charge = (n_src + 1) * POSTING_BLOCK * sizeof(*bufs);
+    if (!at || !k || !t || !st || !bufs) {
+        perror("ix_save: calloc");
+        w->failed = true;
+    }
+    if (bufs) mem_add(MEM_WRITER, (int64_t)charge);
+
+    while (!w->failed) {
+        const char   *word = NULL;
+        const IxTerm *tk;
+        for (size_t j = 0; j < n_src; j++) {
+            const char *wj = cursor_word(w, j, at, &tk);
+            if (wj && (!word || strcmp(wj, word) < 0)) word = wj;
+        }
+        if (!word) break;
+
+        size_t n = 0;
+        for (size_t j = 0; j < n_src; j++) {
+            const char *wj = cursor_word(w, j, at, &tk);
+            if (!wj || strcmp(wj, word) != 0) continue;
+            k[n]   = j;
+            t[n++] = tk;
+            at[j]++;
+        }
+        /* in-memory postings' position lists are read in the epoch */
+        epoch_enter();
+        write_term(w, word, k, t, n, st, bufs);
+        epoch_exit();
+    }
+
+    for (size_t j = 0; st && j < n_src; j++) vec_free(&st[j].all, sizeof(WordOccurrence));
+    if (bufs) mem_add(MEM_WRITER, -(int64_t)charge);
+    free(bufs);
+    free(st);
+    free((void *)t);
+    free(k);
+    free(at);
+}
+
+bool ix_save(HashMap *m, const char *path)
+{
+    /* the sources stay alive while we are in the epoch */
+    epoch_enter();
+    bool ok = ix_write(m, segments_acquire(m), path, false);
+    epoch_exit();
+    return ok;
+}
+
+bool ix_write(HashMap *m, const SegSet *ss, const char *path, bool segment)
+{
+    Writer *w   = calloc(1, sizeof(*w));
+    char   *tmp = malloc(strlen(path) + sizeof ".tmp");
+    IxVec  *mw  = calloc(ss->n_mem + 1, sizeof(*mw));
+    bool    ok  = false;
+    if (!w || !tmp || !mw) {
+        perror("ix_save: calloc");
+        goto out;
+    }
+    w->ss        = ss;
+    w->segment   = segment;
+    w->mem_words = mw;
+    w->n_files   = fr_count(&m->files);
+
+    /* write next to the target and rename, so a crash never leaves a
+     * half-written index under the real name */
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+    if (!(w->out = fopen(tmp, "wb"))) {
+        perror("ix_save: fopen");
+        goto out;
+    }
+    w->failed = !spill_open(&w->files, tmp)  || !spill_open(&w->terms, tmp) ||
+                !spill_open(&w->blocks, tmp) || !spill_open(&w->words, tmp);
+
+    size_t owners = ((size_t)w->n_files + 1) * sizeof(*w->owner);
+    if (!w->failed && !(w->owner = malloc(owners))) {
+        perror("ix_save: malloc");
+        w->failed = true;
+    }
+    if (w->owner) mem_add(MEM_WRITER, (int64_t)owners);
+
+    /* the in-memory segments' words in byte order, and their sentences */
+    for (size_t k = 0; !w->failed && k < ss->n_mem; k++) {
+        seg_for_each_prefix(ss->mem[k], "", 0, collect_word, &mw[k]);
+    }
+    if (!w->failed) collect_sentences(w);
+
+    /* the header is filled in once everything behind it is written */
+    put(w, &w->h, sizeof w->h);
+    pad8(w);
+    write_files(w, m);
+    pad8(w);
+    w->h.postings_off = w->pos;
+    write_terms(w);
+    w->h.n_posting_bytes = w->pos - w->h.postings_off;
+
+    spill_copy(w, &w->files,  &w->h.files_off);
+    spill_copy(w, &w->terms,  &w->h.terms_off);
+    spill_copy(w, &w->blocks, &w->h.blocks_off);
+    spill_copy(w, &w->words,  &w->h.words_off);
+    w->h.n_word_bytes = w->words.n;
+    w->h.size         = w->pos;
+    w->h.version      = IX_VERSION;
+    w->h.n_files      = w->n_files;
+    memcpy(w->h.magic, IX_MAGIC, sizeof w->h.magic);
+    if (!w->failed && (fseek(w->out, 0, SEEK_SET) != 0 ||
+                       fwrite(&w->h, sizeof w->h, 1, w->out) != 1 ||
+                       fflush(w->out) != 0 || fsync(fileno(w->out)) != 0)) {
+        perror("ix_save: write");
+        w->failed = true;
+    }
+    if (fclose(w->out) != 0 && !w->failed) {
+        perror("ix_save: fclose");
+        w->failed = true;
+    }
+    w->out = NULL;
+    if (!w->failed && rename(tmp, path) != 0) {
+        perror("ix_save: rename");
+        w->failed = true;
+    }
+    if (w->failed) unlink(tmp);
+    ok = !w->failed;
+
+out:
+    if (w) {
+        if (w->out) {
+            fclose(w->out);
+            unlink(tmp);
+        }
+        Spill *sp[] = { &w->files, &w->terms, &w->blocks, &w->words };
+        for (size_t i = 0; i < 4; i++) if (sp[i]->f) fclose(sp[i]->f);
+        if (w->owner) mem_add(MEM_WRITER, -(int64_t)(((size_t)w->n_files + 1) * sizeof(*w->owner)));
+        free(w->owner);
+        vec_free(&w->sents.v, sizeof(Sent));
+        mem_add(MEM_WRITER, -(int64_t)(w->sents.cap * sizeof(*w->sents.slots)));
+        free(w->sents.slots);
+        vec_free(&w->bytes, 1);
+    }
+    for (size_t k = 0; mw && k < ss->n_mem; k++) vec_free(&mw[k], sizeof(const char *));
+    free(mw);
+    free(tmp);
+    free(w);
+    return ok;
+}
+
+// ------- Loading -------
+
+// Does a section of n records of `size` bytes at `off` fit in the file?
+static bool section_ok(const IxHeader *h, uint64_t off, uint64_t n, size_t size)
+{
+    return off % 8 == 0 && off <= h->size && n <= (h->size - off) / size;
+}
+
+// Map and check the index file at `path`; the remap is left to the caller
+static IndexSnapshot *ix_map(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("ix_load: open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("ix_load: fstat");
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(IxHeader)) {
+        fprintf(stderr, "ix_load: %s: not an index file\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("ix_load: mmap");
+        return NULL;
+    }
+
+    const IxHeader *h = (const IxHeader *)base;
+    const char *why = NULL;
+    if (memcmp(h->magic, IX_MAGIC, sizeof h->magic) != 0) {
+        why = "not an index file";
+    } else if (h->version != IX_VERSION) {
+        why = "unsupported format version";
+    } else if (h->size != size ||
+               !section_ok(h, h->texts_off,    h->n_text_bytes,    1)               ||
+               !section_ok(h, h->postings_off, h->n_posting_bytes, 1)               ||
+               !section_ok(h, h->files_off,    h->n_files,         sizeof(IxFile))  ||
+               !section_ok(h, h->terms_off,    h->n_terms,         sizeof(IxTerm))  ||
+               !section_ok(h, h->blocks_off,   h->n_blocks,        sizeof(IxBlock)) ||
+               !section_ok(h, h->words_off,    h->n_word_bytes,    1)               ||
+               /* strings end inside their areas */
+               !h->n_text_bytes || base[h->texts_off + h->n_text_bytes - 1] != '\0' ||
+               (h->n_word_bytes && base[h->words_off + h->n_word_bytes - 1] != '\0')) {
+        why = "truncated or corrupt";
+    }
+    if (why) {
+        fprintf(stderr, "ix_load: %s: %s\n", path, why);
+        munmap((void *)base, size);
+        return NULL;
+    }
+    /* lookups binary-search the dictionary and touch a few blocks */
+    posix_madvise((void *)base, size, POSIX_MADV_RANDOM);
+
+    IndexSnapshot *s = calloc(1, sizeof(*s));
+    _Atomic uint32_t *remap = malloc(((size_t)h->n_files + 1) * sizeof(*remap));
+    char          *copy  = strdup(path);
+    if (!s || !remap || !copy) {
+        perror("ix_load: calloc");
+        free(s);
+        free(remap);
+        free(copy);
+        munmap((void *)base, size);
+        return NULL;
+    }
+    *s = (IndexSnapshot){
+        .path     = copy,
+        .base     = base,
+        .size     = size,
+        .hdr      = h,
+        .texts    = base + h->texts_off,
+        .postings = (const uint8_t *)(base + h->postings_off),
+        .files    = (const IxFile *)(base + h->files_off),
+        .terms    = (const IxTerm *)(base + h->terms_off),
+        .blocks   = (const IxBlock *)(base + h->blocks_off),
+        .words    = base + h->words_off,
+        .remap    = remap
+    };
+    return s;
+}
+
+bool ix_load(HashMap *m, const char *path, uint32_t *n_files)
+{
+    IndexSnapshot *s = ix_map(path);
+    if (!s) return false;
+    const IxHeader *h = s->hdr;
+    _Atomic uint32_t *remap = s->remap;
+
+    // give the snapshot's files IDs in the map; known files stay live
+    uint32_t added = 0;
+    for (uint32_t id = 0; id < h->n_files; id++) {
+        uint64_t off = s->files[id].path;
+        bool     created = false;
+        uint32_t mid;
+        if (off >= h->n_text_bytes ||
+            !fr_intern(&m->files, s->texts + off, &mid, &created)) {
+            created = false;
+        }
+        if (created) {
+            /* the new record is ours: adopt the saved version */
+            FileInfo *fi = fr_get(&m->files, mid);
+            fi->size     = s->files[id].size;
+            fi->mtime_ns = s->files[id].mtime_ns;
+            atomic_store(&fi->content, s->files[id].content);
+            atomic_store(&fi->words, s->files[id].words);
+            atomic_store_explicit(&fi->state, FR_INDEXED, memory_order_release);
+        }
+        atomic_init(&remap[id], created ? mid : IX_SHADOWED);
+        added += created;
+    }
+
+    if (!segments_attach(m, s)) {
+        /* its new records stay, versionless: the next _index_ of them
+         * indexes them afresh */
+        for (uint32_t id = 0; id < h->n_files; id++) {
+            uint32_t mid = atomic_load(&remap[id]);
+            FileInfo *fi = mid == IX_SHADOWED ? NULL : fr_get(&m->files, mid);
+            if (fi) {
+                fi->size     = 0;
+                fi->mtime_ns = -1;
+            }
+        }
+        ix_close(s);
+        return false;
+    }
+    index_changed(m);
+
+    if (n_files) *n_files = added;
+    return true;
+}
+
+IndexSnapshot *ix_open_segment(const char *path)
+{
+    IndexSnapshot *s = ix_map(path);
+    if (!s) return NULL;
+    for (uint32_t id = 0; id < s->hdr->n_files; id++) atomic_init(&s->remap[id], id);
+    s->segment = true;
+    return s;
+}
+
+// ------- Lookup -------
+
+// Word of term t, or NULL if it lies outside the word area
+static const char *term_word(const IndexSnapshot *s, const IxTerm *t)
+{
+    uint64_t n = s->hdr->n_word_bytes;
+    if (t->word >= n || n - t->word <= t->len) return NULL;
+    return s->words + t->word;
+}
+
+// Where the bytes of block g of the file end
+static inline uint64_t block_bytes_end(const IndexSnapshot *s, uint64_t g)
+{
+    return g + 1 < s->hdr->n_blocks ? s->blocks[g + 1].off
+                                    : s->hdr->n_posting_bytes;
+}
+
+// View term t's blocks, checked once so decoding can trust their headers:
+// starts rising from 0 by at most POSTING_BLOCK up to its count, bytes in
+// order inside postings[]
+static bool term_view(const IndexSnapshot *s, const IxTerm *t, IxView *v)
+{
+    const IxHeader *h    = s->hdr;
+    uint64_t        last = t + 1 < s->terms + h->n_terms ? t[1].first : h->n_blocks;
+    if (t->first >= last || last > h->n_blocks) return false;
+
+    const IxBlock *b  = &s->blocks[t->first];
+    size_t         nb = (size_t)(last - t->first);
+    for (size_t i = 0; i < nb; i++) {
+        uint64_t next = i + 1 < nb ? b[i + 1].start : t->n_postings;
+        uint64_t end  = block_bytes_end(s, t->first + i);
+        if ((i == 0 && b[i].start != 0) || next <= b[i].start ||
+            next - b[i].start > POSTING_BLOCK || b[i].off > end ||
+            end > h->n_posting_bytes) return false;
+    }
+    *v = (IxView){ .snap = s, .blocks = b, .n_blocks = nb, .n = t->n_postings };
+    return true;
+}
+
+void ix_view(const IndexSnapshot *s, const char *word, size_t len, IxView *v)
+{
+    *v = (IxView){ .snap = s };
+
+    // binary search in byte order (shorter words first on a common prefix)
+    uint64_t lo = 0, hi = s->hdr->n_terms;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const IxTerm *c = &s->terms[mid];
+        const char   *w = term_word(s, c);
+        if (!w) return;
+        int cmp = strncmp(w, word, len);
+        if (cmp == 0) cmp = (c->len > len) - (c->len < len);
+        if (cmp == 0) {
+            if (!term_view(s, c, v)) *v = (IxView){ .snap = s };
+            return;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else         hi = mid;
+    }
+}
+
+void ix_for_each_prefix(const IndexSnapshot *s, const char *prefix,
+                        size_t len,
+                        void (*fn)(const char *word, const IxView *v,
+                                   void *arg),
+                        void *arg)
+{
+    // the matching terms are contiguous: find the first, then scan
+    uint64_t lo = 0, hi = s->hdr->n_terms;
+    while (lo < hi) {
+        uint64_t    mid = lo + (hi - lo) / 2;
+        const char *w   = term_word(s, &s->terms[mid]);
+        if (!w) return;
+        if (strncmp(w, prefix, len) < 0) lo = mid + 1;
+        else                             hi = mid;
+    }
+    for (; lo < s->hdr->n_terms; lo++) {
+        const IxTerm *t = &s->terms[lo];
+        const char   *w = term_word(s, t);
+        if (!w || strncmp(w, prefix, len) != 0) return;
+        IxView v;
+        if (term_view(s, t, &v)) fn(w, &v, arg);
+    }
+}
+
+size_t ixv_block_start(const IxView *v, size_t b)
+{
+    return v->blocks[b].start;
+}
+
+size_t ixv_block_end(const IxView *v, size_t b)
+{
+    return b + 1 == v->n_blocks ? v->n : v->blocks[b + 1].start;
+}
+
+size_t ixv_block_of(const IxView *v, size_t i)
+{
+    size_t lo = 0, hi = v->n_blocks;        // the answer is in [lo, hi)
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (v->blocks[mid].start <= i) lo = mid;
+        else                           hi = mid;
+    }
+    return lo;
+}
+
+// Does block b start at or before (f, s)?
+static inline bool starts_by(const IxView *v, size_t b, uint32_t f,
+                             uint64_t s)
+{
+    const IxBlock *blk = &v->blocks[b];
+    return blk->file_id < f || (blk->file_id == f && blk->sent <= s);
+}
+
+size_t ixv_find_block(const IxView *v, size_t from, uint32_t file_id,
+                      uint64_t sent)
+{
+    if (from + 1 >= v->n_blocks) return from;
+
+    size_t lo = from, hi = from + 1, step = 1;
+    while (hi < v->n_blocks && starts_by(v, hi, file_id, sent)) {
+        lo    = hi;
+        hi   += step;
+        step *= 2;
+    }
+    if (hi > v->n_blocks) hi = v->n_blocks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (starts_by(v, mid, file_id, sent)) lo = mid;
+        else                                  hi = mid;
+    }
+    return lo;
+}
+
+size_t ixv_decode_block(const IxView *v, size_t b, WordOccurrence *out)
+{
+    const IndexSnapshot *s   = v->snap;
+    const IxBlock       *blk = &v->blocks[b];
+    size_t               n   = ixv_block_end(v, b) - blk->start;
+    const uint8_t       *end = s->postings +
+                               block_bytes_end(s, (uint64_t)(blk - s->blocks));
+    size_t got = pl_block_decode(s->postings + blk->off, end, blk->file_id,
+                                 blk->sent, n, out);
+
+    /* contexts were written as offsets into texts[] */
+    for (size_t i = 0; i < got; i++) {
+        uint64_t off = (uint64_t)(uintptr_t)out[i].context;
+        out[i].context = off < s->hdr->n_text_bytes ? (char *)s->texts + off
+                                                    : NULL;
+    }
+    /* damaged: the rest keep their place, without context or positions */
+    for (size_t i = got; i < n; i++) {
+        out[i] = (WordOccurrence){
+            .file_id = i ? out[i - 1].file_id : blk->file_id,
+            .sent    = i ? out[i - 1].sent    : blk->sent
+        };
+    }
+    return n;
+}
+
+size_t ix_occurrences(const IxView *v, WordOccurrence *out)
+{
+    size_t n = 0;
+    for (size_t b = 0; b < v->n_blocks; b++) {
+        size_t from = n, got = ixv_decode_block(v, b, out + from);
+        for (size_t i = 0; i < got; i++) {
+            WordOccurrence o   = out[from + i];
+            uint32_t       fid = ix_file(v->snap, o.file_id);
+            if (fid == IX_SHADOWED || !o.context) continue;
+            o.file_id = fid;
+            out[n++]  = o;
+        }
+    }
+    return n;
+}
+
+uint32_t ix_file(const IndexSnapshot *s, uint32_t snap_id)
+{
+    if (snap_id >= s->hdr->n_files) return IX_SHADOWED;
+    return atomic_load_explicit(&s->remap[snap_id], memory_order_relaxed);
+}
+
+void ix_shadow_file(IndexSnapshot *s, uint32_t file_id)
+{
+    if (s->segment) {                   // identity remap
+        if (file_id < s->hdr->n_files)
+            atomic_store_explicit(&s->remap[file_id], IX_SHADOWED, memory_order_relaxed);
+        return;
+    }
+    for (uint32_t id = 0; id < s->hdr->n_files; id++) {
+        if (atomic_load_explicit(&s->remap[id], memory_order_relaxed) == file_id) {
+            atomic_store_explicit(&s->remap[id], IX_SHADOWED, memory_order_relaxed);
+        }
+    }
+}
+
+void ix_close(IndexSnapshot *s)
+{
+    munmap((void *)s->base, s->size);
+    free((void *)s->remap);
+    free(s->path);
+    free(s);
+}
@@ -1,34 +1,229 @@
-#define _POSIX_C_SOURCE 200809L  // timespec_get
+#define _POSIX_C_SOURCE 200809L  // timespec_get, sched_yield
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
 #include <errno.h>
+#include <sched.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include "job_queue.h"
 #include "config.h"
+#include "epoch.h"
+#include "stats.h"
+
+// Initial slots of a worker's deque (a power of two; it doubles when full)
+#define DEQUE_INITIAL  64
+
+/* --------------------------------------------------------------------------
+ *  Injection ring: bounded MPMC queue (Vyukov).  Each cell's sequence
+ *  number says whose turn it is: pos for the pusher of position pos,
+ *  pos+1 for its popper, so a cell is never read and written at once.
+ * --------------------------------------------------------------------------*/
+struct JqCell {
+    atomic_size_t seq;
+    Job           job;
+};
+
+static bool ring_put(JobQueue *q, const Job *j)
+{
+    size_t pos = atomic_load_explicit(&q->enq, memory_order_relaxed);
+    for (;;) {
+        JqCell   *c   = &q->ring[pos & q->mask];
+        size_t    seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t  dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enq, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                c->job = *j;
+                atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (dif < 0) {
+            return false;                               // full
+        } else {
+            pos = atomic_load_explicit(&q->enq, memory_order_relaxed);
+        }
+    }
+}
+
+static bool ring_take(JobQueue *q, Job *out)
+{
+    size_t pos = atomic_load_explicit(&q->deq, memory_order_relaxed);
+    for (;;) {
+        JqCell   *c   = &q->ring[pos & q->mask];
+        size_t    seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t  dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->deq, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *out = c->job;
+                atomic_store_explicit(&c->seq, pos + q->mask + 1,
+                                      memory_order_release);
+                return true;
+            }
+        } else if (dif < 0) {
+            return false;                               // empty
+        } else {
+            pos = atomic_load_explicit(&q->deq, memory_order_relaxed);
+        }
+    }
+}
+
+/* --------------------------------------------------------------------------
+ *  Worker deques (Chase–Lev, after Lê et al., "Correct and Efficient
+ *  Work-Stealing for Weak Memory Models").  The owner pushes and takes
+ *  at `bottom`; thieves CAS `top`.  Slots hold heap copies of the Jobs so
+ *  a thief reads them atomically.  A grown array replaces the old one,
+ *  which is retired to the epoch collector: thieves may still read it.
+ * --------------------------------------------------------------------------*/
+typedef struct {
+    size_t        mask;
+    Job *_Atomic  slot[];
+} JqArray;
+
+struct JqDeque {
+    _Atomic int64_t    top;
+    _Atomic int64_t    bottom;
+    JqArray *_Atomic   array;
+    char               pad[64];     // keep neighbours off this cache line
+};
+
+static JqArray *array_new(size_t n)
+{
+    JqArray *a = malloc(sizeof(*a) + n * sizeof(a->slot[0]));
+    if (!a) {
+        perror("jq: deque malloc");
+        return NULL;
+    }
+    a->mask = n - 1;
+    return a;
+}
+
+// Owner only.  Returns false (job not queued) if the deque can't grow.
+static bool deque_push(JqDeque *d, Job *j)
+{
+    int64_t  b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t  t = atomic_load_explicit(&d->top, memory_order_acquire);
+    JqArray *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+
+    if ((size_t)(b - t) > a->mask) {
+        JqArray *g = array_new(2 * (a->mask + 1));
+        if (!g) return false;
+        for (int64_t i = t; i < b; i++) {
+            atomic_store_explicit(&g->slot[i & g->mask],
+                atomic_load_explicit(&a->slot[i & a->mask],
+                                     memory_order_relaxed),
+                memory_order_relaxed);
+        }
+        atomic_store_explicit(&d->array, g, memory_order_release);
+        epoch_retire(a, free);
+        a = g;
+    }
+    atomic_store_explicit(&a->slot[b & a->mask], j, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+// Owner only: the newest job, or NULL
+static Job *deque_take(JqDeque *d)
+{
+    int64_t  b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    JqArray *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store(&d->bottom, b);                    // seq_cst: before top
+    int64_t  t = atomic_load(&d->top);
+
+    if (t > b) {                                    // empty
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Job *j = atomic_load_explicit(&a->slot[b & a->mask], memory_order_relaxed);
+    if (t == b) {                                   // last one: race thieves
+        if (!atomic_compare_exchange_strong(&d->top, &t, t + 1)) j = NULL;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return j;
+}
+
+// Any thread: the oldest job, or NULL; *lost is set if a race was lost
+static Job *deque_steal(JqDeque *d, bool *lost)
+{
+    int64_t t = atomic_load(&d->top);
+    int64_t b = atomic_load(&d->bottom);
+    if (t >= b) return NULL;
+
+    epoch_enter();                                  // the array may be retired
+    JqArray *a = atomic_load_explicit(&d->array, memory_order_acquire);
+    Job     *j = atomic_load_explicit(&a->slot[t & a->mask],
+                                      memory_order_relaxed);
+    epoch_exit();
+    if (!atomic_compare_exchange_strong(&d->top, &t, t + 1)) {
+        *lost = true;
+        return NULL;
+    }
+    return j;
+}
+
+/* --------------------------------------------------------------------------
+ *  Queue
+ * --------------------------------------------------------------------------*/
+
+// The queue and deque index of the calling worker, if it is one
+static _Thread_local JobQueue *tl_queue;
+static _Thread_local size_t    tl_self;
 
 // Initialize queue with capacity (if cap==0, use QUEUE_CAPACITY).
-// (tail+1)%cap==head.
 void jq_init(JobQueue *q, size_t cap) {
-    q->cap   = cap ? cap : QUEUE_CAPACITY;
-    q->buf   = calloc(q->cap, sizeof(Job));
-    if (!q->buf) {
-        perror("jq_init: calloc");
+    *q = (JobQueue){ .cap = cap ? cap : QUEUE_CAPACITY };
+
+    /* outside pushes stop at cap, so the ring rarely sees more */
+    size_t n = 2;
+    while (n < 2 * q->cap) n *= 2;
+    q->mask = n - 1;
+    q->ring = malloc(n * sizeof(*q->ring));
+    if (!q->ring) {
+        perror("jq_init: malloc");
         exit(EXIT_FAILURE);
     }
-    q->head  = q->tail = 0;
-    q->closed = false;
+    for (size_t i = 0; i < n; i++) atomic_init(&q->ring[i].seq, i);
+
     pthread_mutex_init(&q->mtx, NULL);
     pthread_cond_init(&q->not_empty, NULL);
     pthread_cond_init(&q->not_full, NULL);
 }
 
-// Push a job; block if full, logging if blocked > QUEUE_BLOCK_TIMEOUT
-void jq_push(JobQueue *q, Job j) {
+void jq_set_workers(JobQueue *q, size_t n) {
+    q->deques = calloc(n, sizeof(*q->deques));
+    if (!q->deques) {
+        perror("jq_set_workers: calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; i++) {
+        JqArray *a = array_new(DEQUE_INITIAL);
+        if (!a) exit(EXIT_FAILURE);
+        atomic_init(&q->deques[i].array, a);
+    }
+    q->n_workers = n;
+}
+
+// Wake a parked worker, if any, after a push
+static void notify_push(JobQueue *q) {
+    atomic_fetch_add(&q->pushes, 1);
+    if (atomic_load(&q->idle)) {
+        pthread_mutex_lock(&q->mtx);
+        pthread_cond_signal(&q->not_empty);
+        pthread_mutex_unlock(&q->mtx);
+    }
+}
+
+// Wait until fewer than cap jobs are queued, logging every
+// QUEUE_BLOCK_TIMEOUT seconds spent blocked
+static void wait_for_room(JobQueue *q) {
+    STATS_START(t0);
+    atomic_fetch_add(&q->full, 1);
     pthread_mutex_lock(&q->mtx);
     struct timespec ts;
-    while ((q->tail + 1) % q->cap == q->head) {
+    while (atomic_load(&q->queued) >= q->cap && !atomic_load(&q->closed)) {
         // compute absolute timeout
         timespec_get(&ts, TIME_UTC);
         ts.tv_sec += (time_t)QUEUE_BLOCK_TIMEOUT;
@@ -39,44 +234,139 @@ void jq_push(JobQueue *q, Job j) {
                     QUEUE_BLOCK_TIMEOUT);
         }
     }
-    q->buf[q->tail] = j;
-    q->tail = (q->tail + 1) % q->cap;
-    pthread_cond_signal(&q->not_empty);
     pthread_mutex_unlock(&q->mtx);
+    atomic_fetch_sub(&q->full, 1);
+    STATS_ADD(ST_PUSH_WAITS, 1);
+    STATS_STOP(ST_PUSH_WAIT_NS, t0);
 }
 
-// Pop next job into *out; return false if queue closed and empty
-bool jq_pop(JobQueue *q, Job *out) {
-    pthread_mutex_lock(&q->mtx);
-    while (q->head == q->tail && !q->closed) {
-        pthread_cond_wait(&q->not_empty, &q->mtx);
+// Push a job: onto the caller's deque if it is one of q's workers,
+// otherwise into the ring once there is room
+void jq_push(JobQueue *q, Job j) {
+    if (tl_queue == q) {
+        Job *copy = malloc(sizeof(*copy));
+        if (copy) *copy = j;
+        atomic_fetch_add(&q->queued, 1);
+        if (copy && deque_push(&q->deques[tl_self], copy)) {
+            notify_push(q);
+            return;
+        }
+        free(copy);
+        atomic_fetch_sub(&q->queued, 1);
+        /* no memory for the deque: fall back to the ring */
+    } else if (atomic_load(&q->queued) >= q->cap) {
+        wait_for_room(q);
     }
-    if (q->head == q->tail && q->closed) {
-        pthread_mutex_unlock(&q->mtx);
-        return false;
+
+    atomic_fetch_add(&q->queued, 1);
+    while (!ring_put(q, &j)) sched_yield();    // racing pushers filled it
+    notify_push(q);
+}
+
+// One pass over everything worker `self` may run: its deque, the ring,
+// then the other workers' deques.  *lost is set if a steal lost a race.
+static bool find_job(JobQueue *q, size_t self, Job *out, bool *lost) {
+    Job *j = deque_take(&q->deques[self]);
+    if (!j && ring_take(q, out)) return true;
+    for (size_t i = 1; !j && i < q->n_workers; i++) {
+        j = deque_steal(&q->deques[(self + i) % q->n_workers], lost);
     }
-    *out = q->buf[q->head];
-    q->head = (q->head + 1) % q->cap;
-    pthread_cond_signal(&q->not_full);
-    pthread_mutex_unlock(&q->mtx);
+    if (!j) return false;
+    *out = *j;
+    free(j);
     return true;
 }
 
+// A job left the queue: let a held-back pusher in
+static void popped(JobQueue *q) {
+    atomic_fetch_sub(&q->queued, 1);
+    if (atomic_load(&q->full)) {
+        pthread_mutex_lock(&q->mtx);
+        pthread_cond_signal(&q->not_full);
+        pthread_mutex_unlock(&q->mtx);
+    }
+}
+
+// Pop next job into *out; return false if queue closed and empty
+bool jq_pop(JobQueue *q, size_t self, Job *out) {
+    tl_queue = q;
+    tl_self  = self;
+
+    for (;;) {
+        bool lost = false;
+        if (find_job(q, self, out, &lost)) {
+            popped(q);
+            return true;
+        }
+        if (lost) continue;                     // someone else got it; retry
+
+        if (atomic_load(&q->closed)) {
+            if (atomic_load(&q->queued) == 0) return false;
+            sched_yield();                      // a push is still landing
+            continue;
+        }
+
+        /* park: announce, re-check, then sleep until the next push */
+        atomic_fetch_add(&q->idle, 1);
+        uint_fast64_t seen = atomic_load(&q->pushes);
+        if (find_job(q, self, out, &lost)) {
+            atomic_fetch_sub(&q->idle, 1);
+            popped(q);
+            return true;
+        }
+        STATS_START(t0);
+        pthread_mutex_lock(&q->mtx);
+        while (!lost && atomic_load(&q->pushes) == seen &&
+               !atomic_load(&q->closed)) {
+            pthread_cond_wait(&q->not_empty, &q->mtx);
+        }
+        pthread_mutex_unlock(&q->mtx);
+        STATS_ADD(ST_POP_WAITS, 1);
+        STATS_STOP(ST_POP_WAIT_NS, t0);
+        atomic_fetch_sub(&q->idle, 1);
+    }
+}
+
+bool jq_try_pop(JobQueue *q, Job *out) {
+    if (tl_queue != q) return false;
+    bool lost;
+    do {
+        lost = false;
+        if (find_job(q, tl_self, out, &lost)) {
+            popped(q);
+            return true;
+        }
+    } while (lost);
+    return false;
+}
+
+bool jq_is_worker(const JobQueue *q) {
+    return tl_queue == q;
+}
+
 // Mark queue as closed and wake all waiters.
 // **Do** not call directly from a signal-handler (not async-signal-safe).
 void jq_shutdown(JobQueue *q) {
     pthread_mutex_lock(&q->mtx);
-    q->closed = true;
+    atomic_store(&q->closed, true);
     pthread_cond_broadcast(&q->not_empty);
     pthread_cond_broadcast(&q->not_full);
     pthread_mutex_unlock(&q->mtx);
 }
 
-// Destroy queue: free buffer and destroy sync primitives.
+// Destroy queue: free buffers and destroy sync primitives.
 
 void jq_destroy(JobQueue *q) {
+    for (size_t i = 0; i < q->n_workers; i++) {
+        JqDeque *d = &q->deques[i];
+        JqArray *a = atomic_load(&d->array);
+        for (int64_t k = atomic_load(&d->top); k < atomic_load(&d->bottom); k++)
+            free(atomic_load(&a->slot[k & a->mask]));
+        free(a);
+    }
     pthread_mutex_destroy(&q->mtx);
     pthread_cond_destroy(&q->not_empty);
     pthread_cond_destroy(&q->not_full);
-    free(q->buf);
+    free(q->deques);
+    free(q->ring);
 }
@@ -4,12 +4,21 @@
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "job_queue.h"
 #include "thread_pool.h"
 #include "search_engine.h"
 #include "util.h"
+#include "index_file.h"
+#include "query.h"
+#include "batch.h"
+#include "walk.h"
+#include "stats.h"
+#include "mem.h"
+#include "segment.h"
 
 // ANSI styling
 #define BOLD  "\033[1m"
@@ -20,6 +29,7 @@
 
 static ThreadPool       g_pool;
 static JobQueue         g_queue;
+static QueryCache       g_cache;
 static volatile sig_atomic_t terminate = 0;
 
 /* activity-log */
@@ -35,12 +45,27 @@ static void rebuild_index(HashMap **map_ptr)
     tp_destroy(&g_pool);
     jq_destroy(&g_queue);
     free_hash_map(*map_ptr);
+    qc_clear(&g_cache);             // its generations restart with the map
 
     *map_ptr = create_hash_map(0);
     jq_init(&g_queue, 0);
     tp_init(&g_pool, DEFAULT_NTHREADS, &g_queue);
 }
 
+/* -------------------------------------------------------------------------- */
+static void load_index(HashMap *map, const char *path)
+{
+    uint32_t n_files = 0;
+    time_t now = time(NULL);
+    if (ix_load(map, path, &n_files)) {
+        printf(GREEN "→ Loaded index %s (%u new file%s)" RESET "\n\n",
+               path, n_files, n_files == 1 ? "" : "s");
+        if (logf) fprintf(logf, "[%ld] load %s\n", now, path);
+    } else {
+        printf(RED "  [!] Couldn't load index %s\n\n" RESET, path);
+    }
+}
+
 /* -------------------------------------------------------------------------- */
 static void cleanup(HashMap *map, CensoredSet *censored)
 {
@@ -48,7 +73,9 @@ static void cleanup(HashMap *map, CensoredSet *censored)
     tp_destroy(&g_pool);
     jq_destroy(&g_queue);
     free_hash_map(map);
+    qc_destroy(&g_cache);
     free_censored_set(censored);
+    stats_stop_logger();
 
     if (logf) {
         time_t t = time(NULL);
@@ -63,19 +90,86 @@ static void cleanup(HashMap *map, CensoredSet *censored)
     puts("Application stopped.");
 }
 
+/* -------------------------------------------------------------------------- */
+static void print_stats(void)
+{
+    size_t hits = 0, misses = 0;
+    stats_report(stdout);
+    qc_counts(&g_cache, &hits, &misses);
+    printf("  query cache: %zu hit%s, %zu miss%s\n\n",
+           hits, hits == 1 ? "" : "s", misses, misses == 1 ? "" : "es");
+    if (logf) stats_log(logf);
+}
+
+/* -------------------------------------------------------------------------- */
+static void print_mem(HashMap *map)
+{
+    mem_report(stdout);
+    segments_report(map, stdout);
+    if (logf) mem_log(logf);
+}
+
+/* -------------------------------------------------------------------------- */
+static bool run_batch(HashMap *map, CensoredSet *censored, const char *path)
+{
+    FILE *in = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!in) {
+        fprintf(stderr, RED "  [!] Couldn't open query batch %s: %s\n\n" RESET,
+                path, strerror(errno));
+        return false;
+    }
+
+    BatchStats st;
+    bool ok = batch_run(&g_pool, map, censored, &g_cache, in, stdout, &st);
+    if (in != stdin) fclose(in);
+
+    count_search += st.queries;
+    batch_print_stats(stderr, &st);
+    if (logf) {
+        time_t t = time(NULL);
+        fprintf(logf, "[%ld] batch %s queries=%zu failed=%zu seconds=%.3f\n",
+                t, path, st.queries, st.failed, st.seconds);
+    }
+    return ok;
+}
+
 /* ========================================================================== */
 int main(int argc, char **argv)
 {
     /* open activity log */
     logf = fopen("activity.log", "a");
 
+    /* 0) arguments: [censored-list] [-l index-file] [-b query-file|-]
+     *    [-s seconds] [-M MiB] [-S segment-dir] ----------------------------*/
+    const char *censored_path = NULL, *load_path = NULL, *batch_path = NULL;
+    unsigned    stats_every = 0;
+    size_t      budget_mb = MEM_BUDGET_MB;
+    for (int i = 1; i < argc; i++) {
+        if ((!strcmp(argv[i], "-l") || !strcmp(argv[i], "--load")) && i + 1 < argc)
+            load_path = argv[++i];
+        else if ((!strcmp(argv[i], "-b") || !strcmp(argv[i], "--batch")) &&
+                 i + 1 < argc)
+            batch_path = argv[++i];
+        else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stats")) &&
+                 i + 1 < argc)
+            stats_every = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if ((!strcmp(argv[i], "-M") || !strcmp(argv[i], "--mem-budget")) &&
+                 i + 1 < argc)
+            budget_mb = (size_t)strtoull(argv[++i], NULL, 10);
+        else if ((!strcmp(argv[i], "-S") || !strcmp(argv[i], "--segments")) &&
+                 i + 1 < argc)
+            segments_set_dir(argv[++i]);
+        else if (!censored_path)
+            censored_path = argv[i];
+    }
+
     /* 1) censored set --------------------------------------------------------*/
     CensoredSet *censored = NULL;
-    if (argc > 1) {
-        censored = load_censored_set(argv[1]);
+    if (censored_path) {
+        censored = load_censored_set(censored_path);
         if (!censored)
             fprintf(stderr, RED "Warning: couldn't load censored list %s\n"
-            RESET "\n", argv[1]);
+            RESET "\n", censored_path);
     }
     size_t n_cen = censored_set_count(censored);
     printf("Loaded %zu censored word%s.\n\n", n_cen, n_cen==1?"":"s");
@@ -85,16 +179,33 @@ int main(int argc, char **argv)
     }
 
     /* 2) banner ------------------------------------------------------------- */
-    puts("Search Engine Simulator (OS2025 – Domaci 4)");
-    puts("_index_  <file>");
-    puts("_search_ <word>");
-    puts("_clear_");
-    puts("_stop_\n");
+    if (!batch_path) {
+        puts("Search Engine Simulator (OS2025 – Domaci 4)");
+        puts("_index_  <file|dir|pattern>");
+        puts("_search_ <word|\"phrase\"> [AND|OR|NOT <word|\"phrase\">]... [k]");
+        puts("_save_   <file>");
+        puts("_load_   <file>");
+        puts("_stats_");
+        puts("_mem_    [budget MiB]");
+        puts("_clear_");
+        puts("_stop_\n");
+    }
 
     /* 3) infra -------------------------------------------------------------- */
+    mem_set_budget(budget_mb << 20);
     HashMap *map = create_hash_map(0);
+    qc_init(&g_cache);
     jq_init(&g_queue, 0);
     tp_init(&g_pool, DEFAULT_NTHREADS, &g_queue);
+    if (load_path) load_index(map, load_path);
+    if (stats_every) stats_start_logger(logf, stats_every);
+
+    /* batch mode: run the queries on the pool and stop ---------------------*/
+    if (batch_path) {
+        bool ok = run_batch(map, censored, batch_path);
+        cleanup(map, censored);
+        return ok ? 0 : 1;
+    }
 
     /* 4) signals ------------------------------------------------------------ */
     struct sigaction sa = { .sa_handler = handle_signal };
@@ -117,7 +228,16 @@ int main(int argc, char **argv)
             time_t now = time(NULL);
 
             printf("\n" BOLD CYAN "_index_ %s" RESET "\n\n", path);
-            if (tp_submit(&g_pool, path, map, censored)) {
+            struct stat st;
+            if (strpbrk(path, WALK_GLOB_CHARS) ||
+                (stat(path, &st) == 0 && S_ISDIR(st.st_mode))) {
+                /* a tree or a pattern: walked on the pool */
+                if (walk_index(&g_pool, path, map, censored)) {
+                    ++count_index;
+                    printf(GREEN "→ Queued indexing for: %s" RESET "\n\n", path);
+                    if (logf) fprintf(logf, "[%ld] index %s\n", now, path);
+                }
+            } else if (tp_submit(&g_pool, path, map, censored)) {
                 ++count_index;
                 printf(GREEN "→ Queued indexing for file: %s" RESET "\n\n", path);
                 if (logf) fprintf(logf, "[%ld] index %s\n", now, path);
@@ -137,8 +257,40 @@ int main(int argc, char **argv)
             } else {
                 ++count_search;
                 if (logf) fprintf(logf, "[%ld] search %s\n", now, term);
-                search_word(map, term);
+                search_query(map, term, censored, &g_cache, stdout);
+            }
+
+            /* SAVE ------------------------------------------------------------- */
+        } else if (strncmp(line, "_save_ ", 7) == 0) {
+            char *path = line + 7;
+            time_t now = time(NULL);
+
+            printf("\n" BOLD CYAN "_save_ %s" RESET "\n\n", path);
+            if (ix_save(map, path)) {
+                printf(GREEN "→ Index saved to %s" RESET "\n\n", path);
+                if (logf) fprintf(logf, "[%ld] save %s\n", now, path);
+            } else {
+                printf(RED "  [!] Couldn't save index to %s\n\n" RESET, path);
+            }
+
+            /* LOAD ------------------------------------------------------------- */
+        } else if (strncmp(line, "_load_ ", 7) == 0) {
+            char *path = line + 7;
+            printf("\n" BOLD CYAN "_load_ %s" RESET "\n\n", path);
+            load_index(map, path);
+
+            /* STATS ------------------------------------------------------------ */
+        } else if (!strcmp(line, "_stats_")) {
+            printf("\n" BOLD CYAN "_stats_" RESET "\n\n");
+            print_stats();
+
+            /* MEM -------------------------------------------------------------- */
+        } else if (!strcmp(line, "_mem_") || !strncmp(line, "_mem_ ", 6)) {
+            printf("\n" BOLD CYAN "%s" RESET "\n\n", line);
+            if (line[5]) {                  // _mem_ <MiB>: a new budget
+                mem_set_budget((size_t)strtoull(line + 6, NULL, 10) << 20);
             }
+            print_mem(map);
 
             /* CLEAR ------------------------------------------------------------ */
         } else if (!strcmp(line, "_clear_")) {
@@ -160,7 +312,8 @@ int main(int argc, char **argv)
             /* UNKNOWN ---------------------------------------------------------- */
         } else {
             printf(RED "  [!] Unknown command: %s\n" RESET
-            "      Try: _index_, _search_, _clear_, or _stop_\n\n", line);
+            "      Try: _index_, _search_, _save_, _load_, _stats_, _mem_,\n"
+            "           _clear_, or _stop_\n\n", line);
             if (logf) {
                 time_t now = time(NULL);
                 fprintf(logf, "[%ld] unknown %s\n", now, line);
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "mem.h"
+
+// ANSI styling
+#define BOLD  "\033[1m"
+#define GRAY  "\033[90m"
+#define RED   "\033[31m"
+#define RESET "\033[0m"
+
+// Category names, for the log line and the table
+static const char *const names[MEM_COUNT] = {
+    [MEM_TABLE]       = "table",
+    [MEM_TERMS]       = "terms",
+    [MEM_POSTINGS]    = "postings",
+    [MEM_CONTEXTS]    = "contexts",
+    [MEM_FILE_TERMS]  = "file_terms",
+    [MEM_REGISTRY]    = "registry",
+    [MEM_ARENA_SPARE] = "arena_spare",
+    [MEM_WRITER]      = "writer",
+};
+
+// One cache line per counter: writers of different categories never
+// bounce each other's line
+static struct {
+    _Atomic int64_t  v;
+    char             pad[64 - sizeof(int64_t)];
+} g_bytes[MEM_COUNT];
+
+static _Atomic size_t g_budget = 0;
+
+void mem_add(MemCat c, int64_t delta)
+{
+    atomic_fetch_add_explicit(&g_bytes[c].v, delta, memory_order_relaxed);
+}
+
+size_t mem_bytes(MemCat c)
+{
+    int64_t v = atomic_load_explicit(&g_bytes[c].v, memory_order_relaxed);
+    return v > 0 ? (size_t)v : 0;   // a release may be seen before its charge
+}
+
+size_t mem_total(void)
+{
+    size_t sum = 0;
+    for (int c = 0; c < MEM_COUNT; c++) sum += mem_bytes(c);
+    return sum;
+}
+
+void mem_set_budget(size_t bytes) { atomic_store(&g_budget, bytes); }
+
+size_t mem_budget(void) { return atomic_load(&g_budget); }
+
+bool mem_over_budget(void)
+{
+    size_t budget = atomic_load_explicit(&g_budget, memory_order_relaxed);
+    return budget && mem_total() >= budget;
+}
+
+static double mib(size_t n) { return (double)n / (1024.0 * 1024.0); }
+
+void mem_report(FILE *out)
+{
+    size_t total = mem_total();
+    fprintf(out, BOLD "  %-14s %12s %8s" RESET "\n", "category", "MiB", "share");
+    for (int c = 0; c < MEM_COUNT; c++) {
+        size_t n = mem_bytes(c);
+        fprintf(out, "  %-14s %12.2f %7.1f%%\n", names[c], mib(n),
+                total ? 100.0 * (double)n / (double)total : 0.0);
+    }
+    fprintf(out, "  %-14s %12.2f\n\n", "total", mib(total));
+
+    size_t budget = mem_budget();
+    if (!budget) {
+        fprintf(out, GRAY "  No memory budget (set one with -M or _mem_ <MiB>)." RESET "\n\n");
+    } else if (total >= budget) {
+        fprintf(out, RED "  Budget of %.0f MiB reached: new files wait for segments to be written out." RESET
+                "\n\n", mib(budget));
+    } else {
+        fprintf(out, "  Budget %.0f MiB, %.1f%% used.\n\n", mib(budget),
+                100.0 * (double)total / (double)budget);
+    }
+}
+
+void mem_log(FILE *log)
+{
+    fprintf(log, "[%ld] mem", (long)time(NULL));
+    for (int c = 0; c < MEM_COUNT; c++) {
+        fprintf(log, " %s=%zu", names[c], mem_bytes(c));
+    }
+    fprintf(log, " total=%zu budget=%zu\n", mem_total(), mem_budget());
+    fflush(log);
+}
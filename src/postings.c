@@ -0,0 +1,623 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "postings.h"
+#include "config.h"
+#include "epoch.h"
+#include "varint.h"
+#include "mem.h"
+
+// Bytes of a posting's encoded fields before its position list, at most
+#define HEAD_MAX (4 * VARINT_MAX)
+
+// Bytes a new last block starts with: room for a few postings before it
+// first has to grow
+#define BLOCK_MIN 48
+
+struct PostingBlock {
+    uint32_t        file_id;    // first posting's key
+    uint64_t        sent;
+    atomic_uint     n;          // postings readable
+    uint32_t        len, cap;   // bytes used / allocated (writer side)
+    WordOccurrence  last;       // last posting, the next one's delta base
+                                // (writer side; pos unset)
+    uint8_t         data[];
+};
+
+// A block and the number of postings in the blocks before it
+typedef struct {
+    PostingBlock *_Atomic  block;
+    size_t                 start;
+} ListSlot;
+
+struct PostingList {
+    size_t         cap;
+    atomic_size_t  n;           // slots readable
+    ListSlot       slots[];
+};
+
+// ------- Allocation -------
+// Lists and blocks are charged to MEM_POSTINGS by their capacity; the
+// free functions read it back, so they also serve epoch_retire.
+
+static PostingBlock *block_alloc(size_t cap)
+{
+    PostingBlock *b = malloc(sizeof(*b) + cap);
+    if (!b) {
+        perror("postings: malloc block");
+        return NULL;
+    }
+    b->cap = (uint32_t)cap;
+    mem_add(MEM_POSTINGS, (int64_t)(sizeof(*b) + cap));
+    return b;
+}
+
+static void block_free(void *p)
+{
+    PostingBlock *b = p;
+    mem_add(MEM_POSTINGS, -(int64_t)(sizeof(*b) + b->cap));
+    free(b);
+}
+
+static void list_free(void *p)
+{
+    PostingList *l = p;
+    mem_add(MEM_POSTINGS, -(int64_t)(sizeof(*l) + l->cap * sizeof(l->slots[0])));
+    free(l);
+}
+
+// Posting order: by file, then by sentence within the file
+static inline int occ_order(const WordOccurrence *x, const WordOccurrence *y)
+{
+    if (x->file_id != y->file_id) return x->file_id < y->file_id ? -1 : 1;
+    return (x->sent > y->sent) - (x->sent < y->sent);
+}
+
+static int cmp_order(const void *a, const void *b)
+{
+    return occ_order(a, b);
+}
+
+// ------- Encoding -------
+
+static inline size_t pos_bytes(const WordOccurrence *o)
+{
+    return o->pos ? poslist_len(o->pos, NULL) : 0;
+}
+
+// Encode o's fields relative to prev into head[0..HEAD_MAX); its position
+// list follows them
+static size_t posting_head(uint8_t *head, const WordOccurrence *prev,
+                           const WordOccurrence *o)
+{
+    uint32_t gap = o->file_id - prev->file_id;
+    int64_t  ctx = (int64_t)((uintptr_t)o->context - (uintptr_t)prev->context);
+    size_t   len = varint_put(head, gap);
+    len += varint_put(head + len, gap ? o->sent : o->sent - prev->sent);
+    len += varint_put(head + len, (uint64_t)o->count);
+    len += varint_put(head + len, zigzag_encode(ctx));
+    return len;
+}
+
+// Decode the posting at p over *o, which holds the one before it.
+// end==NULL ⇒ trusted input; otherwise NULL if it overruns end.
+static const uint8_t *posting_get(const uint8_t *p, const uint8_t *end,
+                                  WordOccurrence *o)
+{
+    uint64_t gap = 0, sent = 0, count = 0, ctx = 0;
+    if (!varint_get(&p, end, &gap)   || !varint_get(&p, end, &sent) ||
+        !varint_get(&p, end, &count) || !varint_get(&p, end, &ctx)) return NULL;
+    size_t plen = poslist_len(p, end);
+    if (!plen) return NULL;
+    o->file_id += (uint32_t)gap;
+    o->sent     = gap ? sent : o->sent + sent;
+    o->count    = (int)count;
+    o->context  = (char *)((uintptr_t)o->context +
+                           (uintptr_t)zigzag_decode(ctx));
+    o->pos      = p;
+    return p + plen;
+}
+
+// Encoded size of o after prev
+static size_t posting_size(const WordOccurrence *prev, const WordOccurrence *o,
+                           size_t plen)
+{
+    uint8_t head[HEAD_MAX];
+    return posting_head(head, prev, o) + (plen ? plen : 1);
+}
+
+// Encode o after prev at dst (room checked by the caller); returns the
+// bytes written
+static size_t posting_put(uint8_t *dst, const WordOccurrence *prev,
+                          const WordOccurrence *o, size_t plen)
+{
+    size_t len = posting_head(dst, prev, o);
+    if (plen) memcpy(dst + len, o->pos, plen);
+    else      dst[len] = 0;                 // no positions: an empty list
+    return len + (plen ? plen : 1);
+}
+
+// Append o to b's bytes (room checked by the caller)
+static void block_put(PostingBlock *b, const WordOccurrence *o, size_t plen)
+{
+    b->len     += (uint32_t)posting_put(b->data + b->len, &b->last, o, plen);
+    b->last     = *o;
+    b->last.pos = NULL;
+}
+
+// An empty block whose first posting will be `first`
+static PostingBlock *block_new(const WordOccurrence *first, size_t cap)
+{
+    PostingBlock *b = block_alloc(cap);
+    if (!b) return NULL;
+    b->file_id = first->file_id;
+    b->sent    = first->sent;
+    atomic_init(&b->n, 0);
+    b->len  = 0;
+    b->last = (WordOccurrence){ .file_id = first->file_id, .sent = first->sent };
+    return b;
+}
+
+size_t pl_block_size(const WordOccurrence *v, size_t n)
+{
+    WordOccurrence prev = { .file_id = v[0].file_id, .sent = v[0].sent };
+    size_t         size = 0;
+    for (size_t i = 0; i < n; i++) {
+        size += posting_size(&prev, &v[i], pos_bytes(&v[i]));
+        prev  = v[i];
+    }
+    return size;
+}
+
+size_t pl_block_encode(uint8_t *dst, const WordOccurrence *v, size_t n)
+{
+    WordOccurrence prev = { .file_id = v[0].file_id, .sent = v[0].sent };
+    size_t         len  = 0;
+    for (size_t i = 0; i < n; i++) {
+        len += posting_put(dst + len, &prev, &v[i], pos_bytes(&v[i]));
+        prev = v[i];
+    }
+    return len;
+}
+
+size_t pl_block_decode(const uint8_t *p, const uint8_t *end, uint32_t file_id,
+                       uint64_t sent, size_t n, WordOccurrence *out)
+{
+    WordOccurrence o = { .file_id = file_id, .sent = sent };
+    for (size_t i = 0; i < n; i++) {
+        if (!(p = posting_get(p, end, &o))) return i;
+        out[i] = o;
+    }
+    return n;
+}
+
+// v[0..n) (n <= POSTING_BLOCK, in order) as one block of exactly its size
+static PostingBlock *block_encode(const WordOccurrence *v, size_t n)
+{
+    PostingBlock *b = block_new(&v[0], pl_block_size(v, n));
+    if (!b) return NULL;
+    for (size_t i = 0; i < n; i++) block_put(b, &v[i], pos_bytes(&v[i]));
+    atomic_init(&b->n, (unsigned)n);
+    return b;
+}
+
+static void block_decode(const PostingBlock *b, size_t n, WordOccurrence *out)
+{
+    pl_block_decode(b->data, NULL, b->file_id, b->sent, n, out);
+}
+
+static PostingList *list_new(size_t cap)
+{
+    PostingList *l = malloc(sizeof(*l) + cap * sizeof(l->slots[0]));
+    if (!l) {
+        perror("postings: malloc list");
+        return NULL;
+    }
+    l->cap = cap;
+    atomic_init(&l->n, 0);
+    mem_add(MEM_POSTINGS, (int64_t)(sizeof(*l) + cap * sizeof(l->slots[0])));
+    return l;
+}
+
+static inline PostingBlock *slot_block(PostingList *l, size_t b)
+{
+    return atomic_load_explicit(&l->slots[b].block, memory_order_acquire);
+}
+
+void pl_free(PostingList *l)
+{
+    if (!l) return;
+    size_t n = atomic_load_explicit(&l->n, memory_order_relaxed);
+    for (size_t b = 0; b < n; b++) block_free(slot_block(l, b));
+    list_free(l);
+}
+
+// ------- Reading -------
+
+void pl_view(PostingList *l, PostingView *v)
+{
+    *v = (PostingView){ .list = l };
+    size_t nb = l ? atomic_load_explicit(&l->n, memory_order_acquire) : 0;
+    if (!nb) return;
+    v->last     = slot_block(l, nb - 1);
+    v->n_blocks = nb;
+    v->n        = l->slots[nb - 1].start +
+                  atomic_load_explicit(&v->last->n, memory_order_acquire);
+}
+
+static inline PostingBlock *view_block(const PostingView *v, size_t b)
+{
+    return b + 1 == v->n_blocks ? v->last : slot_block(v->list, b);
+}
+
+size_t pv_block_start(const PostingView *v, size_t b)
+{
+    return v->list->slots[b].start;
+}
+
+size_t pv_block_end(const PostingView *v, size_t b)
+{
+    return b + 1 == v->n_blocks ? v->n : v->list->slots[b + 1].start;
+}
+
+size_t pv_block_of(const PostingView *v, size_t i)
+{
+    size_t lo = 0, hi = v->n_blocks;        // the answer is in [lo, hi)
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (v->list->slots[mid].start <= i) lo = mid;
+        else                                hi = mid;
+    }
+    return lo;
+}
+
+// Does block b start at or before (f, s)?
+static inline bool starts_by(const PostingView *v, size_t b, uint32_t f,
+                             uint64_t s)
+{
+    const PostingBlock *blk = view_block(v, b);
+    return blk->file_id < f || (blk->file_id == f && blk->sent <= s);
+}
+
+size_t pv_find_block(const PostingView *v, size_t from, uint32_t file_id,
+                     uint64_t sent)
+{
+    if (from + 1 >= v->n_blocks) return from;
+
+    size_t lo = from, hi = from + 1, step = 1;
+    while (hi < v->n_blocks && starts_by(v, hi, file_id, sent)) {
+        lo    = hi;
+        hi   += step;
+        step *= 2;
+    }
+    if (hi > v->n_blocks) hi = v->n_blocks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (starts_by(v, mid, file_id, sent)) lo = mid;
+        else                                  hi = mid;
+    }
+    return lo;
+}
+
+size_t pv_decode_block(const PostingView *v, size_t b, WordOccurrence *out)
+{
+    size_t n = pv_block_end(v, b) - pv_block_start(v, b);
+    block_decode(view_block(v, b), n, out);
+    return n;
+}
+
+void pv_decode(const PostingView *v, WordOccurrence *out)
+{
+    for (size_t b = 0; b < v->n_blocks; b++) {
+        out += pv_decode_block(v, b, out);
+    }
+}
+
+// ------- Writing -------
+
+// Publish l with its blocks [lo, hi] replaced by v[0..n) (in order) cut
+// into new ones, then retire what the new list no longer holds.  The
+// blocks around keep their encoding; only the starts after move.
+static bool replace(PostingList *_Atomic *slot, PostingList *l,
+                    size_t lo, size_t hi, const WordOccurrence *v, size_t n)
+{
+    PostingView view;
+    pl_view(l, &view);
+    size_t add = (n + POSTING_BLOCK - 1) / POSTING_BLOCK;
+    size_t nb  = view.n_blocks - (hi + 1 - lo) + add;
+
+    PostingList *nl = nb ? list_new(nb) : NULL;
+    if (nb && !nl) return false;
+
+    size_t k = 0, start = 0;
+    for (size_t b = 0; b < lo; b++, k++) {
+        atomic_init(&nl->slots[k].block, view_block(&view, b));
+        nl->slots[k].start = start;
+        start += pv_block_end(&view, b) - pv_block_start(&view, b);
+    }
+    for (size_t i = 0; i < n; i += POSTING_BLOCK, k++) {
+        size_t        cnt = n - i < POSTING_BLOCK ? n - i : POSTING_BLOCK;
+        PostingBlock *blk = block_encode(v + i, cnt);
+        if (!blk) {
+            while (k-- > lo) block_free(atomic_load(&nl->slots[k].block));
+            list_free(nl);
+            return false;
+        }
+        atomic_init(&nl->slots[k].block, blk);
+        nl->slots[k].start = start;
+        start += cnt;
+    }
+    for (size_t b = hi + 1; b < view.n_blocks; b++, k++) {
+        atomic_init(&nl->slots[k].block, view_block(&view, b));
+        nl->slots[k].start = start;
+        start += pv_block_end(&view, b) - pv_block_start(&view, b);
+    }
+    if (nl) atomic_init(&nl->n, nb);
+
+    atomic_store_explicit(slot, nl, memory_order_release);
+    for (size_t b = lo; b <= hi; b++) epoch_retire(view_block(&view, b), block_free);
+    epoch_retire(l, list_free);
+    return true;
+}
+
+// Decode blocks [lo, hi] of v into a new array of *n postings
+static WordOccurrence *decode_range(const PostingView *v, size_t lo, size_t hi,
+                                    size_t *n)
+{
+    *n = pv_block_end(v, hi) - pv_block_start(v, lo);
+    WordOccurrence *buf = malloc(*n * sizeof(*buf));
+    if (!buf) {
+        perror("postings: malloc");
+        return NULL;
+    }
+    for (size_t b = lo, i = 0; b <= hi; b++) {
+        i += pv_decode_block(v, b, buf + i);
+    }
+    return buf;
+}
+
+// A full block is copied once to the size it needs
+static void seal(PostingList *l, size_t b, PostingBlock *blk)
+{
+    if (blk->len == blk->cap) return;
+    PostingBlock *t = malloc(sizeof(*t) + blk->len);
+    if (!t) return;                         // it just keeps the slack
+    memcpy(t, blk, sizeof(*t) + blk->len);
+    t->cap = t->len;
+    mem_add(MEM_POSTINGS, (int64_t)(sizeof(*t) + t->cap));
+    atomic_store_explicit(&l->slots[b].block, t, memory_order_release);
+    epoch_retire(blk, block_free);
+}
+
+// Append o, which sorts after every posting of l, in place where there
+// is room: in the last block, then in the list
+static bool push(PostingList *_Atomic *slot, PostingList *l,
+                 const WordOccurrence *o)
+{
+    size_t        nb   = l ? atomic_load_explicit(&l->n, memory_order_relaxed) : 0;
+    PostingBlock *last = nb ? slot_block(l, nb - 1) : NULL;
+    unsigned      cnt  = last ? atomic_load_explicit(&last->n,
+                                                     memory_order_relaxed)
+                              : POSTING_BLOCK;
+    size_t        plen = pos_bytes(o);
+
+    if (cnt < POSTING_BLOCK) {
+        size_t need = posting_size(&last->last, o, plen);
+        if (last->len + need > last->cap) {
+            /* out of room: a copy twice the size takes its place */
+            size_t cap = 2 * (size_t)last->cap;
+            if (cap < last->len + need) cap = last->len + need;
+            PostingBlock *b = block_alloc(cap);
+            if (!b) return false;
+            memcpy(b, last, sizeof(*b) + last->len);
+            b->cap = (uint32_t)cap;
+            atomic_store_explicit(&l->slots[nb - 1].block, b,
+                                  memory_order_release);
+            epoch_retire(last, block_free);
+            last = b;
+        }
+        block_put(last, o, plen);
+        atomic_store_explicit(&last->n, cnt + 1, memory_order_release);
+        if (cnt + 1 == POSTING_BLOCK) seal(l, nb - 1, last);
+        return true;
+    }
+
+    /* the last block is full (or there is none): start one */
+    WordOccurrence base  = { .file_id = o->file_id, .sent = o->sent };
+    size_t         need  = posting_size(&base, o, plen);
+    PostingBlock  *b     = block_new(o, need > BLOCK_MIN ? need : BLOCK_MIN);
+    size_t         start = nb ? l->slots[nb - 1].start + cnt : 0;
+    if (!b) return false;
+    block_put(b, o, plen);
+    atomic_init(&b->n, 1);
+    if (l && nb < l->cap) {
+        atomic_init(&l->slots[nb].block, b);
+        l->slots[nb].start = start;
+        atomic_store_explicit(&l->n, nb + 1, memory_order_release);
+        return true;
+    }
+
+    PostingList *nl = list_new(nb ? 2 * nb : 1);
+    if (!nl) {
+        block_free(b);
+        return false;
+    }
+    for (size_t i = 0; i < nb; i++) {
+        atomic_init(&nl->slots[i].block, slot_block(l, i));
+        nl->slots[i].start = l->slots[i].start;
+    }
+    atomic_init(&nl->slots[nb].block, b);
+    nl->slots[nb].start = start;
+    atomic_init(&nl->n, nb + 1);
+    atomic_store_explicit(slot, nl, memory_order_release);
+    if (l) epoch_retire(l, list_free);
+    return true;
+}
+
+// Fold o into the last posting of l (same file and context): the last
+// block is re-encoded
+static bool merge_last(PostingList *_Atomic *slot, PostingList *l,
+                       const WordOccurrence *o)
+{
+    PostingView v;
+    pl_view(l, &v);
+    size_t          b = v.n_blocks - 1, n;
+    WordOccurrence *buf = decode_range(&v, b, b, &n);
+    if (!buf) return false;
+    buf[n - 1].count += o->count;
+    bool ok = replace(slot, l, b, b, buf, n);
+    free(buf);
+    return ok;
+}
+
+// Does o repeat the context of the posting before it, last?  Then it is
+// folded into last, as local_index_add does within a file.
+static inline bool same_sentence(const WordOccurrence *last,
+                                 const WordOccurrence *o)
+{
+    return last->file_id == o->file_id &&
+           (last->context == o->context ||
+            strcmp(last->context, o->context) == 0);
+}
+
+// Fold each of v[0..n)'s postings of file_id that repeats the context of
+// the one before it into that one; returns how many are left.  With
+// `unfolded`, nothing is folded: it is set if there was any.
+static size_t fold_file(WordOccurrence *v, size_t n, uint32_t file_id,
+                        bool *unfolded)
+{
+    size_t m = 0;
+    for (size_t k = 0; k < n; k++) {
+        bool rep = m && v[k].file_id == file_id &&
+                   same_sentence(&v[m - 1], &v[k]);
+        if (rep && unfolded) {
+            *unfolded = true;
+            return n;
+        }
+        if (rep) v[m - 1].count += v[k].count;
+        else     v[m++] = v[k];
+    }
+    return m;
+}
+
+// Merge occ[0..n), in any order, into l: only the blocks their keys fall
+// in are decoded, merged and re-encoded.  One merge's postings are a
+// single file's sentences in a row, so that is usually one block.  The
+// file's postings that repeat a context are then folded into the one
+// before, wherever occ landed (see pl_append for `unfolded`).
+static bool insert(PostingList *_Atomic *slot, PostingList *l,
+                   const WordOccurrence *occ, size_t n, bool *unfolded)
+{
+    /* a merge's batch comes sorted; anything else is sorted first */
+    WordOccurrence *add = NULL;
+    for (size_t i = 1; i < n && !add; i++) {
+        if (occ_order(&occ[i - 1], &occ[i]) <= 0) continue;
+        if (!(add = malloc(n * sizeof(*add)))) {
+            perror("postings: malloc");
+            return false;
+        }
+        memcpy(add, occ, n * sizeof(*add));
+        qsort(add, n, sizeof(*add), cmp_order);
+        occ = add;
+    }
+
+    PostingView v;
+    pl_view(l, &v);
+    size_t lo   = pv_find_block(&v, 0, occ[0].file_id, occ[0].sent);
+    size_t hi   = pv_find_block(&v, lo, occ[n - 1].file_id, occ[n - 1].sent);
+    /* the next block's first posting may repeat the last one added */
+    if (hi + 1 < v.n_blocks &&
+        view_block(&v, hi + 1)->file_id == occ[n - 1].file_id) hi++;
+    size_t have = pv_block_end(&v, hi) - pv_block_start(&v, lo);
+
+    /* the old postings go to the back of one buffer and are merged
+     * forward: the write position never passes the next one read */
+    WordOccurrence *all = malloc((have + n) * sizeof(*all));
+    bool            ok  = all != NULL;
+    if (!ok) perror("postings: malloc");
+    if (ok) {
+        WordOccurrence *old = all + n;
+        for (size_t b = lo, i = 0; b <= hi; b++) {
+            i += pv_decode_block(&v, b, old + i);
+        }
+        size_t i = 0, j = 0, k = 0;
+        while (i < have && j < n) {
+            all[k++] = occ_order(&occ[j], &old[i]) < 0 ? occ[j++] : old[i++];
+        }
+        while (j < n) all[k++] = occ[j++];
+        k  = fold_file(all, have + n, occ[0].file_id, unfolded);
+        ok = replace(slot, l, lo, hi, all, k);
+    }
+    free(all);
+    free(add);
+    return ok;
+}
+
+bool pl_append(PostingList *_Atomic *list, const WordOccurrence *occ,
+               size_t n, bool *unfolded)
+{
+    for (size_t i = 0; i < n; i++) {
+        PostingList  *l    = atomic_load_explicit(list, memory_order_relaxed);
+        size_t        nb   = l ? atomic_load_explicit(&l->n,
+                                                      memory_order_relaxed) : 0;
+        PostingBlock *last = nb ? slot_block(l, nb - 1) : NULL;
+        int           ord  = last ? occ_order(&last->last, &occ[i]) : -1;
+        bool          rep  = ord < 0 && last &&
+                             same_sentence(&last->last, &occ[i]);
+
+        if (rep && !unfolded) {
+            if (!merge_last(list, l, &occ[i])) return false;
+        } else if (ord >= 0) {
+            /* out of order: the rest goes in with one re-encoding */
+            return insert(list, l, occ + i, n - i, unfolded);
+        } else {
+            if (rep) *unfolded = true;
+            if (!push(list, l, &occ[i])) return false;
+        }
+    }
+    return true;
+}
+
+bool pl_fold(PostingList *_Atomic *list, uint32_t file_id)
+{
+    PostingList *l = atomic_load_explicit(list, memory_order_relaxed);
+    PostingView  v;
+    pl_view(l, &v);
+    if (!v.n) return true;
+
+    size_t          lo = pv_find_block(&v, 0, file_id, 0);
+    size_t          hi = pv_find_block(&v, lo, file_id, UINT64_MAX);
+    size_t          n;
+    WordOccurrence *buf = decode_range(&v, lo, hi, &n);
+    if (!buf) return false;
+
+    size_t keep = fold_file(buf, n, file_id, NULL);
+    bool   ok   = keep == n || replace(list, l, lo, hi, buf, keep);
+    free(buf);
+    return ok;
+}
+
+bool pl_remove_file(PostingList *_Atomic *list, uint32_t file_id)
+{
+    PostingList *l = atomic_load_explicit(list, memory_order_relaxed);
+    PostingView  v;
+    pl_view(l, &v);
+    if (!v.n) return true;
+
+    /* the file's postings all lie in blocks [lo, hi] */
+    size_t          lo = pv_find_block(&v, 0, file_id, 0);
+    size_t          hi = pv_find_block(&v, lo, file_id, UINT64_MAX);
+    size_t          n;
+    WordOccurrence *buf = decode_range(&v, lo, hi, &n);
+    if (!buf) return false;
+
+    size_t keep = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (buf[i].file_id != file_id) buf[keep++] = buf[i];
+    }
+    bool ok = keep == n || replace(list, l, lo, hi, buf, keep);
+    free(buf);
+    return ok;
+}
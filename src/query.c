@@ -0,0 +1,696 @@
+#define _POSIX_C_SOURCE 200809L  // for strdup, open_memstream
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "query.h"
+#include "config.h"
+#include "epoch.h"
+#include "index_file.h"
+#include "varint.h"
+#include "rank.h"
+#include "segment.h"
+
+// ANSI escape codes for styling
+#define RED   "\033[31m"
+#define RESET "\033[0m"
+
+// A word, a wildcard pattern or a quoted phrase, optionally negated
+typedef struct {
+    const char **words;     // words[0..n) in phrase order
+    int          n;
+    bool         neg;       // NOT term
+    bool         glob;      // words[0] is a pattern (n == 1)
+} QTerm;
+
+// Wildcards: '*' matches any run of letters, '?' exactly one
+#define GLOB_CHARS "*?"
+
+// One OR-branch: terms[first .. first+n) of the parsed query
+typedef struct {
+    int first, n;
+} QGroup;
+
+// ------- Posting runs -------
+
+// One term's postings in one source (an in-memory segment, or an on-disk
+// segment or loaded index file), in (file_id, sent) order, with a cursor
+// for the intersection.  A word's compressed list is decoded a block at a
+// time, as the cursor reaches it.
+typedef struct {
+    PostingView           view;    // in-memory postings (blk set), or
+    IxView                ixv;     // ... an index file's (blk and disk set), or
+    const WordOccurrence *occ;     // ... decoded ones (a pattern's merge)
+    bool                  disk;
+    size_t                n;
+    size_t                pos;     // everything before pos is < the probe
+    WordOccurrence       *blk;     // block blk_no, decoded, which
+    size_t                blk_no;  // ... holds postings [blk_lo, blk_hi)
+    size_t                blk_lo, blk_hi;
+    void                 *own;     // merged postings of a pattern, freed
+} Run;
+
+// Block bookkeeping of r's compressed list, whichever kind it is
+static inline size_t run_block_of(const Run *r, size_t i) {
+    return r->disk ? ixv_block_of(&r->ixv, i) : pv_block_of(&r->view, i);
+}
+
+static inline size_t run_block_start(const Run *r, size_t b) {
+    return r->disk ? ixv_block_start(&r->ixv, b) : pv_block_start(&r->view, b);
+}
+
+static inline size_t run_block_end(const Run *r, size_t b) {
+    return r->disk ? ixv_block_end(&r->ixv, b) : pv_block_end(&r->view, b);
+}
+
+static inline size_t run_find_block(const Run *r, size_t from, uint32_t f,
+                                    uint64_t s) {
+    return r->disk ? ixv_find_block(&r->ixv, from, f, s)
+                   : pv_find_block(&r->view, from, f, s);
+}
+
+// Posting i of r
+static inline const WordOccurrence *run_occ(Run *r, size_t i) {
+    if (!r->blk) return &r->occ[i];
+    if (i < r->blk_lo || i >= r->blk_hi) {
+        size_t b  = i == r->blk_hi ? r->blk_no + 1 : run_block_of(r, i);
+        r->blk_no = b;
+        r->blk_lo = run_block_start(r, b);
+        r->blk_hi = r->blk_lo + (r->disk ? ixv_decode_block(&r->ixv, b, r->blk)
+                                         : pv_decode_block(&r->view, b, r->blk));
+    }
+    return &r->blk[i - r->blk_lo];
+}
+
+static inline uint32_t run_file(Run *r, size_t i) {
+    return run_occ(r, i)->file_id;
+}
+
+static inline uint64_t run_sent(Run *r, size_t i) {
+    return run_occ(r, i)->sent;
+}
+
+// Compare element i of r with the key (f, s)
+static inline int run_cmp(Run *r, size_t i, uint32_t f, uint64_t s) {
+    uint32_t rf = run_file(r, i);
+    if (rf != f) return rf < f ? -1 : 1;
+    uint64_t rs = run_sent(r, i);
+    return (rs > s) - (rs < s);
+}
+
+// Move r's cursor to the first posting >= (f, s) and say whether it is
+// equal.  Galloping: probe 1, 2, 4, ... ahead, then binary-search the
+// last gap, so a walk over the whole run costs O(k log(n/k)) for k probes.
+// A compressed run first skips whole blocks by their headers, then
+// searches the one block the key can be in.
+static bool run_seek(Run *r, uint32_t f, uint64_t s)
+{
+    size_t end = r->n;
+    if (r->blk && r->pos < r->n) {
+        size_t from = r->pos >= r->blk_lo && r->pos < r->blk_hi
+                          ? r->blk_no : run_block_of(r, r->pos);
+        size_t b    = run_find_block(r, from, f, s);
+        size_t lo   = run_block_start(r, b);
+        if (lo > r->pos) r->pos = lo;
+        end = run_block_end(r, b);
+    }
+
+    size_t lo = r->pos, hi = lo, step = 1;
+    while (hi < end && run_cmp(r, hi, f, s) < 0) {
+        lo    = hi + 1;
+        hi   += step;
+        step *= 2;
+    }
+    if (hi > end) hi = end;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (run_cmp(r, mid, f, s) < 0) lo = mid + 1;
+        else                           hi = mid;
+    }
+    r->pos = lo;
+    return lo < end && run_cmp(r, lo, f, s) == 0;
+}
+
+// Word positions of the posting under r's cursor (an index file's were
+// checked as they were decoded)
+static bool run_positions(Run *r, PosIter *it)
+{
+    return pos_iter_init(it, run_occ(r, r->pos)->pos, NULL);
+}
+
+// Do the postings under the cursors of r[0..n) (one per phrase word, all
+// in the same sentence) hold the words at consecutive positions?  Each
+// list is walked once.
+static bool phrase_at(Run *r, int n)
+{
+    PosIter  it[QUERY_MAX_PHRASE];
+    uint32_t cur[QUERY_MAX_PHRASE];
+    for (int k = 0; k < n; k++) {
+        if (!run_positions(&r[k], &it[k])) return false;
+        if (k > 0 && !pos_iter_next(&it[k], &cur[k])) return false;
+    }
+    uint32_t p0;
+    while (pos_iter_next(&it[0], &p0)) {
+        bool all = true;
+        for (int k = 1; all && k < n; k++) {
+            uint64_t want = (uint64_t)p0 + (uint64_t)k;
+            while (cur[k] < want) {
+                if (!pos_iter_next(&it[k], &cur[k])) return false;
+            }
+            all = cur[k] == want;
+        }
+        if (all) return true;
+    }
+    return false;
+}
+
+// ------- Results -------
+
+typedef struct {
+    WordOccurrence *v;
+    size_t          n, cap;
+} Results;
+
+// Make room for `more` results
+static bool results_reserve(Results *r, size_t more)
+{
+    if (r->n + more > r->cap) {
+        size_t new_cap = r->cap ? r->cap * 2 : 64;
+        while (new_cap < r->n + more) new_cap *= 2;
+        WordOccurrence *tmp = realloc(r->v, new_cap * sizeof(*tmp));
+        if (!tmp) {
+            perror("search_query: realloc");
+            return false;
+        }
+        r->v   = tmp;
+        r->cap = new_cap;
+    }
+    return true;
+}
+
+static bool results_push(Results *r, WordOccurrence occ)
+{
+    if (!results_reserve(r, 1)) return false;
+    r->v[r->n++] = occ;
+    return true;
+}
+
+static int cmp_result(const void *a, const void *b)
+{
+    const WordOccurrence *x = a, *y = b;
+    if (x->file_id != y->file_id) return x->file_id < y->file_id ? -1 : 1;
+    return (x->sent > y->sent) - (x->sent < y->sent);
+}
+
+// ------- Wildcards -------
+
+// Does word match pat?  A '*' first tries to match nothing and grows by
+// one letter each time the rest fails, resuming from the last '*' only.
+static bool glob_match(const char *pat, const char *word)
+{
+    const char *star = NULL, *resume = NULL;
+    while (*word) {
+        if (*pat == '*') {
+            star   = pat++;
+            resume = word;
+        } else if (*pat && (*pat == '?' || *pat == *word)) {
+            pat++;
+            word++;
+        } else if (star) {
+            pat  = star + 1;
+            word = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pat == '*') pat++;
+    return !*pat;
+}
+
+// A pattern's matches in one source, merged into one posting list
+typedef struct {
+    MemSegment *seg;
+    const char *pat;
+    Results    occ;             // copies of the postings
+    bool       ok;
+} Expansion;
+
+static void expand_live(const char *word, void *arg)
+{
+    Expansion *x = arg;
+    if (!x->ok || !glob_match(x->pat, word)) return;
+
+    PostingView v;
+    seg_postings(x->seg, word, &v);
+    if (!v.n || !(x->ok = results_reserve(&x->occ, v.n))) return;
+    pv_decode(&v, x->occ.v + x->occ.n);
+    x->occ.n += v.n;
+}
+
+static void expand_ix(const char *word, const IxView *v, void *arg)
+{
+    Expansion *x = arg;
+    if (!x->ok || !glob_match(x->pat, word)) return;
+
+    if (!v->n || !(x->ok = results_reserve(&x->occ, v->n))) return;
+    for (size_t b = 0; b < v->n_blocks; b++) {
+        x->occ.n += ixv_decode_block(v, b, x->occ.v + x->occ.n);
+    }
+}
+
+// Build the run of pattern `pat` in segment seg (snap == NULL) or in
+// snap: every matching term's postings, in order, one per sentence.  Only
+// the terms under the pattern's literal prefix are visited.
+static bool expand_run(MemSegment *seg, const IndexSnapshot *snap,
+                       const char *pat, Run *r)
+{
+    Expansion x = { .seg = seg, .pat = pat, .ok = true };
+    size_t    lit = strcspn(pat, GLOB_CHARS);
+
+    if (!snap) seg_for_each_prefix(seg, pat, lit, expand_live, &x);
+    else       ix_for_each_prefix(snap, pat, lit, expand_ix, &x);
+    if (!x.ok) {
+        free(x.occ.v);
+        return false;
+    }
+
+    /* several matches in one sentence make one posting, counts summed */
+    size_t w = 0;
+    if (x.occ.n) qsort(x.occ.v, x.occ.n, sizeof(*x.occ.v), cmp_result);
+    for (size_t i = 0; i < x.occ.n; i++) {
+        if (w && cmp_result(&x.occ.v[i], &x.occ.v[w - 1]) == 0)
+            x.occ.v[w - 1].count += x.occ.v[i].count;
+        else
+            x.occ.v[w++] = x.occ.v[i];
+    }
+    *r = (Run){ .occ = x.occ.v, .n = w, .own = x.occ.v };
+    return true;
+}
+
+// ------- Evaluation -------
+
+// Intersect one group's runs from one source: walk the rarest plain word
+// and probe the others, so the cost follows the smallest list.  runs[k]
+// belongs to word k of the group, term by term; `snap` is the source's
+// index file (NULL for an in-memory segment).
+static bool eval_runs(const QTerm *terms, int n_terms, Run *runs,
+                      const IndexSnapshot *snap, Results *out)
+{
+    Run *lead = NULL;
+    for (int t = 0, k = 0; t < n_terms; k += terms[t++].n) {
+        for (int w = 0; !terms[t].neg && w < terms[t].n; w++) {
+            if (!lead || runs[k + w].n < lead->n) lead = &runs[k + w];
+        }
+    }
+    if (!lead || lead->n == 0) return true;
+
+    for (size_t i = 0; i < lead->n; i++) {
+        uint32_t f = run_file(lead, i);
+        uint64_t s = run_sent(lead, i);
+
+        uint32_t fid = snap ? ix_file(snap, f) : f;
+        if (fid == IX_SHADOWED) continue;
+        lead->pos = i;
+
+        /* every plain word in this sentence, then the phrases in order */
+        bool hit = true;
+        for (int t = 0, k = 0; hit && t < n_terms; k += terms[t++].n) {
+            for (int w = 0; hit && !terms[t].neg && w < terms[t].n; w++) {
+                if (&runs[k + w] != lead) hit = run_seek(&runs[k + w], f, s);
+            }
+        }
+        for (int t = 0, k = 0; hit && t < n_terms; k += terms[t++].n) {
+            if (!terms[t].neg && terms[t].n > 1) hit = phrase_at(&runs[k], terms[t].n);
+        }
+        /* ... and no NOT term */
+        for (int t = 0, k = 0; hit && t < n_terms; k += terms[t++].n) {
+            if (!terms[t].neg) continue;
+            bool all = true;
+            for (int w = 0; all && w < terms[t].n; w++) {
+                all = run_seek(&runs[k + w], f, s);
+            }
+            if (all && terms[t].n > 1) all = phrase_at(&runs[k], terms[t].n);
+            hit = !all;
+        }
+        if (!hit) continue;
+
+        /* the sentence counts every plain word's occurrences in it */
+        int count = 0;
+        for (int t = 0, k = 0; t < n_terms; k += terms[t++].n) {
+            for (int w = 0; !terms[t].neg && w < terms[t].n; w++) {
+                Run *r = &runs[k + w];
+                count += run_occ(r, r->pos)->count;
+            }
+        }
+
+        WordOccurrence occ = *run_occ(lead, i);
+        if (!occ.context) continue;     // a damaged index file's
+        occ.file_id = fid;
+        occ.count   = count;
+        if (!results_push(out, occ)) return false;
+    }
+    return true;
+}
+
+// Evaluate one group in every source of ss and append its matches to
+// `out`.  The caller is inside an epoch: in-memory segments' blocks, and
+// the positions and contexts taken from them, stay valid until it ends.
+static bool eval_group(const SegSet *ss, const QTerm *terms, int n_terms,
+                       Results *out)
+{
+    int n_words = 0;
+    for (int t = 0; t < n_terms; t++) n_words += terms[t].n;
+
+    Run *runs = calloc((size_t)n_words, sizeof(*runs));
+    if (!runs) {
+        perror("search_query: calloc");
+        return false;
+    }
+
+    /* every source holds its own files: each is intersected alone */
+    bool ok = true;
+    for (size_t i = 0; ok && i < ss->n_mem; i++) {
+        for (int t = 0, k = 0; t < n_terms; t++) {
+            for (int w = 0; w < terms[t].n; w++, k++) {
+                Run *r = &runs[k];
+                free(r->own);
+                free(r->blk);
+                *r = (Run){ 0 };
+                if (terms[t].glob) {
+                    ok &= expand_run(ss->mem[i], NULL, terms[t].words[w], r);
+                    continue;
+                }
+                seg_postings(ss->mem[i], terms[t].words[w], &r->view);
+                r->n      = r->view.n;
+                r->blk_no = SIZE_MAX;
+                if (r->n && !(r->blk = malloc(POSTING_BLOCK * sizeof(*r->blk)))) {
+                    perror("search_query: malloc");
+                    ok = false;
+                }
+            }
+        }
+        if (ok) ok = eval_runs(terms, n_terms, runs, NULL, out);
+    }
+
+    for (size_t i = 0; ok && i < ss->n_snap; i++) {
+        IndexSnapshot *s = ss->snap[i];
+        for (int t = 0, k = 0; t < n_terms; t++) {
+            for (int w = 0; w < terms[t].n; w++, k++) {
+                const char *word = terms[t].words[w];
+                free(runs[k].own);
+                free(runs[k].blk);
+                runs[k] = (Run){ 0 };
+                if (terms[t].glob) {
+                    ok &= expand_run(NULL, s, word, &runs[k]);
+                    continue;
+                }
+                Run *r = &runs[k];
+                ix_view(s, word, strlen(word), &r->ixv);
+                r->n      = r->ixv.n;
+                r->disk   = true;
+                r->blk_no = SIZE_MAX;
+                if (r->n && !(r->blk = malloc(POSTING_BLOCK * sizeof(*r->blk)))) {
+                    perror("search_query: malloc");
+                    ok = false;
+                }
+            }
+        }
+        if (ok) ok = eval_runs(terms, n_terms, runs, s, out);
+    }
+
+    for (int k = 0; k < n_words; k++) {
+        free(runs[k].own);
+        free(runs[k].blk);
+    }
+    free(runs);
+    return ok;
+}
+
+// ------- Parsing -------
+
+static inline bool is_blank(char c) { return c == ' ' || c == '\t'; }
+
+// Split `buf` (modified in place) into terms and OR-groups; every word
+// goes to `words`.  Prints the problem to `out` and returns false on a
+// syntax error.
+static bool parse_query(char *buf, const char **words, QTerm *terms,
+                        int *n_terms, QGroup *groups, int *n_groups, FILE *out)
+{
+    bool  want_term = true, neg = false;
+    int   nw = 0, nt = 0, ng = 0;
+    char *p = buf;
+
+    groups[ng++] = (QGroup){ 0, 0 };
+    for (;;) {
+        while (is_blank(*p)) p++;
+        if (!*p) break;
+
+        if (*p == '"') {                       // "a phrase of words"
+            char *close = strchr(++p, '"');
+            if (!close) {
+                fprintf(out, RED "  [!] Query syntax: unterminated quote.\n\n"
+                        RESET);
+                return false;
+            }
+            *close = '\0';
+            QTerm t = { .words = words + nw, .neg = neg };
+            for (char *w = p; ; ) {
+                while (is_blank(*w)) w++;
+                if (!*w) break;
+                if (t.n == QUERY_MAX_PHRASE) {
+                    fprintf(out, RED "  [!] Query syntax: phrases are limited "
+                            "to %d words.\n\n" RESET, QUERY_MAX_PHRASE);
+                    return false;
+                }
+                if (strpbrk(w, GLOB_CHARS)) {
+                    fprintf(out, RED "  [!] Query syntax: wildcards can't be "
+                            "used in phrases.\n\n" RESET);
+                    return false;
+                }
+                words[nw++] = w;
+                t.n++;
+                while (*w && !is_blank(*w)) w++;
+                if (*w) *w++ = '\0';
+            }
+            if (t.n == 0) {
+                fprintf(out, RED "  [!] Query syntax: empty phrase.\n\n"
+                        RESET);
+                return false;
+            }
+            terms[nt++] = t;
+            groups[ng - 1].n++;
+            neg = want_term = false;
+            p = close + 1;
+            continue;
+        }
+
+        char *tok = p;
+        while (*p && !is_blank(*p)) p++;
+        if (*p) *p++ = '\0';
+
+        if (!strcmp(tok, "OR") || !strcmp(tok, "AND")) {
+            if (want_term) {
+                fprintf(out, RED "  [!] Query syntax: '%s' needs a term "
+                        "before it.\n\n" RESET, tok);
+                return false;
+            }
+            if (tok[0] == 'O') groups[ng++] = (QGroup){ nt, 0 };
+            want_term = true;
+        } else if (!strcmp(tok, "NOT")) {
+            if (neg) {
+                fprintf(out, RED "  [!] Query syntax: NOT NOT.\n\n" RESET);
+                return false;
+            }
+            neg = want_term = true;
+        } else {
+            words[nw] = tok;
+            terms[nt++] = (QTerm){
+                .words = words + nw++,
+                .n     = 1,
+                .neg   = neg,
+                .glob  = strpbrk(tok, GLOB_CHARS) != NULL
+            };
+            groups[ng - 1].n++;
+            neg = want_term = false;
+        }
+    }
+    if (want_term) {
+        fprintf(out, RED "  [!] Query syntax: the query ends without a "
+                "term.\n\n" RESET);
+        return false;
+    }
+    for (int g = 0; g < ng; g++) {
+        bool plain = false;
+        for (int k = 0; k < groups[g].n; k++)
+            plain |= !terms[groups[g].first + k].neg;
+        if (!plain) {
+            fprintf(out, RED "  [!] Query syntax: every OR-branch needs a "
+                    "term without NOT.\n\n" RESET);
+            return false;
+        }
+    }
+    *n_terms  = nt;
+    *n_groups = ng;
+    return true;
+}
+
+// Cut a trailing result count ("war peace 5") off buf and return it, or
+// DEFAULT_TOP_K if there is none.  A lone number stays a search term.
+static size_t take_count(char *buf)
+{
+    char *end = buf + strlen(buf);
+    while (end > buf && is_blank(end[-1])) end--;
+    char *num = end;
+    while (num > buf && num[-1] >= '0' && num[-1] <= '9') num--;
+    if (num == end || num == buf || !is_blank(num[-1])) return DEFAULT_TOP_K;
+
+    size_t k = strtoul(num, NULL, 10);
+    while (num > buf && is_blank(num[-1])) num--;
+    if (num == buf) return DEFAULT_TOP_K;
+    *num = '\0';
+    return k;
+}
+
+// Evaluate the query in buf (modified) and print its results, under
+// `label`, to `out`.
+static bool run_query(HashMap *m, char *buf, const char *label, size_t k,
+                      const CensoredSet *censored, FILE *out)
+{
+    size_t  max    = strlen(buf) / 2 + 1;         // tokens are space-separated
+    const char **words = malloc(max * sizeof(*words));
+    QTerm  *terms  = malloc(max * sizeof(*terms));
+    QGroup *groups = malloc(max * sizeof(*groups));
+    Results res    = { 0 };
+    TopK    top    = { 0 };
+    bool    ok     = false;
+    int     n_terms = 0, n_groups = 0;
+
+    if (!words || !terms || !groups) {
+        perror("search_query: malloc");
+        goto out;
+    }
+    if (!parse_query(buf, words, terms, &n_terms, groups, &n_groups, out))
+        goto out;
+
+    for (int t = 0; t < n_terms; t++) {
+        for (int w = 0; w < terms[t].n; w++) {
+            if (censored && is_censored(censored, terms[t].words[w])) {
+                fprintf(out, RED "  [!] Search term '%s' is censored.\n\n"
+                        RESET, terms[t].words[w]);
+                goto out;
+            }
+        }
+    }
+
+    /* a lone word is ranked straight from its postings */
+    if (n_terms == 1 && terms[0].n == 1 && !terms[0].glob) {
+        search_word(m, terms[0].words[0], k, out);
+        ok = true;
+        goto out;
+    }
+
+    /* results point into in-memory segments until they are printed */
+    epoch_enter();
+    SegSet *ss = segments_acquire(m);
+    for (int g = 0; g < n_groups; g++) {
+        if (!eval_group(ss, terms + groups[g].first, groups[g].n, &res)) {
+            epoch_exit();
+            goto out;
+        }
+    }
+
+    /* in file order; a sentence matched by several OR-branches is
+     * listed once */
+    if (res.n > 1) qsort(res.v, res.n, sizeof(*res.v), cmp_result);
+    if (n_groups > 1 && res.n > 1) {
+        size_t w = 1;
+        for (size_t i = 1; i < res.n; i++) {
+            if (cmp_result(&res.v[i], &res.v[w - 1]) != 0) res.v[w++] = res.v[i];
+        }
+        res.n = w;
+    }
+
+    /* the matching files, ranked as if the query were one term */
+    RankStats st;
+    rank_stats(m, &st);
+    st.df = rank_count_files(res.v, res.n);
+    topk_init(&top, k);
+    ok = rank_postings(&top, &st, res.v, res.n);
+    if (ok) print_ranked(out, m, label, &top);
+    epoch_exit();
+
+out:
+    topk_free(&top);
+    free(res.v);
+    free(groups);
+    free(terms);
+    free((void *)words);
+    return ok;
+}
+
+// Cache key of a query: its tokens joined by single spaces, then k
+static char *cache_key(const char *label, size_t k)
+{
+    size_t len = strlen(label);
+    char  *key = malloc(len + 24);
+    if (!key) return NULL;
+
+    char *w = key;
+    for (const char *p = label; *p; p++) {
+        if (is_blank(*p) && (w == key || w[-1] == ' ')) continue;
+        *w++ = is_blank(*p) ? ' ' : *p;
+    }
+    if (w > key && w[-1] == ' ') w--;
+    snprintf(w, 24, "\x1f%zu", k);
+    return key;
+}
+
+bool search_query(HashMap *m, const char *query, const CensoredSet *censored,
+                  QueryCache *cache, FILE *out)
+{
+    char   *buf   = strdup(query);
+    char   *label = NULL, *key = NULL;
+    char   *text  = NULL;
+    size_t  text_len = 0;
+    bool    ok    = false;
+
+    if (!buf) {
+        perror("search_query: strdup");
+        return false;
+    }
+    size_t k = take_count(buf);
+    if (!(label = strdup(buf))) {
+        perror("search_query: strdup");
+        goto out;
+    }
+
+    /* a query seen since the index last changed is answered from the
+     * cache; anything else is rendered to memory so it can be kept */
+    uint64_t gen = index_generation(m);
+    if (cache && (key = cache_key(label, k)) &&
+        qc_write(cache, key, gen, out)) {
+        ok = true;
+        goto out;
+    }
+    FILE *mem = key ? open_memstream(&text, &text_len) : NULL;
+
+    ok = run_query(m, buf, label, k, censored, mem ? mem : out);
+    if (mem) {
+        if (fclose(mem) == 0) {
+            fwrite(text, 1, text_len, out);
+            if (ok) qc_put(cache, key, gen, text, text_len);
+        } else {
+            perror("search_query: open_memstream");
+            ok = false;
+        }
+    }
+
+out:
+    free(text);
+    free(key);
+    free(label);
+    free(buf);
+    return ok;
+}
@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809L  // for strdup
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "query_cache.h"
+#include "config.h"
+#include "hash.h"
+
+// Hash chains: a power of two above the entry limit keeps them short
+#define QC_SLOTS  (2 * QUERY_CACHE_ENTRIES)
+
+struct QcEntry {
+    char     *key;
+    uint64_t  hash;
+    char     *text;
+    size_t    len;
+    QcEntry  *chain;            // next in the slot's chain
+    QcEntry  *prev, *next;      // LRU list neighbours
+};
+
+void qc_init(QueryCache *c)
+{
+    *c = (QueryCache){ 0 };
+    pthread_mutex_init(&c->lock, NULL);
+    c->slots = calloc(QC_SLOTS, sizeof(*c->slots));
+    if (!c->slots) perror("qc_init: calloc");    // caching stays off
+}
+
+static void lru_unlink(QueryCache *c, QcEntry *e)
+{
+    if (e->prev) e->prev->next = e->next; else c->head = e->next;
+    if (e->next) e->next->prev = e->prev; else c->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(QueryCache *c, QcEntry *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head) c->head->prev = e; else c->tail = e;
+    c->head = e;
+}
+
+// Unlink e from its chain and the LRU list and free it
+static void drop(QueryCache *c, QcEntry *e)
+{
+    QcEntry **p = &c->slots[e->hash & (QC_SLOTS - 1)];
+    while (*p != e) p = &(*p)->chain;
+    *p = e->chain;
+    lru_unlink(c, e);
+    c->n--;
+    c->bytes -= e->len;
+    free(e->key);
+    free(e->text);
+    free(e);
+}
+
+static void clear_locked(QueryCache *c)
+{
+    while (c->head) drop(c, c->head);
+}
+
+// Entries of an older generation are stale all at once
+static void sync_gen(QueryCache *c, uint64_t gen)
+{
+    if (gen > c->gen) {
+        clear_locked(c);
+        c->gen = gen;
+    }
+}
+
+static QcEntry *find(QueryCache *c, const char *key, uint64_t h)
+{
+    for (QcEntry *e = c->slots[h & (QC_SLOTS - 1)]; e; e = e->chain) {
+        if (e->hash == h && strcmp(e->key, key) == 0) return e;
+    }
+    return NULL;
+}
+
+void qc_clear(QueryCache *c)
+{
+    pthread_mutex_lock(&c->lock);
+    if (c->slots) clear_locked(c);
+    c->gen = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void qc_destroy(QueryCache *c)
+{
+    qc_clear(c);
+    free(c->slots);
+    pthread_mutex_destroy(&c->lock);
+}
+
+void qc_counts(QueryCache *c, size_t *hits, size_t *misses)
+{
+    pthread_mutex_lock(&c->lock);
+    *hits   = c->hits;
+    *misses = c->misses;
+    pthread_mutex_unlock(&c->lock);
+}
+
+bool qc_write(QueryCache *c, const char *key, uint64_t gen, FILE *out)
+{
+    uint64_t h   = fnv1a(key);
+    bool     hit = false;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->slots) {
+        sync_gen(c, gen);
+        QcEntry *e = (gen == c->gen) ? find(c, key, h) : NULL;
+        if (e) {
+            lru_unlink(c, e);
+            lru_push_front(c, e);
+            fwrite(e->text, 1, e->len, out);
+            hit = true;
+        }
+        if (hit) c->hits++;
+        else     c->misses++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return hit;
+}
+
+void qc_put(QueryCache *c, const char *key, uint64_t gen,
+            const char *text, size_t len)
+{
+    if (len > QUERY_CACHE_BYTES / 8) return;     // one entry ≤ 1/8 budget
+
+    QcEntry *e = calloc(1, sizeof(*e));
+    if (!e || !(e->key = strdup(key)) || !(e->text = malloc(len))) {
+        perror("qc_put: alloc");
+        if (e) free(e->key);
+        free(e);
+        return;
+    }
+    memcpy(e->text, text, len);
+    e->len  = len;
+    e->hash = fnv1a(key);
+
+    pthread_mutex_lock(&c->lock);
+    if (c->slots) sync_gen(c, gen);
+    if (!c->slots || gen != c->gen) {             // computed on an old index
+        pthread_mutex_unlock(&c->lock);
+        free(e->key);
+        free(e->text);
+        free(e);
+        return;
+    }
+    QcEntry *old = find(c, key, e->hash);
+    if (old) drop(c, old);
+
+    QcEntry **slot = &c->slots[e->hash & (QC_SLOTS - 1)];
+    e->chain = *slot;
+    *slot    = e;
+    lru_push_front(c, e);
+    c->n++;
+    c->bytes += len;
+
+    while (c->n > QUERY_CACHE_ENTRIES || c->bytes > QUERY_CACHE_BYTES) {
+        drop(c, c->tail);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "rank.h"
+#include "config.h"
+
+// ANSI escape codes for styling
+#define BOLD  "\033[1m"
+#define CYAN  "\033[36m"
+#define GREEN "\033[32m"
+#define RED   "\033[31m"
+#define GRAY  "\033[90m"
+#define RESET "\033[0m"
+
+void rank_stats(HashMap *m, RankStats *st)
+{
+    uint64_t total = 0;
+    *st = (RankStats){ .files = &m->files };
+
+    uint32_t n = fr_count(&m->files);
+    for (uint32_t id = 0; id < n; id++) {
+        FileInfo *fi = fr_get(&m->files, id);
+        uint64_t  w  = fi ? atomic_load_explicit(&fi->words,
+                                                 memory_order_relaxed) : 0;
+        if (!w) continue;
+        total += w;
+        st->n_files++;
+    }
+    st->avg_words = st->n_files ? (double)total / st->n_files : 1.0;
+}
+
+// BM25 of tf matches in file_id (see rank.h)
+static double bm25(const RankStats *st, uint64_t tf, uint32_t file_id)
+{
+    double n_files = st->n_files > st->df ? st->n_files : st->df;
+    double df      = st->df;
+    double idf     = log(1.0 + (n_files - df + 0.5) / (df + 0.5));
+
+    FileInfo *fi  = fr_get(st->files, file_id);
+    uint64_t  w   = fi ? atomic_load_explicit(&fi->words,
+                                              memory_order_relaxed) : 0;
+    double    rel = w ? (double)w / st->avg_words : 1.0;  // unknown ⇒ average
+    double    f   = (double)tf;
+    return idf * f * (BM25_K1 + 1.0) /
+           (f + BM25_K1 * (1.0 - BM25_B + BM25_B * rel));
+}
+
+uint32_t rank_count_files(const WordOccurrence *occ, size_t n)
+{
+    uint32_t df = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || occ[i].file_id != occ[i - 1].file_id) df++;
+    }
+    return df;
+}
+
+// ------- Bounded heap -------
+
+// Is a a worse result than b?  Ties go to the lower file ID.
+static inline bool worse(const FileHits *a, const FileHits *b)
+{
+    if (a->score != b->score) return a->score < b->score;
+    return a->file_id > b->file_id;
+}
+
+static int cmp_best(const void *a, const void *b)
+{
+    const FileHits *x = a, *y = b;
+    return worse(x, y) ? 1 : worse(y, x) ? -1 : 0;
+}
+
+static void sift_down(TopK *t, size_t i)
+{
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+        if (l < t->n && worse(&t->v[l], &t->v[min])) min = l;
+        if (r < t->n && worse(&t->v[r], &t->v[min])) min = r;
+        if (min == i) return;
+        FileHits tmp = t->v[i];
+        t->v[i]   = t->v[min];
+        t->v[min] = tmp;
+        i = min;
+    }
+}
+
+static void sift_up(TopK *t, size_t i)
+{
+    while (i > 0 && worse(&t->v[i], &t->v[(i - 1) / 2])) {
+        size_t    p   = (i - 1) / 2;
+        FileHits  tmp = t->v[i];
+        t->v[i] = t->v[p];
+        t->v[p] = tmp;
+        i = p;
+    }
+}
+
+void topk_init(TopK *t, size_t k)
+{
+    *t = (TopK){ .k = k };
+}
+
+void topk_free(TopK *t)
+{
+    free(t->v);
+    *t = (TopK){ 0 };
+}
+
+// Keep h if it is among the best k so far
+static bool topk_offer(TopK *t, const FileHits *h)
+{
+    t->seen++;
+    if (t->k && t->n == t->k) {
+        if (worse(&t->v[0], h)) {       // displace the current worst
+            t->v[0] = *h;
+            sift_down(t, 0);
+        }
+        return true;
+    }
+    if (t->n == t->cap) {
+        size_t new_cap = t->cap ? t->cap * 2 : (t->k && t->k < 16 ? t->k : 16);
+        FileHits *tmp = realloc(t->v, new_cap * sizeof(*tmp));
+        if (!tmp) {
+            perror("topk_offer: realloc");
+            return false;
+        }
+        t->v   = tmp;
+        t->cap = new_cap;
+    }
+    t->v[t->n++] = *h;
+    sift_up(t, t->n - 1);
+    return true;
+}
+
+bool rank_postings(TopK *t, const RankStats *st,
+                   const WordOccurrence *occ, size_t n)
+{
+    for (size_t i = 0, j; i < n; i = j) {
+        uint64_t tf = 0;
+        for (j = i; j < n && occ[j].file_id == occ[i].file_id; j++)
+            tf += (uint64_t)occ[j].count;
+
+        FileHits h = {
+            .file_id = occ[i].file_id,
+            .tf      = tf,
+            .occ     = occ + i,
+            .n       = j - i
+        };
+        h.score = bm25(st, tf, h.file_id);
+        if (!topk_offer(t, &h)) return false;
+    }
+    return true;
+}
+
+// ------- Printing -------
+
+void print_ranked(FILE *out, HashMap *m, const char *label, TopK *t)
+{
+    if (t->n == 0) {
+        fprintf(out, "\n" RED "No results for '%s'." RESET "\n\n", label);
+        return;
+    }
+
+    if (t->seen > t->n) {
+        fprintf(out, "\n" BOLD CYAN "Search results for '%s' (top %zu of %zu "
+                "files):" RESET "\n\n", label, t->n, t->seen);
+    } else {
+        fprintf(out, "\n" BOLD CYAN "Search results for '%s':" RESET "\n\n",
+                label);
+    }
+
+    qsort(t->v, t->n, sizeof(*t->v), cmp_best);
+    for (size_t f = 0; f < t->n; f++) {
+        const FileHits *h = &t->v[f];
+        fprintf(out, BOLD GREEN "File: %s" RESET " " GRAY "(%zu×, score %.3f)"
+                RESET "\n", fr_path(&m->files, h->file_id), h->n, h->score);
+        fprintf(out, "  " BOLD "Contexts:" RESET "\n");
+
+        if (t->k == 0) {                  // unbounded: every sentence, in order
+            for (size_t i = 0; i < h->n; i++) {
+                WordOccurrence o = h->occ[i];
+                if (o.context) fprintf(out, "    - \"%s\"\n", o.context);
+            }
+            fputc('\n', out);
+            continue;
+        }
+
+        /* the sentences with the most matches, by insertion */
+        WordOccurrence best[SNIPPETS_PER_FILE];
+        size_t         nb = 0;
+        for (size_t i = 0; i < h->n; i++) {
+            WordOccurrence o = h->occ[i];
+            if (!o.context) continue;
+            size_t at = nb;
+            while (at > 0 && cmp_occ(&o, &best[at - 1]) < 0) at--;
+            if (at == SNIPPETS_PER_FILE) continue;
+            if (nb < SNIPPETS_PER_FILE) nb++;
+            for (size_t k = nb - 1; k > at; k--) best[k] = best[k - 1];
+            best[at] = o;
+        }
+        for (size_t i = 0; i < nb; i++) {
+            fprintf(out, "    - \"%s\"\n", best[i].context);
+        }
+        if (h->n > nb) fprintf(out, GRAY "    … %zu more" RESET "\n", h->n - nb);
+        fputc('\n', out);
+    }
+}
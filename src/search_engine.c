@@ -5,11 +5,21 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <sched.h>
+#include <errno.h>
 
 #include "search_engine.h"
 #include "config.h"
+#include "hash.h"
+#include "epoch.h"
+#include "index_file.h"
+#include "varint.h"
+#include "rank.h"
+#include "stats.h"
+#include "mem.h"
+#include "segment.h"
 
-#define MAX_LOAD_FACTOR 0.75
+#define MAX_LOAD_FACTOR 0.5    // linear probing degrades past this
 
 // ANSI escape codes for styling
 #define BOLD       "\033[1m"
@@ -20,77 +30,338 @@
 #define RED        "\033[31m"
 #define GRAY       "\033[90m"
 
-// FNV-1a 64-bit hash for strings
-static inline uint64_t fnv1a(const char *s) {
-    uint64_t h = 14695981039346656037ULL;
-    while (*s) {
-        h ^= (unsigned char)*s++;
-        h *= 1099511628211ULL;
+// Slots of the old table moved by every writer while a resize is running
+#define MIGRATE_STEP 8
+
+// Slot tag: the word's hash, never 0 (0 marks an empty slot)
+static inline uint64_t slot_hash(uint64_t h) { return h ? h : 1; }
+
+// First 8 bytes of a word, zero padded.  Words never contain NUL, so for
+// words shorter than 8 bytes equal prefixes mean equal words.
+static inline uint64_t key_prefix(const char *word, size_t len)
+{
+    uint64_t p = 0;
+    memcpy(&p, word, len < sizeof p ? len : sizeof p);
+    return p;
+}
+
+// Bytes of a table's slot arrays, charged to MEM_TABLE while it lives
+static inline size_t table_bytes(size_t cap)
+{
+    HashTable *t = NULL;
+    return sizeof(*t) + cap * (sizeof(*t->hashes) + sizeof(*t->prefix) +
+                               sizeof(*t->entries));
+}
+
+static HashTable *alloc_table(size_t cap)
+{
+    HashTable *t = calloc(1, sizeof(*t));
+    if (!t) {
+        perror("alloc_table: calloc");
+        return NULL;
+    }
+    t->cap     = cap;
+    t->hashes  = calloc(cap, sizeof(*t->hashes));
+    t->prefix  = calloc(cap, sizeof(*t->prefix));
+    t->entries = calloc(cap, sizeof(*t->entries));
+    if (!t->hashes || !t->prefix || !t->entries) {
+        perror("alloc_table: calloc slots");
+        free((void *)t->hashes);
+        free(t->prefix);
+        free((void *)t->entries);
+        free(t);
+        return NULL;
     }
-    return h;
+    atomic_init(&t->prev, NULL);
+    atomic_init(&t->migrate_next, 0);
+    atomic_init(&t->migrated, 0);
+    mem_add(MEM_TABLE, (int64_t)table_bytes(cap));
+    return t;
 }
 
-static void resize_map(HashMap *m)
+// Free a table's slot arrays (not the entries – they live in the arenas)
+static void free_table(void *arg)
 {
-    const size_t old_cap = m->cap;
-    HashBucket  *old     = m->buckets;
+    HashTable *t = arg;
+    mem_add(MEM_TABLE, -(int64_t)table_bytes(t->cap));
+    free((void *)t->hashes);
+    free(t->prefix);
+    free((void *)t->entries);
+    free(t);
+}
 
-    const size_t new_cap = old_cap * 2;
-    HashBucket  *newb    = calloc(new_cap, sizeof *newb);
-    if (!newb) { perror("resize_map: calloc"); return; }
+// Wait for the entry of a slot whose hash was just claimed by another thread
+static HashEntry *slot_entry(HashTable *t, size_t i)
+{
+    HashEntry *e;
+    while (!(e = atomic_load_explicit(&t->entries[i], memory_order_acquire))) {
+        sched_yield();
+    }
+    return e;
+}
 
-    /* 0.  Initialise locks on the new buckets */
-    for (size_t i = 0; i < new_cap; ++i) {
-        if (pthread_rwlock_init(&newb[i].lock, NULL) != 0) {
-            perror("resize_map: rwlock_init");
-            /* roll back already-initialised locks */
-            while (i--) pthread_rwlock_destroy(&newb[i].lock);
-            free(newb);
-            return;
+// Does slot i hold word[0..len)?  Hash tags are compared by the caller;
+// the prefix settles short words without touching the string.
+static bool slot_matches(HashTable *t, size_t i, HashEntry *e,
+                         const char *word, size_t len, uint64_t prefix)
+{
+    if (t->prefix[i] != prefix) return false;
+    if (len < sizeof prefix)    return true;
+    return strncmp(e->word, word, len) == 0 && e->word[len] == '\0';
+}
+
+// Lock-free probe of one table.  Slots being filled right now are skipped:
+// their insert has not completed yet.
+static HashEntry *probe(HashTable *t, uint64_t h,
+                        const char *word, size_t len, uint64_t prefix)
+{
+    size_t mask = t->cap - 1;
+    for (size_t n = 0, i = h & mask; n < t->cap; n++, i = (i + 1) & mask) {
+        uint64_t sh = atomic_load_explicit(&t->hashes[i], memory_order_acquire);
+        if (!sh) return NULL;
+        if (sh != h) continue;
+        HashEntry *e = atomic_load_explicit(&t->entries[i], memory_order_acquire);
+        if (e && slot_matches(t, i, e, word, len, prefix)) return e;
+    }
+    return NULL;
+}
+
+// Insert entry e (holding word[0..len)) into t unless the word is already
+// there, and return the entry that ends up in the table.
+static HashEntry *insert_if_absent(HashTable *t, uint64_t h,
+                                   const char *word, size_t len,
+                                   uint64_t prefix, HashEntry *e)
+{
+    size_t mask = t->cap - 1;
+    for (size_t n = 0, i = h & mask; n < t->cap; n++, i = (i + 1) & mask) {
+        uint64_t sh = atomic_load(&t->hashes[i]);
+        if (!sh) {
+            uint64_t expected = 0;
+            if (atomic_compare_exchange_strong(&t->hashes[i], &expected, h)) {
+                /* slot claimed: publish prefix, then the entry */
+                t->prefix[i] = prefix;
+                atomic_store_explicit(&t->entries[i], e, memory_order_release);
+                return e;
+            }
+            sh = expected;            // lost the slot: look at the winner
         }
+        if (sh != h) continue;
+        HashEntry *cur = slot_entry(t, i);
+        if (slot_matches(t, i, cur, word, len, prefix)) return cur;
     }
+    fprintf(stderr, "insert_if_absent: table full\n");
+    return NULL;
+}
 
-    /* 1.  Iterate over the old buckets */
-    for (size_t i = 0; i < old_cap; ++i) {
-        /* 1a. Lock the old bucket exclusively and detach its chain */
-        pthread_rwlock_wrlock(&old[i].lock);
-        HashEntry *chain = old[i].head;
-        old[i].head      = NULL;              /* bucket is now empty      */
-        pthread_rwlock_unlock(&old[i].lock);
+// Count one more drained slot of t->prev; the thread that drains the
+// last one detaches the old table and retires it.
+static void note_migrated(HashTable *t, HashTable *p)
+{
+    if (atomic_fetch_add(&t->migrated, 1) + 1 == p->cap) {
+        atomic_store(&t->prev, NULL);
+        epoch_retire(p, free_table);
+    }
+}
 
-        /* 1b. Re-insert every node into the new table */
-        while (chain) {
-            HashEntry *next = chain->next;
-            uint64_t   idx  = fnv1a(chain->word) % new_cap;
+// Copy slot i of old table p into t.  The stored hash and prefix are
+// reused, so nothing is rehashed.
+static void migrate_slot(HashTable *t, HashTable *p, size_t i)
+{
+    uint64_t sh = atomic_load(&p->hashes[i]);
+    if (sh) {
+        HashEntry *e = slot_entry(p, i);
+        insert_if_absent(t, sh, e->word, strlen(e->word), p->prefix[i], e);
+    }
+    note_migrated(t, p);
+}
 
-            pthread_rwlock_wrlock(&newb[idx].lock);
-            chain->next      = newb[idx].head;
-            newb[idx].head   = chain;
-            pthread_rwlock_unlock(&newb[idx].lock);
+// Help a running resize by draining the next few old slots.
+static void help_migrate(MemSegment *m)
+{
+    HashTable *t = atomic_load(&m->table);
+    HashTable *p = atomic_load(&t->prev);
+    if (!p) return;
 
-            chain = next;
-        }
-        /* 1c. The old bucket is empty – its lock can be destroyed */
-        pthread_rwlock_destroy(&old[i].lock);
+    STATS_START(t0);
+    for (int k = 0; k < MIGRATE_STEP; k++) {
+        size_t i = atomic_fetch_add(&t->migrate_next, 1);
+        if (i >= p->cap) break;
+        migrate_slot(t, p, i);
     }
-
-    /* 2.  Swap in the new table */
-    free(old);
-    m->buckets = newb;
-    m->cap     = new_cap;
+    STATS_STOP(ST_RESIZE_NS, t0);
 }
 
-// Check current load factor and resize if needed
-static void try_resize(HashMap *m) {
-    double load = (double)atomic_load(&m->n_items) / (double)m->cap;
+// Start a resize once the load factor is exceeded.  The new table is
+// published immediately and the old one is drained a few slots at a
+// time by later writers, so nobody waits for a full rehash.
+static void try_resize(MemSegment *m) {
+    HashTable *t = atomic_load(&m->table);
+    if (atomic_load(&t->prev)) {
+        help_migrate(m);
+        return;
+    }
+    double load = (double)atomic_load(&m->n_items) / (double)t->cap;
     if (load < MAX_LOAD_FACTOR) return;
 
     pthread_mutex_lock(&m->resize_lock);
-    load = (double)atomic_load(&m->n_items) / (double)m->cap;
-    if (load >= MAX_LOAD_FACTOR) {
-        resize_map(m);
+    if (atomic_load(&m->table) == t) {
+        HashTable *nt = alloc_table(t->cap * 2);
+        if (nt) {
+            atomic_store(&nt->prev, t);
+            atomic_store(&m->table, nt);
+            STATS_ADD(ST_RESIZES, 1);
+        }
     }
     pthread_mutex_unlock(&m->resize_lock);
+    help_migrate(m);
+}
+
+// Find word in the current table, or in the table being drained.
+// Caller must be inside epoch_enter/epoch_exit.
+static HashEntry *lookup(MemSegment *m, uint64_t h, const char *word, size_t len)
+{
+    uint64_t   prefix = key_prefix(word, len);
+    HashTable *t = atomic_load(&m->table);
+    HashTable *p = atomic_load(&t->prev);   // before probing t: see below
+
+    /* if p was NULL, every older entry was already in t when we looked */
+    HashEntry *e = probe(t, h, word, len, prefix);
+    if (!e && p) e = probe(p, h, word, len, prefix);
+    return e;
+}
+
+// Posting order: by file, then by sentence within the file
+static inline int occ_cmp(const WordOccurrence *x, const WordOccurrence *y)
+{
+    if (x->file_id != y->file_id) return x->file_id < y->file_id ? -1 : 1;
+    return (x->sent > y->sent) - (x->sent < y->sent);
+}
+
+// Allocate an empty entry for word[0..len) in arena `a`
+static HashEntry *new_entry(Arena *a, const char *word, size_t len)
+{
+    HashEntry *e = arena_alloc(a, sizeof(*e), MEM_TERMS);
+    if (!e) return NULL;
+    e->word = arena_strndup(a, word, len, MEM_TERMS);
+    atomic_init(&e->postings, NULL);
+    return e->word ? e : NULL;     // arena space goes with the map
+}
+
+// ------- Ordered term dictionary -------
+
+static inline TermNode *term_next(TermNode *_Atomic *link)
+{
+    return atomic_load_explicit(link, memory_order_acquire);
+}
+
+// Add entry e, holding word[0..len), to the term tree.  Called once per
+// word, by the thread whose entry won the table insert; missing nodes are
+// attached with a CAS, and one lost to a racing insert is reused.
+static void term_insert(MemSegment *m, Arena *a, const char *word, size_t len,
+                        HashEntry *e)
+{
+    TermNode *_Atomic *link  = &m->terms;
+    TermNode          *spare = NULL;
+    size_t             i     = 0;
+
+    while (i < len) {
+        unsigned char c = (unsigned char)word[i];
+        TermNode     *n = term_next(link);
+        if (!n) {
+            if (!spare && !(spare = arena_alloc(a, sizeof(*spare), MEM_TERMS))) {
+                perror("term_insert: arena node");
+                return;
+            }
+            spare->c = c;
+            atomic_init(&spare->lo, NULL);
+            atomic_init(&spare->eq, NULL);
+            atomic_init(&spare->hi, NULL);
+            atomic_init(&spare->entry, NULL);
+            if (!atomic_compare_exchange_strong(link, &n, spare)) continue;
+            n     = spare;
+            spare = NULL;
+        }
+        if      (c < n->c)  link = &n->lo;
+        else if (c > n->c)  link = &n->hi;
+        else if (++i < len) link = &n->eq;
+        else atomic_store_explicit(&n->entry, e, memory_order_release);
+    }
+}
+
+// In-order walk of the subtree at n: every word below it in byte order
+static void term_walk(TermNode *n, void (*fn)(const char *word, void *arg),
+                      void *arg)
+{
+    for (; n; n = term_next(&n->hi)) {
+        term_walk(term_next(&n->lo), fn, arg);
+        HashEntry *e = atomic_load_explicit(&n->entry, memory_order_acquire);
+        if (e) fn(e->word, arg);
+        term_walk(term_next(&n->eq), fn, arg);
+    }
+}
+
+// Find word or create its entry in arena `a`.  An entry found only in the
+// table being drained is copied forward, so every word has exactly one
+// entry however inserts and the migration interleave.
+// Caller must be inside epoch_enter/epoch_exit.
+static HashEntry *find_or_create(MemSegment *m, Arena *a, uint64_t h,
+                                 const char *word, size_t len)
+{
+    uint64_t   prefix = key_prefix(word, len);
+    HashEntry *fresh  = NULL;
+    HashEntry *e      = NULL;
+
+    for (;;) {
+        HashTable *t = atomic_load(&m->table);
+        HashTable *p = atomic_load(&t->prev);   // before probing t
+
+        if (!e) e = probe(t, h, word, len, prefix);
+        if (!e && p) e = probe(p, h, word, len, prefix);
+        if (!e) {
+            if (!fresh && !(fresh = new_entry(a, word, len))) {
+                perror("add_word_occurrence: arena entry");
+                return NULL;
+            }
+            e = fresh;
+        }
+        HashEntry *won = insert_if_absent(t, h, word, len, prefix, e);
+        if (!won) return NULL;
+        if (won == fresh) {
+            atomic_fetch_add(&m->n_items, 1);
+            term_insert(m, a, fresh->word, len, fresh);
+            fresh = NULL;                      // now owned by the table
+        }
+        e = won;
+
+        /* t superseded meanwhile: the drain may have passed our slot, so
+         * carry the entry into the new table too */
+        if (atomic_load(&m->table) == t) return e;
+    }
+}
+
+MemSegment *mem_segment_create(size_t cap, uint64_t id)
+{
+    MemSegment *s = calloc(1, sizeof(*s));
+    if (!s) {
+        perror("mem_segment_create: calloc");
+        return NULL;
+    }
+    size_t want = cap ? cap : DEFAULT_BUCKETS, pow2 = 16;
+    while (pow2 < want) pow2 *= 2;
+    HashTable *t = alloc_table(pow2);
+    if (!t) {
+        free(s);
+        return NULL;
+    }
+    s->id = id;
+    atomic_init(&s->table, t);
+    atomic_init(&s->n_items, 0);
+    atomic_init(&s->terms, NULL);
+    atomic_init(&s->pins, 0);
+    atomic_init(&s->frozen, false);
+    pthread_mutex_init(&s->resize_lock, NULL);
+    arena_set_init(&s->arenas);
+    return s;
 }
 
 HashMap *create_hash_map(size_t cap) {
@@ -99,192 +370,707 @@ HashMap *create_hash_map(size_t cap) {
         perror("create_hash_map: calloc");
         exit(EXIT_FAILURE);
     }
-    m->cap          = cap ? cap : DEFAULT_BUCKETS;
-    atomic_init(&m->n_items, 0);
-    m->buckets      = calloc(m->cap, sizeof(*m->buckets));
-    if (!m->buckets) {
-        perror("create_hash_map: calloc buckets");
-        free(m);
-        exit(EXIT_FAILURE);
+    for (size_t i = 0; i < ENTRY_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&m->entry_locks[i], NULL);
     }
-    pthread_mutex_init(&m->resize_lock, NULL);
+    fr_init(&m->files);
+    atomic_init(&m->generation, 0);
+    m->seg_buckets = cap;
+    if (!segments_init(m)) exit(EXIT_FAILURE);
+    return m;
+}
 
-    // init file deduplication set
-    pthread_mutex_init(&m->file_set_lock, NULL);
-    m->indexed_files = NULL;
-    m->n_files       = 0;
-    m->cap_files     = 0;
+// Lock guarding the occurrence array of the entry with hash h
+static inline pthread_mutex_t *entry_lock(HashMap *m, uint64_t h)
+{
+    return &m->entry_locks[(h >> 32) % ENTRY_LOCK_STRIPES];
+}
+
+// Sentences are stored with their line breaks collapsed to spaces
+static inline char collapse_nl(char c) {
+    return (c == '\n' || c == '\r') ? ' ' : c;
+}
 
-    for (size_t i = 0; i < m->cap; i++) {
-        pthread_rwlock_init(&m->buckets[i].lock, NULL);
+// Materialise a raw sentence span in `a` as a NUL-terminated, collapsed string
+static char *ctx_dup(Arena *a, const char *ctx, size_t len)
+{
+    char *s = arena_alloc(a, len + 1, MEM_CONTEXTS);
+    if (!s) return NULL;
+    for (size_t i = 0; i < len; i++) s[i] = collapse_nl(ctx[i]);
+    s[len] = '\0';
+    return s;
+}
+
+// Remember entries[0..n) on a file's list (FileInfo.terms: they now hold
+// its postings)
+static void note_file_terms(Arena *a, FileTerms *_Atomic *list,
+                            HashEntry **entries, size_t n)
+{
+    if (n == 0) return;
+
+    FileTerms *b = arena_alloc(a, sizeof(*b) + n * sizeof(b->entries[0]),
+                               MEM_FILE_TERMS);
+    if (!b) {
+        perror("merge_local_index: arena file terms");
+        return;
     }
-    return m;
+    b->n = n;
+    memcpy(b->entries, entries, n * sizeof(b->entries[0]));
+
+    FileTerms *head = atomic_load(list);
+    do {
+        b->next = head;
+    } while (!atomic_compare_exchange_weak(list, &head, b));
 }
 
-void add_word_occurrence(HashMap *m,
+void remove_file_postings(HashMap *m, uint32_t file_id)
+{
+    FileInfo *fi = fr_get(&m->files, file_id);
+    if (!fi) return;
+
+    /* under seg_lock, so a segment being written out either sees the
+     * removal or has it applied to what it was written to */
+    epoch_enter();
+    pthread_mutex_lock(&m->seg_lock);
+    SegSet     *ss  = segments_acquire(m);
+    MemSegment *seg = segments_of_file(ss, fi);
+    FileTerms  *b   = atomic_exchange(&fi->terms, NULL);
+
+    // only the words this file touched are visited
+    for (; seg && b; b = b->next) {
+        for (size_t k = 0; k < b->n; k++) {
+            HashEntry *e = b->entries[k];
+            uint64_t   h = slot_hash(fnv1a(e->word));
+            STATS_LOCK(entry_lock(m, h), ST_LOCK_WAITS, ST_LOCK_WAIT_NS);
+            pl_remove_file(&e->postings, file_id);  // reports a failure
+            pthread_mutex_unlock(entry_lock(m, h));
+        }
+    }
+    /* a frozen segment may be written out with them already read (the
+     * file may have left it for the live one, too): its file shadows them */
+    for (size_t i = 0; i < ss->n_mem; i++) {
+        if (atomic_load(&ss->mem[i]->frozen)) segments_note_removed(ss->mem[i], file_id);
+    }
+
+    // postings served from segment and index files are hidden instead
+    for (size_t i = 0; i < ss->n_snap; i++) ix_shadow_file(ss->snap[i], file_id);
+    atomic_store(&fi->seg, 0);
+    pthread_mutex_unlock(&m->seg_lock);
+    epoch_exit();
+    index_changed(m);
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+    HashEntry *x = *(HashEntry *const *)a, *y = *(HashEntry *const *)b;
+    return (x > y) - (x < y);
+}
+
+void fold_file_postings(HashMap *m, uint32_t file_id)
+{
+    FileInfo  *fi = fr_get(&m->files, file_id);
+    FileTerms *l  = fi ? atomic_exchange(&fi->unfolded, NULL) : NULL;
+
+    /* the words noted by the merges, each visited once */
+    size_t n = 0;
+    for (FileTerms *b = l; b; b = b->next) n += b->n;
+    if (n == 0) return;
+    HashEntry **v = malloc(n * sizeof(*v));
+    if (!v) {
+        perror("fold_file_postings: malloc");
+        return;
+    }
+    size_t k = 0;
+    for (FileTerms *b = l; b; b = b->next) {
+        memcpy(v + k, b->entries, b->n * sizeof(*v));
+        k += b->n;
+    }
+    qsort(v, n, sizeof(*v), cmp_entry);
+
+    epoch_enter();
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0 && v[i] == v[i - 1]) continue;
+        uint64_t h = slot_hash(fnv1a(v[i]->word));
+        STATS_LOCK(entry_lock(m, h), ST_LOCK_WAITS, ST_LOCK_WAIT_NS);
+        pl_fold(&v[i]->postings, file_id);  // reports a failure
+        pthread_mutex_unlock(entry_lock(m, h));
+    }
+    epoch_exit();
+    free(v);
+    index_changed(m);
+}
+
+bool add_word_occurrence(HashMap *m,
                          const char *word,
-                         const char *filename,
+                         uint32_t    file_id,
                          const char *context)
 {
-    try_resize(m);
+    /* the file's segment, pinned for the call */
+    FileInfo *fi = fr_get(&m->files, file_id);
+    if (!fi) return false;
+    MemSegment *seg = segments_pin_file(m, fi, strlen(context));
+
+    Arena *a = arena_set_local(&seg->arenas);
+    char *ctx = a ? ctx_dup(a, context, strlen(context)) : NULL;
+    if (!ctx) {
+        perror("add_word_occurrence: arena context");
+        segments_unpin_file(m, fi);
+        return false;
+    }
+
+    epoch_enter();
+    try_resize(seg);
+
+    uint64_t   h = slot_hash(fnv1a(word));
+    HashEntry *e = find_or_create(seg, a, h, word, strlen(word));
+    if (e) {
+        /* no file offset or positions here: the stored context's address
+         * names the sentence */
+        WordOccurrence occ = {
+            .context = ctx,
+            .file_id = file_id,
+            .count   = 1,
+            .sent    = (uint64_t)(uintptr_t)ctx
+        };
+        STATS_LOCK(entry_lock(m, h), ST_LOCK_WAITS, ST_LOCK_WAIT_NS);
+        if (!pl_append(&e->postings, &occ, 1, NULL)) {
+            perror("add_word_occurrence: postings");
+        }
+        pthread_mutex_unlock(entry_lock(m, h));
+        note_file_terms(a, &fi->terms, &e, 1);
+    }
+
+    epoch_exit();
+    segments_unpin_file(m, fi);
+    index_changed(m);
+    return true;
+}
+
+// ------- Per-worker local index -------
+
+#define LOCAL_INITIAL_SLOTS 1024   // power of two
+
+typedef struct {
+    uint32_t sent;         // index into LocalIndex.sents
+    int      count;
+    int      npos;         // its positions: the next npos of LocalTerm.pos
+} LocalOcc;
+
+typedef struct {
+    char     *word;        // NULL ⇒ empty slot
+    size_t    len;
+    uint64_t  hash;
+    LocalOcc *occ;
+    int       occ_cnt;
+    int       occ_cap;
+    uint32_t *pos;         // word positions of every occ, in order
+    size_t    pos_cnt, pos_cap;
+} LocalTerm;
+
+// One buffered sentence: a borrowed span, stored once at merge time
+typedef struct {
+    const char *ctx;       // valid until the merge
+    size_t      len;
+    const char *stored;    // copy in the map's arena (set by the merge)
+} LocalSent;
+
+struct LocalIndex {
+    LocalTerm  *slots;     // open addressing, linear probing
+    size_t      cap;       // power of two
+    size_t      n_terms;
+    size_t     *used;      // indices of occupied slots, in insertion order
+    LocalSent  *sents;     // sentences in order of appearance
+    size_t      n_sents, cap_sents;
+};
+
+// Two raw spans are the same context once line breaks are collapsed
+static bool spans_equal(const char *a, const char *b, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (collapse_nl(a[i]) != collapse_nl(b[i])) return false;
+    }
+    return true;
+}
+
+LocalIndex *local_index_create(void)
+{
+    LocalIndex *li = calloc(1, sizeof(*li));
+    if (!li) {
+        perror("local_index_create: calloc");
+        return NULL;
+    }
+    li->cap   = LOCAL_INITIAL_SLOTS;
+    li->slots = calloc(li->cap, sizeof(*li->slots));
+    li->used  = malloc(li->cap * sizeof(*li->used));
+    if (!li->slots || !li->used) {
+        perror("local_index_create: calloc slots");
+        free(li->slots);
+        free(li->used);
+        free(li);
+        return NULL;
+    }
+    return li;
+}
 
-    uint64_t idx = fnv1a(word) % m->cap;
-    pthread_rwlock_wrlock(&m->buckets[idx].lock);
+static bool local_grow(LocalIndex *li)
+{
+    size_t     new_cap = li->cap * 2;
+    LocalTerm *slots   = calloc(new_cap, sizeof(*slots));
+    size_t    *used    = malloc(new_cap * sizeof(*used));
+    if (!slots || !used) {
+        perror("local_index_add: calloc slots");
+        free(slots);
+        free(used);
+        return false;
+    }
+    // re-place using the stored hashes, keeping insertion order
+    for (size_t k = 0; k < li->n_terms; k++) {
+        LocalTerm *t = &li->slots[li->used[k]];
+        size_t i = t->hash & (new_cap - 1);
+        while (slots[i].word) i = (i + 1) & (new_cap - 1);
+        slots[i] = *t;
+        used[k]  = i;
+    }
+    free(li->slots);
+    free(li->used);
+    li->slots = slots;
+    li->used  = used;
+    li->cap   = new_cap;
+    return true;
+}
 
-    // find or create entry
-    HashEntry *e = m->buckets[idx].head;
-    while (e && strcmp(e->word, word) != 0) {
-        e = e->next;
+// Index of the sentence starting at ctx, appending it if it is new.
+// Words arrive sentence by sentence, so only the last one can match.
+static bool local_sentence(LocalIndex *li, const char *ctx, size_t len,
+                           uint32_t *out)
+{
+    if (li->n_sents && li->sents[li->n_sents - 1].ctx == ctx) {
+        *out = (uint32_t)(li->n_sents - 1);
+        return true;
     }
-    if (!e) {
-        e = calloc(1, sizeof(*e));
-        if (!e) {
-            perror("add_word_occurrence: calloc entry");
-            pthread_rwlock_unlock(&m->buckets[idx].lock);
-            return;
+    if (li->n_sents == li->cap_sents) {
+        size_t new_cap = li->cap_sents ? li->cap_sents * 2 : 256;
+        LocalSent *tmp = realloc(li->sents, new_cap * sizeof(*tmp));
+        if (!tmp) {
+            perror("local_index_add: realloc sents");
+            return false;
         }
-        e->word    = strdup(word);
-        e->occ_cap = 4;
-        e->occ     = malloc(e->occ_cap * sizeof(*e->occ));
-        if (!e->word || !e->occ) {
-            perror("add_word_occurrence: strdup/malloc");
-            free(e->word);
-            free(e->occ);
-            free(e);
-            pthread_rwlock_unlock(&m->buckets[idx].lock);
+        li->sents     = tmp;
+        li->cap_sents = new_cap;
+    }
+    li->sents[li->n_sents] = (LocalSent){ .ctx = ctx, .len = len };
+    *out = (uint32_t)li->n_sents++;
+    return true;
+}
+
+// Append one position to t's buffer
+static bool local_pos(LocalTerm *t, uint32_t pos)
+{
+    if (t->pos_cnt == t->pos_cap) {
+        size_t new_cap = t->pos_cap ? t->pos_cap * 2 : 8;
+        uint32_t *tmp = realloc(t->pos, new_cap * sizeof(*tmp));
+        if (!tmp) {
+            perror("local_index_add: realloc pos");
+            return false;
+        }
+        t->pos     = tmp;
+        t->pos_cap = new_cap;
+    }
+    t->pos[t->pos_cnt++] = pos;
+    return true;
+}
+
+void local_index_add(LocalIndex *li,
+                     const char *word,
+                     size_t      len,
+                     const char *ctx,
+                     size_t      ctx_len,
+                     uint32_t    pos)
+{
+    uint32_t sent;
+    if (!local_sentence(li, ctx, ctx_len, &sent)) return;
+    if (2 * (li->n_terms + 1) > li->cap && !local_grow(li)) return;
+
+    uint64_t   h = fnv1a_n(word, len);
+    size_t     i = h & (li->cap - 1);
+    LocalTerm *t;
+    for (;; i = (i + 1) & (li->cap - 1)) {
+        t = &li->slots[i];
+        if (!t->word) break;
+        if (t->hash == h && t->len == len && memcmp(t->word, word, len) == 0)
+            break;
+    }
+
+    if (!t->word) {
+        char *copy = strndup(word, len);
+        if (!copy) {
+            perror("local_index_add: strndup");
             return;
         }
-        e->occ_cnt = 0;
-        e->next    = m->buckets[idx].head;
-        m->buckets[idx].head = e;
-        atomic_fetch_add(&m->n_items, 1);
+        *t = (LocalTerm){ .word = copy, .len = len, .hash = h };
+        li->used[li->n_terms++] = i;
     }
 
-    // merge repeated context
-    if (e->occ_cnt > 0) {
-        WordOccurrence *last = &e->occ[e->occ_cnt - 1];
-        if (strcmp(last->filename, filename) == 0 &&
-            strcmp(last->context, context) == 0) {
+    // merge repeated context (same rule as append_occ_locked); an
+    // identical later sentence adds nothing to the positions
+    if (t->occ_cnt > 0) {
+        LocalOcc  *last = &t->occ[t->occ_cnt - 1];
+        LocalSent *ls   = &li->sents[last->sent];
+        if (last->sent == sent) {
             last->count++;
-        pthread_rwlock_unlock(&m->buckets[idx].lock);
-        return;
-            }
+            if (local_pos(t, pos)) last->npos++;
+            return;
+        }
+        if (ls->len == ctx_len && spans_equal(ls->ctx, ctx, ctx_len)) {
+            last->count++;
+            return;
+        }
     }
-
-    // grow occ array if needed
-    if (e->occ_cnt == e->occ_cap) {
-        size_t new_cap = e->occ_cap * 2;
-        WordOccurrence *tmp = realloc(e->occ, new_cap * sizeof(*e->occ));
+    if (t->occ_cnt == t->occ_cap) {
+        int new_cap = t->occ_cap ? t->occ_cap * 2 : 4;
+        LocalOcc *tmp = realloc(t->occ, (size_t)new_cap * sizeof(*tmp));
         if (!tmp) {
-            perror("add_word_occurrence: realloc occ");
-            pthread_rwlock_unlock(&m->buckets[idx].lock);
+            perror("local_index_add: realloc occ");
             return;
         }
-        e->occ     = tmp;
-        e->occ_cap = new_cap;
+        t->occ     = tmp;
+        t->occ_cap = new_cap;
     }
-
-    // append new occurrence
-    e->occ[e->occ_cnt++] = (WordOccurrence){
-        .filename = strdup(filename),
-        .context  = strdup(context),
-        .count    = 1
+    t->occ[t->occ_cnt++] = (LocalOcc){
+        .sent  = sent,
+        .count = 1,
+        .npos  = local_pos(t, pos) ? 1 : 0
     };
+}
 
-    pthread_rwlock_unlock(&m->buckets[idx].lock);
+// Drop all buffered terms and sentences but keep the allocations sized
+static void local_index_reset(LocalIndex *li)
+{
+    for (size_t k = 0; k < li->n_terms; k++) {
+        LocalTerm *t = &li->slots[li->used[k]];
+        free(t->word);
+        free(t->occ);
+        free(t->pos);
+        *t = (LocalTerm){ 0 };
+    }
+    li->n_terms = 0;
+    li->n_sents = 0;
 }
 
-WordOccurrence *get_word_occurrences(HashMap *m,
-                                     const char *word,
+bool merge_local_index(HashMap *m, LocalIndex *li, uint32_t file_id,
+                       const char *base, bool fold)
+{
+    /* the caller pinned the file (segments_pin_file), so its segment
+     * stays in memory until the merge is done */
+    FileInfo   *fi  = fr_get(&m->files, file_id);
+    MemSegment *seg = fi ? segments_file_segment(m, fi) : NULL;
+    Arena      *a   = seg ? arena_set_local(&seg->arenas) : NULL;
+    if (!a) {
+        if (!seg) fprintf(stderr, "merge_local_index: file %u is not pinned\n", file_id);
+        local_index_reset(li);
+        return false;
+    }
+    STATS_START(t0);
+
+    // every buffered sentence is stored once and shared by all its words
+    for (size_t k = 0; k < li->n_sents; k++) {
+        LocalSent *ls = &li->sents[k];
+        ls->stored = ctx_dup(a, ls->ctx, ls->len);
+        if (!ls->stored) {
+            perror("merge_local_index: arena context");
+            local_index_reset(li);
+            return false;
+        }
+    }
+
+    // entries that received postings, recorded for remove_file_postings;
+    // those left next to a repeat go after them, for fold_file_postings
+    HashEntry **touched = malloc(2 * li->n_terms * sizeof(*touched) + 1);
+    HashEntry **unfolded = touched ? touched + li->n_terms : NULL;
+    size_t      n_touched = 0, n_unfolded = 0;
+    if (!touched) perror("merge_local_index: malloc");
+
+    // a term's postings and position lists are built here, then copied
+    // into its posting list
+    uint8_t        *enc  = NULL;
+    size_t          enc_cap = 0;
+    WordOccurrence *batch = NULL;
+    int             batch_cap = 0;
+
+    for (size_t k = 0; k < li->n_terms; k++) {
+        LocalTerm *t = &li->slots[li->used[k]];
+
+        size_t need = poslist_bound(t->pos_cnt) + (size_t)t->occ_cnt * 5;
+        if (need > enc_cap) {
+            uint8_t *tmp = realloc(enc, need);
+            if (tmp) { enc = tmp; enc_cap = need; }
+        }
+        if (t->occ_cnt > batch_cap) {
+            WordOccurrence *tmp = realloc(batch, (size_t)t->occ_cnt * sizeof(*batch));
+            if (tmp) { batch = tmp; batch_cap = t->occ_cnt; }
+        }
+        if (t->occ_cnt > batch_cap) {
+            perror("merge_local_index: realloc");
+            continue;
+        }
+        bool   with_pos = need <= enc_cap;  // else: no positions
+        size_t len = 0, first = 0;
+        if (!with_pos) perror("merge_local_index: positions");
+        for (int j = 0; j < t->occ_cnt; j++) {
+            LocalSent *ls = &li->sents[t->occ[j].sent];
+            batch[j] = (WordOccurrence){
+                .context = (char *)ls->stored,
+                .file_id = file_id,
+                .count   = t->occ[j].count,
+                .sent    = (uint64_t)(ls->ctx - base),
+                .pos     = with_pos ? enc + len : NULL
+            };
+            if (with_pos) {
+                len += poslist_encode(enc + len, t->pos + first,
+                                      (size_t)t->occ[j].npos);
+            }
+            first += (size_t)t->occ[j].npos;
+        }
+
+        epoch_enter();
+        try_resize(seg);
+
+        uint64_t   h = slot_hash(t->hash);
+        HashEntry *e = find_or_create(seg, a, h, t->word, t->len);
+        if (e) {
+            bool rep = false;
+            STATS_LOCK(entry_lock(m, h), ST_LOCK_WAITS, ST_LOCK_WAIT_NS);
+            if (!pl_append(&e->postings, batch, (size_t)t->occ_cnt,
+                           fold ? NULL : &rep)) {
+                perror("merge_local_index: postings");
+            }
+            pthread_mutex_unlock(entry_lock(m, h));
+            if (touched) touched[n_touched++] = e;
+            if (unfolded && rep) unfolded[n_unfolded++] = e;
+        }
+
+        epoch_exit();
+    }
+    note_file_terms(a, &fi->terms, touched, n_touched);
+    note_file_terms(a, &fi->unfolded, unfolded, n_unfolded);
+    free(touched);
+    free(enc);
+    free(batch);
+    local_index_reset(li);
+    index_changed(m);
+    STATS_ADD(ST_MERGES, 1);
+    STATS_STOP(ST_INSERT_NS, t0);
+    return true;
+}
+
+void local_index_free(LocalIndex *li)
+{
+    if (!li) return;
+    local_index_reset(li);
+    free(li->slots);
+    free(li->used);
+    free(li->sents);
+    free(li);
+}
+
+WordOccurrence *set_word_occurrences(const SegSet *ss, const char *word,
                                      int *out_n)
 {
-    uint64_t idx = fnv1a(word) % m->cap;
-    pthread_rwlock_rdlock(&m->buckets[idx].lock);
-    HashEntry *e = m->buckets[idx].head;
-    while (e && strcmp(e->word, word) != 0) {
-        e = e->next;
+    size_t len = strlen(word);
+
+    /* lock-free: probe the dictionaries and decode the published blocks;
+     * writers never modify postings a reader can see */
+    epoch_enter();
+    PostingView *v  = malloc((ss->n_mem + 1) * sizeof(*v));
+    IxView      *iv = malloc((ss->n_snap + 1) * sizeof(*iv));
+    if (!v || !iv) {
+        perror("get_word_occurrences: malloc");
+        free(v);
+        free(iv);
+        epoch_exit();
+        *out_n = 0;
+        return NULL;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < ss->n_mem; i++) {
+        seg_postings(ss->mem[i], word, &v[i]);
+        total += v[i].n;
+    }
+    // on-disk segments and loaded index files answer next to them
+    for (size_t i = 0; i < ss->n_snap; i++) {
+        ix_view(ss->snap[i], word, len, &iv[i]);
+        total += iv[i].n;
     }
 
     WordOccurrence *res = NULL;
-    if (e) {
-        *out_n = e->occ_cnt;
-        res    = malloc(e->occ_cnt * sizeof(*res));
+    if (total > 0) {
+        res = malloc(total * sizeof(*res));
         if (res) {
-            memcpy(res, e->occ, e->occ_cnt * sizeof(*res));
+            size_t n = 0;
+            for (size_t i = 0; i < ss->n_mem; i++) {
+                pv_decode(&v[i], res + n);
+                n += v[i].n;
+            }
+            /* shadowed files are left out */
+            for (size_t i = 0; i < ss->n_snap; i++) {
+                n += ix_occurrences(&iv[i], res + n);
+            }
+            total = n;
         } else {
             perror("get_word_occurrences: malloc");
-            *out_n = 0;
+            total = 0;
         }
     }
-    pthread_rwlock_unlock(&m->buckets[idx].lock);
+    free(v);
+    free(iv);
+    epoch_exit();
+    *out_n = (int)total;
     return res;
 }
 
-void free_hash_map(HashMap *m) {
-    // destroy buckets
-    for (size_t i = 0; i < m->cap; i++) {
-        pthread_rwlock_destroy(&m->buckets[i].lock);
-        HashEntry *e = m->buckets[i].head;
-        while (e) {
-            HashEntry *tmp = e->next;
-            free(e->word);
-            for (int j = 0; j < e->occ_cnt; j++) {
-                free(e->occ[j].filename);
-                free(e->occ[j].context);
-            }
-            free(e->occ);
-            free(e);
-            e = tmp;
+WordOccurrence *get_word_occurrences(HashMap *m,
+                                     const char *word,
+                                     int *out_n)
+{
+    epoch_enter();
+    WordOccurrence *res = set_word_occurrences(segments_acquire(m), word, out_n);
+    epoch_exit();
+    return res;
+}
+
+void seg_for_each_word(MemSegment *m,
+                       void (*fn)(const char *word, void *arg),
+                       void *arg)
+{
+    epoch_enter();
+    HashTable *t = atomic_load(&m->table);
+    HashTable *p = atomic_load(&t->prev);
+    for (HashTable *x = t; x; x = (x == t) ? p : NULL) {
+        for (size_t i = 0; i < x->cap; i++) {
+            HashEntry *e = atomic_load_explicit(&x->entries[i],
+                                                memory_order_acquire);
+            if (e) fn(e->word, arg);
         }
     }
-    free(m->buckets);
+    epoch_exit();
+}
 
-    // destroy file_set
-    for (size_t i = 0; i < m->n_files; i++) {
-        free(m->indexed_files[i]);
+void seg_for_each_prefix(MemSegment *m, const char *prefix, size_t len,
+                         void (*fn)(const char *word, void *arg),
+                         void *arg)
+{
+    TermNode *n = term_next(&m->terms);
+    if (len == 0) {
+        term_walk(n, fn, arg);
+        return;
+    }
+    for (size_t i = 0; n; ) {
+        unsigned char c = (unsigned char)prefix[i];
+        if      (c < n->c)  n = term_next(&n->lo);
+        else if (c > n->c)  n = term_next(&n->hi);
+        else if (++i < len) n = term_next(&n->eq);
+        else {
+            /* the prefix itself, then everything that extends it */
+            HashEntry *e = atomic_load_explicit(&n->entry, memory_order_acquire);
+            if (e) fn(e->word, arg);
+            term_walk(term_next(&n->eq), fn, arg);
+            return;
+        }
     }
-    free(m->indexed_files);
-    pthread_mutex_destroy(&m->file_set_lock);
-
-    pthread_mutex_destroy(&m->resize_lock);
-    free(m);
 }
 
-// compare by filename then context
-static int cmp_by_fname(const void *A, const void *B) {
-    const WordOccurrence *x = A, *y = B;
-    int c = strcmp(x->filename, y->filename);
-    return c ? c : strcmp(x->context, y->context);
+// Free the posting list of every entry under n: the term tree holds each
+// entry once, where the tables may hold it twice mid-resize
+static void term_free_postings(TermNode *n)
+{
+    for (; n; n = term_next(&n->hi)) {
+        term_free_postings(term_next(&n->lo));
+        HashEntry *e = atomic_load_explicit(&n->entry, memory_order_acquire);
+        if (e) pl_free(atomic_load(&e->postings));
+        term_free_postings(term_next(&n->eq));
+    }
 }
 
-void search_word(HashMap *m, const char *word) {
-    int total = 0;
-    WordOccurrence *occ = get_word_occurrences(m, word, &total);
+void mem_segment_free(void *arg)
+{
+    // destroy tables and posting lists; entries, words and contexts all
+    // live in the arenas and go away with them.  Blocks retired earlier
+    // are separate allocations and may be freed in any order.
+    MemSegment *s = arg;
+    HashTable  *t = atomic_load(&s->table);
+    HashTable  *p = atomic_load(&t->prev);
+    if (p) free_table(p);
+    free_table(t);
+    term_free_postings(term_next(&s->terms));
+    arena_set_release(&s->arenas);
+    pthread_mutex_destroy(&s->resize_lock);
+    free(s->removed);
+    free(s);
+}
 
-    if (!occ || total == 0) {
-        printf("\n" RED "No results for '%s'." RESET "\n\n", word);
-        free(occ);
-        return;
+void free_hash_map(HashMap *m) {
+    segments_destroy(m);      // stops the thread; frees every segment
+    epoch_barrier();          // tables and blocks retired meanwhile
+    for (size_t i = 0; i < ENTRY_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&m->entry_locks[i]);
     }
+    fr_destroy(&m->files);
+    free(m);
+}
 
-    printf("\n" BOLD CYAN "Search results for '%s':" RESET "\n\n", word);
+void seg_postings(MemSegment *s, const char *word, PostingView *v)
+{
+    uint64_t   h = slot_hash(fnv1a(word));
+    HashEntry *e = lookup(s, h, word, strlen(word));
+    pl_view(e ? atomic_load_explicit(&e->postings, memory_order_acquire)
+              : NULL, v);
+}
 
-    qsort(occ, total, sizeof(*occ), cmp_by_fname);
+// compare by count (desc), then position: file, then sentence
+int cmp_occ(const void *a, const void *b)
+{
+    const WordOccurrence *x = a, *y = b;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return occ_cmp(x, y);
+}
 
-    for (int i = 0; i < total; ) {
-        const char *fname = occ[i].filename;
-        int start = i;
-        while (i < total && strcmp(occ[i].filename, fname) == 0) i++;
-        int count = i - start;
+void search_word(HashMap *m, const char *word, size_t k, FILE *out)
+{
+    RankStats st;
+    TopK      top;
+    rank_stats(m, &st);
+    topk_init(&top, k);
 
-        printf(BOLD GREEN "File: %s" RESET " " GRAY "(%d×)" RESET "\n",
-               fname, count);
-        printf("  " BOLD "Contexts:" RESET "\n");
-        for (int j = start; j < i; j++) {
-            printf("    - \"%s\"\n", occ[j].context);
+    /* a file's postings live in exactly one source; gather them all
+     * for the IDF, then score each file in place.  In-memory segments'
+     * contexts go when the segment is written out, so the epoch lasts
+     * until they are printed. */
+    epoch_enter();
+    SegSet         *ss  = segments_acquire(m);
+    size_t          n   = 0;
+    size_t          len = strlen(word);
+    WordOccurrence *occ = NULL;
+    for (size_t i = 0; i < ss->n_mem + ss->n_snap; i++) {
+        PostingView v  = { 0 };
+        IxView      iv = { 0 };
+        if (i < ss->n_mem) seg_postings(ss->mem[i], word, &v);
+        else               ix_view(ss->snap[i - ss->n_mem], word, len, &iv);
+        if (!v.n && !iv.n) continue;
+        WordOccurrence *tmp = realloc(occ, (n + v.n + iv.n) * sizeof(*occ));
+        if (!tmp) {
+            perror("search_word: malloc");
+            break;
         }
-        putchar('\n');
+        occ = tmp;
+        if (v.n) pv_decode(&v, occ + n);
+        n += v.n ? v.n : ix_occurrences(&iv, occ + n);
     }
 
+    /* segments hold disjoint files, so each file's postings stay
+     * contiguous in the concatenation */
+    st.df = rank_count_files(occ, n);
+    if (rank_postings(&top, &st, occ, n)) print_ranked(out, m, word, &top);
+    epoch_exit();
+    topk_free(&top);
     free(occ);
 }
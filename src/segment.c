@@ -0,0 +1,467 @@
+#define _POSIX_C_SOURCE 200809L  // for getpid
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "segment.h"
+#include "config.h"
+#include "epoch.h"
+#include "stats.h"
+#include "mem.h"
+
+static const char          *g_dir   = NULL;  // NULL ⇒ $TMPDIR or /tmp
+static atomic_uint_fast64_t g_names = 0;     // numbers segment files
+static const uint64_t       g_flush = SEGMENT_FLUSH_BYTES;  // 0 ⇒ never
+
+void segments_set_dir(const char *dir) { g_dir = dir; }
+
+static const char *seg_dir(void)
+{
+    if (g_dir) return g_dir;
+    const char *tmp = getenv("TMPDIR");
+    return tmp && *tmp ? tmp : "/tmp";
+}
+
+// ------- Sets -------
+
+// Free a replaced set: its arrays only, the sources live on in the next
+static void set_free(void *arg)
+{
+    SegSet *ss = arg;
+    free(ss->mem);
+    free(ss->snap);
+    free(ss);
+}
+
+static void snap_free(void *arg) { ix_close(arg); }
+
+// An empty set with room for n_mem + n_snap sources, or NULL
+static SegSet *set_new(size_t n_mem, size_t n_snap)
+{
+    SegSet         *ss   = calloc(1, sizeof(*ss));
+    MemSegment    **mem  = calloc(n_mem + 1, sizeof(*mem));
+    IndexSnapshot **snap = calloc(n_snap + 1, sizeof(*snap));
+    if (!ss || !mem || !snap) {
+        perror("segments: calloc");
+        free(ss);
+        free(mem);
+        free(snap);
+        return NULL;
+    }
+    *ss = (SegSet){ .n_mem = n_mem, .n_snap = n_snap, .mem = mem, .snap = snap };
+    return ss;
+}
+
+// Make ss the current set; the old one goes once no search holds it.
+// Caller holds seg_lock.
+static void set_publish(HashMap *m, SegSet *ss)
+{
+    SegSet *old = atomic_load(&m->segs);
+    atomic_store_explicit(&m->segs, ss, memory_order_release);
+    epoch_retire(old, set_free);
+}
+
+SegSet *segments_acquire(HashMap *m)
+{
+    return atomic_load_explicit(&m->segs, memory_order_acquire);
+}
+
+MemSegment *segments_of_file(const SegSet *ss, const FileInfo *fi)
+{
+    uint64_t id = atomic_load(&fi->seg);
+    for (size_t i = 0; id && i < ss->n_mem; i++) {
+        if (ss->mem[i]->id == id) return ss->mem[i];
+    }
+    return NULL;
+}
+
+MemSegment *segments_file_segment(HashMap *m, const FileInfo *fi)
+{
+    epoch_enter();
+    MemSegment *s = segments_of_file(segments_acquire(m), fi);
+    epoch_exit();
+    return s;                           // pinned: stays in memory
+}
+
+// ------- Freezing -------
+
+// Freeze the live segment if it is full, or holds anything while the
+// memory budget is used up, and the thread is keeping up, putting a fresh
+// one in its place.  Caller holds seg_lock.
+static void maybe_freeze(HashMap *m)
+{
+    SegSet     *cur  = atomic_load(&m->segs);
+    MemSegment *live = cur->mem[0];
+    bool        full = live->bytes >= g_flush || (live->bytes && mem_over_budget());
+    if (!m->seg_running || !full || cur->n_mem > SEGMENT_MAX_FROZEN) return;
+
+    MemSegment *fresh = mem_segment_create(m->seg_buckets, m->next_seg_id);
+    SegSet     *ss    = fresh ? set_new(cur->n_mem + 1, cur->n_snap) : NULL;
+    if (!ss) {
+        if (fresh) mem_segment_free(fresh);
+        return;                         // the live one keeps growing
+    }
+    m->next_seg_id++;
+    ss->mem[0] = fresh;
+    memcpy(ss->mem + 1, cur->mem, cur->n_mem * sizeof(*ss->mem));
+    memcpy(ss->snap, cur->snap, cur->n_snap * sizeof(*ss->snap));
+    atomic_store(&live->frozen, true);
+    set_publish(m, ss);
+    pthread_cond_broadcast(&m->seg_cond);
+}
+
+// Whether a new file has to wait for the segment thread: the live segment
+// is full and cannot be frozen before a frozen one is written out, or the
+// memory budget is used up and writing out segments will free some.
+// Frozen segments that could not be written out are not waited for.
+// Caller holds seg_lock.
+static bool behind(HashMap *m)
+{
+    SegSet *cur = atomic_load(&m->segs);
+    if (!m->seg_running || m->seg_stop) return false;
+
+    bool writable = false;
+    for (size_t i = 1; i < cur->n_mem; i++) writable |= !cur->mem[i]->stuck;
+    bool can_freeze = cur->n_mem <= SEGMENT_MAX_FROZEN;
+    if (mem_over_budget()) {
+        return writable || m->seg_freeing || (cur->mem[0]->bytes && can_freeze);
+    }
+    return cur->mem[0]->bytes >= g_flush && !can_freeze && writable;
+}
+
+bool segments_wait_room(HashMap *m, unsigned max_ms)
+{
+    pthread_mutex_lock(&m->seg_lock);
+    if (behind(m)) {
+        STATS_START(t0);
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        ts.tv_sec  += max_ms / 1000;
+        ts.tv_nsec += (long)(max_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while (behind(m)) {
+            maybe_freeze(m);            // over budget: the live one goes too
+            if (!max_ms) {
+                pthread_cond_wait(&m->seg_cond, &m->seg_lock);
+            } else if (pthread_cond_timedwait(&m->seg_cond, &m->seg_lock, &ts) == ETIMEDOUT) {
+                break;
+            }
+        }
+        STATS_ADD(ST_SEG_WAITS, 1);
+        STATS_STOP(ST_SEG_WAIT_NS, t0);
+    }
+    bool room = !behind(m);
+    pthread_mutex_unlock(&m->seg_lock);
+    return room;
+}
+
+MemSegment *segments_pin_file(HashMap *m, FileInfo *fi, uint64_t bytes)
+{
+    pthread_mutex_lock(&m->seg_lock);
+    SegSet     *ss = atomic_load(&m->segs);
+    MemSegment *s  = segments_of_file(ss, fi);
+    if (!s || s->flushing) {
+        maybe_freeze(m);
+        s = atomic_load(&m->segs)->mem[0];
+        /* the entry lists point into the old segment, which is gone or
+         * going; the removal of what is left there shadows it */
+        if (atomic_exchange(&fi->seg, s->id) != s->id) {
+            atomic_store(&fi->terms, NULL);
+            atomic_store(&fi->unfolded, NULL);
+        }
+    }
+    atomic_fetch_add(&s->pins, 1);
+    s->bytes += bytes;
+    pthread_mutex_unlock(&m->seg_lock);
+    return s;
+}
+
+void segments_unpin_file(HashMap *m, FileInfo *fi)
+{
+    pthread_mutex_lock(&m->seg_lock);
+    MemSegment *s = segments_of_file(atomic_load(&m->segs), fi);
+    if (s && atomic_fetch_sub(&s->pins, 1) == 1 && atomic_load(&s->frozen)) {
+        pthread_cond_broadcast(&m->seg_cond);
+    }
+    maybe_freeze(m);                    // a big file may have filled it
+    pthread_mutex_unlock(&m->seg_lock);
+}
+
+void segments_note_removed(MemSegment *s, uint32_t file_id)
+{
+    if (s->n_removed == s->cap_removed) {
+        size_t    new_cap = s->cap_removed ? s->cap_removed * 2 : 16;
+        uint32_t *tmp     = realloc(s->removed, new_cap * sizeof(*tmp));
+        if (!tmp) {
+            perror("segments: realloc removed");
+            return;
+        }
+        s->removed     = tmp;
+        s->cap_removed = new_cap;
+    }
+    s->removed[s->n_removed++] = file_id;
+}
+
+bool segments_attach(HashMap *m, IndexSnapshot *snap)
+{
+    pthread_mutex_lock(&m->seg_lock);
+    SegSet *cur = atomic_load(&m->segs);
+    SegSet *ss  = set_new(cur->n_mem, cur->n_snap + 1);
+    if (ss) {
+        memcpy(ss->mem, cur->mem, cur->n_mem * sizeof(*ss->mem));
+        memcpy(ss->snap, cur->snap, cur->n_snap * sizeof(*ss->snap));
+        ss->snap[cur->n_snap] = snap;
+        set_publish(m, ss);
+    }
+    pthread_mutex_unlock(&m->seg_lock);
+    return ss != NULL;
+}
+
+// ------- Writing out and merging -------
+
+// Write the sources of ss to a new segment file and map it.  The file is
+// unlinked at once: the mapping keeps its pages.
+static IndexSnapshot *write_segment(HashMap *m, const SegSet *ss)
+{
+    char path[4096];
+    int  len = snprintf(path, sizeof path, "%s/mwf-%ld-%llu.seg", seg_dir(),
+                        (long)getpid(),
+                        (unsigned long long)atomic_fetch_add(&g_names, 1));
+    if (len < 0 || (size_t)len >= sizeof path) {
+        fprintf(stderr, "segments: directory name too long: %s\n", seg_dir());
+        return NULL;
+    }
+    if (!ix_write(m, ss, path, true)) return NULL;
+    IndexSnapshot *s = ix_open_segment(path);
+    if (unlink(path) != 0) perror("segments: unlink");
+    return s;
+}
+
+// Write out frozen segment f, which nobody is indexing into any more, and
+// swap the file in for it.  Called and returns with seg_lock held.
+static void flush(HashMap *m, MemSegment *f)
+{
+    f->flushing = true;
+    pthread_mutex_unlock(&m->seg_lock);
+
+    MemSegment    *only[1] = { f };
+    IndexSnapshot *s = write_segment(m, &(SegSet){ .n_mem = 1, .mem = only });
+
+    pthread_mutex_lock(&m->seg_lock);
+    f->flushing = false;
+    SegSet *cur = atomic_load(&m->segs);
+    SegSet *ss  = s ? set_new(cur->n_mem - 1, cur->n_snap + 1) : NULL;
+    if (!ss) {
+        if (s) ix_close(s);
+        f->stuck = true;                // still searchable where it is
+        fprintf(stderr, "segments: keeping segment %llu in memory\n",
+                (unsigned long long)f->id);
+        pthread_cond_broadcast(&m->seg_cond);   // nobody waits on it now
+        return;
+    }
+    for (size_t i = 0, j = 0; i < cur->n_mem; i++) {
+        if (cur->mem[i] != f) ss->mem[j++] = cur->mem[i];
+    }
+    memcpy(ss->snap, cur->snap, cur->n_snap * sizeof(*ss->snap));
+    ss->snap[cur->n_snap] = s;
+
+    /* files removed while it was written may be in the file */
+    for (size_t i = 0; i < f->n_removed; i++) ix_shadow_file(s, f->removed[i]);
+    set_publish(m, ss);
+    epoch_retire(f, mem_segment_free);
+    m->merge_failed = false;
+}
+
+// Size class of an on-disk segment: 0 below SEGMENT_MERGE_FANIN flushes'
+// worth, one more for every further factor of the fan-in
+static unsigned tier(size_t size)
+{
+    unsigned t = 0;
+    for (uint64_t cap = g_flush * SEGMENT_MERGE_FANIN;
+         size >= cap; cap *= SEGMENT_MERGE_FANIN) t++;
+    return t;
+}
+
+// Merge SEGMENT_MERGE_FANIN on-disk segments of one size class, smallest
+// class first, into one.  Returns false if there is nothing to merge.
+// Called and returns with seg_lock held.
+static bool compact(HashMap *m)
+{
+    if (m->merge_failed) return false;
+
+    SegSet        *cur = atomic_load(&m->segs);
+    IndexSnapshot *in[SEGMENT_MERGE_FANIN];
+    size_t         n = 0;
+    for (unsigned t = 0; n < SEGMENT_MERGE_FANIN && t < 64; t++) {
+        uint64_t total = 0;
+        n = 0;
+        for (size_t i = 0; i < cur->n_snap && n < SEGMENT_MERGE_FANIN; i++) {
+            IndexSnapshot *s = cur->snap[i];
+            if (!s->segment || tier(s->size) != t) continue;
+            in[n++] = s;
+            total  += s->size;
+        }
+        if (n == SEGMENT_MERGE_FANIN && total > SEGMENT_MERGE_MAX_BYTES) n = 0;
+    }
+    if (n < SEGMENT_MERGE_FANIN) return false;
+
+    /* files shadowed from here on may still be read into the output */
+    bool *was[SEGMENT_MERGE_FANIN] = { 0 };
+    for (size_t k = 0; k < n; k++) {
+        uint32_t nf = in[k]->hdr->n_files;
+        if (!(was[k] = malloc((nf + 1) * sizeof(**was)))) {
+            perror("segments: malloc");
+            for (size_t j = 0; j < k; j++) free(was[j]);
+            m->merge_failed = true;
+            return false;
+        }
+        for (uint32_t id = 0; id < nf; id++) was[k][id] = ix_file(in[k], id) == IX_SHADOWED;
+    }
+    pthread_mutex_unlock(&m->seg_lock);
+
+    IndexSnapshot *s = write_segment(m, &(SegSet){ .n_snap = n, .snap = in });
+
+    pthread_mutex_lock(&m->seg_lock);
+    cur = atomic_load(&m->segs);        // only this thread drops segments
+    SegSet *ss = s ? set_new(cur->n_mem, cur->n_snap - n + 1) : NULL;
+    if (ss) {
+        memcpy(ss->mem, cur->mem, cur->n_mem * sizeof(*ss->mem));
+        size_t j = 0;
+        for (size_t i = 0; i < cur->n_snap; i++) {
+            bool merged = false;
+            for (size_t k = 0; k < n; k++) merged |= cur->snap[i] == in[k];
+            if (!merged) ss->snap[j++] = cur->snap[i];
+        }
+        ss->snap[j] = s;
+        for (size_t k = 0; k < n; k++) {
+            for (uint32_t id = 0; id < in[k]->hdr->n_files; id++) {
+                if (!was[k][id] && ix_file(in[k], id) == IX_SHADOWED) ix_shadow_file(s, id);
+            }
+        }
+        set_publish(m, ss);
+        for (size_t k = 0; k < n; k++) epoch_retire(in[k], snap_free);
+    } else {
+        if (s) ix_close(s);
+        fprintf(stderr, "segments: merge failed, retrying after the next write-out\n");
+        m->merge_failed = true;
+    }
+    for (size_t k = 0; k < n; k++) free(was[k]);
+    return ss != NULL;
+}
+
+static void *seg_main(void *arg)
+{
+    HashMap *m = arg;
+    pthread_mutex_lock(&m->seg_lock);
+    while (!m->seg_stop) {
+        /* the oldest frozen segment nobody is indexing into any more */
+        SegSet     *ss = atomic_load(&m->segs);
+        MemSegment *f  = NULL;
+        for (size_t i = ss->n_mem; i-- > 1; ) {
+            MemSegment *s = ss->mem[i];
+            if (!s->stuck && atomic_load(&s->pins) == 0) {
+                f = s;
+                break;
+            }
+        }
+        if (f) {
+            flush(m, f);
+            /* its memory goes once no search holds it: new files waiting
+             * for room (or for the budget) are let in after that */
+            m->seg_freeing = true;
+            pthread_mutex_unlock(&m->seg_lock);
+            epoch_barrier();
+            pthread_mutex_lock(&m->seg_lock);
+            m->seg_freeing = false;
+            pthread_cond_broadcast(&m->seg_cond);
+        } else if (!compact(m)) {
+            pthread_cond_wait(&m->seg_cond, &m->seg_lock);
+        }
+    }
+    pthread_mutex_unlock(&m->seg_lock);
+    return NULL;
+}
+
+// ------- Lifetime -------
+
+bool segments_init(HashMap *m)
+{
+    pthread_mutex_init(&m->seg_lock, NULL);
+    pthread_cond_init(&m->seg_cond, NULL);
+    m->next_seg_id = 1;
+
+    MemSegment *live = mem_segment_create(m->seg_buckets, m->next_seg_id++);
+    SegSet     *ss   = live ? set_new(1, 0) : NULL;
+    if (!ss) {
+        if (live) mem_segment_free(live);
+        return false;
+    }
+    ss->mem[0] = live;
+    atomic_init(&m->segs, ss);
+
+    /* without the thread nothing is frozen: one segment, as before */
+    if (g_flush) {
+        int rc = pthread_create(&m->seg_thread, NULL, seg_main, m);
+        if (rc != 0) {
+            errno = rc;
+            perror("segments: pthread_create");
+        }
+        m->seg_running = rc == 0;
+    }
+    return true;
+}
+
+void segments_destroy(HashMap *m)
+{
+    if (m->seg_running) {
+        pthread_mutex_lock(&m->seg_lock);
+        m->seg_stop = true;
+        pthread_cond_broadcast(&m->seg_cond);
+        pthread_mutex_unlock(&m->seg_lock);
+        pthread_join(m->seg_thread, NULL);
+        m->seg_running = false;
+    }
+    SegSet *ss = atomic_load(&m->segs);
+    for (size_t i = 0; i < ss->n_mem; i++)  mem_segment_free(ss->mem[i]);
+    for (size_t i = 0; i < ss->n_snap; i++) ix_close(ss->snap[i]);
+    set_free(ss);
+    pthread_cond_destroy(&m->seg_cond);
+    pthread_mutex_destroy(&m->seg_lock);
+}
+
+// ------- Report -------
+
+static double mib(uint64_t n) { return (double)n / (1024.0 * 1024.0); }
+
+void segments_report(HashMap *m, FILE *out)
+{
+    pthread_mutex_lock(&m->seg_lock);
+    SegSet  *ss = atomic_load(&m->segs);
+    size_t   n_disk = 0, n_loaded = 0;
+    uint64_t disk = 0;
+    for (size_t i = 0; i < ss->n_snap; i++) {
+        if (ss->snap[i]->segment) {
+            n_disk++;
+            disk += ss->snap[i]->size;
+        } else {
+            n_loaded++;
+        }
+    }
+    fprintf(out, "  Segments: live %.1f MiB of text, %zu frozen, %zu on disk "
+            "(%.1f MiB), %zu loaded index file%s.\n",
+            mib(ss->mem[0]->bytes), ss->n_mem - 1, n_disk, mib(disk),
+            n_loaded, n_loaded == 1 ? "" : "s");
+    if (!m->seg_running) {
+        fprintf(out, "  Segments are never written out (SEGMENT_FLUSH_BYTES is 0).\n");
+    }
+    fputc('\n', out);
+    pthread_mutex_unlock(&m->seg_lock);
+}
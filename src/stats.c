@@ -0,0 +1,225 @@
+#define _POSIX_C_SOURCE 200809L  // for clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+// ANSI styling
+#define BOLD  "\033[1m"
+#define RESET "\033[0m"
+
+// Counter names, for the log line and the table
+static const char *const names[ST_COUNT] = {
+    [ST_FILES_READ]         = "files_read",
+    [ST_READ_NS]            = "read_ns",
+    [ST_RANGES_TOKENIZED]   = "ranges_tokenized",
+    [ST_TOKENIZE_NS]        = "tokenize_ns",
+    [ST_TOKENS]             = "tokens",
+    [ST_CENSORED_SENTENCES] = "censored_sentences",
+    [ST_MERGES]             = "merges",
+    [ST_INSERT_NS]          = "insert_ns",
+    [ST_LOCK_WAITS]         = "lock_waits",
+    [ST_LOCK_WAIT_NS]       = "lock_wait_ns",
+    [ST_RESIZES]            = "resizes",
+    [ST_RESIZE_NS]          = "resize_ns",
+    [ST_PUSH_WAITS]         = "push_waits",
+    [ST_PUSH_WAIT_NS]       = "push_wait_ns",
+    [ST_POP_WAITS]          = "pop_waits",
+    [ST_POP_WAIT_NS]        = "pop_wait_ns",
+    [ST_SEG_WAITS]          = "seg_waits",
+    [ST_SEG_WAIT_NS]        = "seg_wait_ns",
+};
+
+#if STATS_ENABLED
+
+// One record per thread that has ever counted; a record freed by an
+// exited thread is reused, its counts kept, so totals never drop.
+static StatsRec *_Atomic  g_recs = NULL;
+static pthread_once_t     key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t      rec_key;
+
+_Thread_local StatsRec *stats_tl;
+
+static void release_rec(void *arg)
+{
+    StatsRec *r = arg;
+    atomic_store(&r->in_use, false);
+}
+
+static void make_key(void) { pthread_key_create(&rec_key, release_rec); }
+
+StatsRec *stats_rec(void)
+{
+    StatsRec *r;
+    for (r = atomic_load(&g_recs); r; r = r->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, true)) break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r) {
+            perror("stats: calloc");
+            exit(EXIT_FAILURE);
+        }
+        atomic_init(&r->in_use, true);
+        r->next = atomic_load(&g_recs);
+        while (!atomic_compare_exchange_weak(&g_recs, &r->next, r)) { }
+    }
+
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(rec_key, r);
+    stats_tl = r;
+    return r;
+}
+
+uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void stats_snapshot(uint64_t out[ST_COUNT])
+{
+    memset(out, 0, ST_COUNT * sizeof(out[0]));
+    for (StatsRec *r = atomic_load(&g_recs); r; r = r->next) {
+        for (int i = 0; i < ST_COUNT; i++) {
+            out[i] += atomic_load_explicit(&r->v[i], memory_order_relaxed);
+        }
+    }
+}
+
+#else
+
+void stats_snapshot(uint64_t out[ST_COUNT])
+{
+    memset(out, 0, ST_COUNT * sizeof(out[0]));
+}
+
+#endif // STATS_ENABLED
+
+static double ms(uint64_t ns) { return (double)ns / 1e6; }
+
+// Mean of a total over n events, in microseconds
+static double avg_us(uint64_t ns, uint64_t n) { return n ? (double)ns / 1e3 / (double)n : 0; }
+
+void stats_report(FILE *out)
+{
+    if (!STATS_ENABLED) {
+        fprintf(out, "  Counters are compiled out (build with STATS=1).\n\n");
+        return;
+    }
+    uint64_t s[ST_COUNT];
+    stats_snapshot(s);
+
+    fprintf(out, BOLD "  %-14s %12s %12s %12s" RESET "\n",
+            "stage", "events", "total ms", "avg us");
+    fprintf(out, "  %-14s %12llu %12.1f %12.1f\n", "read",
+            (unsigned long long)s[ST_FILES_READ], ms(s[ST_READ_NS]),
+            avg_us(s[ST_READ_NS], s[ST_FILES_READ]));
+    fprintf(out, "  %-14s %12llu %12.1f %12.1f\n", "tokenize",
+            (unsigned long long)s[ST_RANGES_TOKENIZED], ms(s[ST_TOKENIZE_NS]),
+            avg_us(s[ST_TOKENIZE_NS], s[ST_RANGES_TOKENIZED]));
+    fprintf(out, "  %-14s %12llu %12.1f %12.1f\n", "insert",
+            (unsigned long long)s[ST_MERGES], ms(s[ST_INSERT_NS]),
+            avg_us(s[ST_INSERT_NS], s[ST_MERGES]));
+    fprintf(out, "  %-14s %12llu %12.1f %12.1f\n", "lock wait",
+            (unsigned long long)s[ST_LOCK_WAITS], ms(s[ST_LOCK_WAIT_NS]),
+            avg_us(s[ST_LOCK_WAIT_NS], s[ST_LOCK_WAITS]));
+    fprintf(out, "  %-14s %12llu %12.1f %12.1f\n", "resize",
+            (unsigned long long)s[ST_RESIZES], ms(s[ST_RESIZE_NS]),
+            avg_us(s[ST_RESIZE_NS], s[ST_RESIZES]));
+    fprintf(out, "  %-14s %12llu %12.1f %12.1f\n", "queue push",
+            (unsigned long long)s[ST_PUSH_WAITS], ms(s[ST_PUSH_WAIT_NS]),
+            avg_us(s[ST_PUSH_WAIT_NS], s[ST_PUSH_WAITS]));
+    fprintf(out, "  %-14s %12llu %12.1f %12.1f\n", "queue pop",
+            (unsigned long long)s[ST_POP_WAITS], ms(s[ST_POP_WAIT_NS]),
+            avg_us(s[ST_POP_WAIT_NS], s[ST_POP_WAITS]));
+    fprintf(out, "  %-14s %12llu %12.1f %12.1f\n", "segment wait",
+            (unsigned long long)s[ST_SEG_WAITS], ms(s[ST_SEG_WAIT_NS]),
+            avg_us(s[ST_SEG_WAIT_NS], s[ST_SEG_WAITS]));
+    fprintf(out, "\n  %llu tokens indexed, %llu censored sentence%s skipped\n\n",
+            (unsigned long long)s[ST_TOKENS],
+            (unsigned long long)s[ST_CENSORED_SENTENCES],
+            s[ST_CENSORED_SENTENCES] == 1 ? "" : "s");
+}
+
+void stats_log(FILE *log)
+{
+    uint64_t s[ST_COUNT];
+    stats_snapshot(s);
+    fprintf(log, "[%ld] stats", (long)time(NULL));
+    for (int i = 0; i < ST_COUNT; i++) {
+        fprintf(log, " %s=%llu", names[i], (unsigned long long)s[i]);
+    }
+    fputc('\n', log);
+    fflush(log);
+}
+
+// ------- Interval logger -------
+
+static pthread_t        logger;
+static bool             logging = false;
+static bool             stopping;
+static pthread_mutex_t  logger_mtx  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   logger_cond = PTHREAD_COND_INITIALIZER;
+
+typedef struct {
+    FILE     *log;
+    unsigned  seconds;
+} LoggerArgs;
+
+static LoggerArgs logger_args;
+
+static void *logger_main(void *arg)
+{
+    LoggerArgs *a = arg;
+    pthread_mutex_lock(&logger_mtx);
+    while (!stopping) {
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        ts.tv_sec += (time_t)a->seconds;
+        int rc = 0;
+        while (!stopping && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&logger_cond, &logger_mtx, &ts);
+        }
+        if (!stopping) stats_log(a->log);
+    }
+    pthread_mutex_unlock(&logger_mtx);
+    return NULL;
+}
+
+bool stats_start_logger(FILE *log, unsigned seconds)
+{
+    if (!STATS_ENABLED) {
+        fprintf(stderr, "stats: counters are compiled out, not logging\n");
+        return false;
+    }
+    if (logging || !log || seconds == 0) return false;
+
+    logger_args = (LoggerArgs){ .log = log, .seconds = seconds };
+    stopping    = false;
+    int rc = pthread_create(&logger, NULL, logger_main, &logger_args);
+    if (rc != 0) {
+        errno = rc;
+        perror("stats: pthread_create");
+        return false;
+    }
+    logging = true;
+    return true;
+}
+
+void stats_stop_logger(void)
+{
+    if (!logging) return;
+    pthread_mutex_lock(&logger_mtx);
+    stopping = true;
+    pthread_cond_signal(&logger_cond);
+    pthread_mutex_unlock(&logger_mtx);
+    pthread_join(logger, NULL);
+    logging = false;
+}
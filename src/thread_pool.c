@@ -1,79 +1,96 @@
 #define _POSIX_C_SOURCE 200809L  // for sysconf
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #include "thread_pool.h"
 #include "util.h"          // for tokenize_file(), CensoredSet
-#include "search_engine.h" // for HashMap, dedup fields
+#include "search_engine.h" // for HashMap, file registry
 #include "config.h"
+#include "mem.h"           // for the memory budget
+#include "segment.h"       // for pinning the file's segment
 
 // mutex for synchronized terminal output
 static pthread_mutex_t log_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+void tp_log(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&log_mtx);
+    vprintf(fmt, ap);
+    fflush(stdout);
+    pthread_mutex_unlock(&log_mtx);
+    va_end(ap);
+}
 
- // Deduplication helper – uses HashMap’s indexed_files[] set
 
-static bool already_indexed(HashMap *m, const char *path)
-{
-    pthread_mutex_lock(&m->file_set_lock);
+/* --------------------------------------------------------------------------
+ *  Worker thread
+ * --------------------------------------------------------------------------*/
 
-    /* check if already recorded */
-    for (size_t i = 0; i < m->n_files; ++i) {
-        if (strcmp(m->indexed_files[i], path) == 0) {
-            pthread_mutex_unlock(&m->file_set_lock);
-            return true;
-        }
+// Run one job: index its file range with `scratch` as term buffer (NULL ⇒
+// a temporary one), or run its task
+static void run_job(Job *job, LocalIndex *scratch)
+{
+    if (job->run) {                     // a task, not a file
+        job->run(job->arg);
+        return;
     }
+    errno = 0;
+    tokenize_range(job->filename, job->file_id, job->off, job->len,
+                   job->map, job->censored, scratch);
+    int err = errno;
 
-    /* grow array if needed */
-    if (m->n_files == m->cap_files) {
-        size_t new_cap = m->cap_files ? m->cap_files * 2 : 8;
-        char **tmp = realloc(m->indexed_files, new_cap * sizeof(*tmp));
-        if (!tmp) {
-            perror("already_indexed: realloc");
-        } else {
-            m->indexed_files = tmp;
-            m->cap_files     = new_cap;
+    /* only the last chunk of a split file reports completion */
+    bool last = !job->pending || atomic_fetch_sub(job->pending, 1) == 1;
+
+    /* the file's record goes back to idle with its new version */
+    if (last) {
+        FileInfo *fi = fr_get(&job->map->files, job->file_id);
+        if (job->pending) fold_file_postings(job->map, job->file_id);
+        /* part of it was dropped: left without a version, so the
+         * next _index_ of it starts over */
+        if (atomic_exchange(&fi->dropped, false)) {
+            fi->size     = 0;
+            fi->mtime_ns = -1;
         }
+        segments_unpin_file(job->map, fi);  // its segment may be written out
+        atomic_store_explicit(&fi->state, FR_INDEXED, memory_order_release);
     }
 
-    /* record new path */
-    m->indexed_files[m->n_files++] = strdup(path);
+    pthread_mutex_lock(&log_mtx);
+    if (err) {
+        fprintf(stderr,
+                "Error: tokenize_file failed for '%s': %s\n",
+                job->filename, strerror(err));
+    } else if (last) {
+        printf("Worker finished indexing: %s\n", job->filename);
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&log_mtx);
 
-    pthread_mutex_unlock(&m->file_set_lock);
-    return false;
+    if (job->pending && last) free(job->pending);
+    free(job->filename);
+    if (last && job->done) job->done(job->done_arg);
 }
 
-/* --------------------------------------------------------------------------
- *  Worker thread
- * --------------------------------------------------------------------------*/
 static void *worker_fn(void *arg)
 {
-    JobQueue *q = (JobQueue *)arg;
+    Worker   *w = (Worker *)arg;
+    JobQueue *q = w->queue;
     Job job;
 
-    while (jq_pop(q, &job)) {
-        errno = 0;
-        tokenize_file(job.filename, job.map, job.censored);
-        int err = errno;
-
-        pthread_mutex_lock(&log_mtx);
-        if (err) {
-            fprintf(stderr,
-                    "Error: tokenize_file failed for '%s': %s\n",
-                    job.filename, strerror(err));
-        } else {
-            printf("Worker finished indexing: %s\n", job.filename);
-            fflush(stdout);
-        }
-        pthread_mutex_unlock(&log_mtx);
+    /* private term buffer, reused across this worker's jobs */
+    LocalIndex *scratch = local_index_create();
 
-        free(job.filename);
-    }
+    while (jq_pop(q, w->id, &job)) run_job(&job, scratch);
+    local_index_free(scratch);
     return NULL;
 }
 
@@ -85,14 +102,17 @@ void tp_init(ThreadPool *pool, size_t n_threads, JobQueue *q)
 
     pool->n       = n;
     pool->queue   = q;
-    pool->workers = malloc(n * sizeof(pthread_t));
+    pool->workers = malloc(n * sizeof(Worker));
     if (!pool->workers) {
         perror("tp_init: malloc");
         exit(EXIT_FAILURE);
     }
+    jq_set_workers(q, n);
 
     for (size_t i = 0; i < n; ++i) {
-        if (pthread_create(&pool->workers[i], NULL, worker_fn, q) != 0) {
+        pool->workers[i] = (Worker){ .queue = q, .id = i };
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_fn,
+                           &pool->workers[i]) != 0) {
             perror("tp_init: pthread_create");
             exit(EXIT_FAILURE);
         }
@@ -104,34 +124,154 @@ bool tp_submit(ThreadPool  *pool,
                HashMap     *map,
                CensoredSet *censored)
 {
-    /* skip duplicates */
-    if (already_indexed(map, filename)) {
-        pthread_mutex_lock(&log_mtx);
-        printf("→ File already queued/indexed: %s\n", filename);
-        pthread_mutex_unlock(&log_mtx);
+    return tp_submit_cb(pool, filename, map, censored, NULL, NULL);
+}
+
+bool tp_submit_cb(ThreadPool  *pool,
+                  const char  *filename,
+                  HashMap     *map,
+                  CensoredSet *censored,
+                  void       (*done)(void *arg),
+                  void        *done_arg)
+{
+    /* the registry assigns an ID on first sight; a known file is only
+     * re-indexed once it is idle and its contents actually changed */
+    uint32_t file_id;
+    bool     created;
+
+    /* back-pressure from the segment thread: wait while it is behind or
+     * while writing segments out will bring memory back under budget.  A
+     * worker (a directory walk) must not sleep on the jobs queued behind
+     * it, which may pin the very segments waited for: it runs them. */
+    bool worker = jq_is_worker(pool->queue);
+    Job  job;
+    while (!segments_wait_room(map, worker ? SEGMENT_WAIT_MS : 0)) {
+        if (jq_try_pop(pool->queue, &job)) run_job(&job, NULL);
+    }
+    /* over budget with nothing left to write out: nothing new is queued */
+    if (mem_over_budget()) {
+        tp_log("→ Memory budget reached, not indexing: %s\n", filename);
         return false;
     }
+    if (!fr_intern(&map->files, filename, &file_id, &created)) return false;
 
-    char *copy = strdup(filename);
-    if (!copy) {
-        perror("tp_submit: strdup");
+    FileInfo *fi = fr_get(&map->files, file_id);
+    int idle = FR_INDEXED;
+    if (!created &&
+        !atomic_compare_exchange_strong(&fi->state, &idle, FR_PENDING)) {
+        tp_log("→ File already queued/indexed: %s\n", filename);
         return false;
     }
+    /* from here on the record is ours until its last job finishes */
+
+    struct stat st;
+    bool have_st = stat(filename, &st) == 0;
+    if (!created) {
+        if (!have_st) {
+            perror("tp_submit: stat");
+            atomic_store(&fi->state, FR_INDEXED);
+            return false;
+        }
+        bool same = (uint64_t)st.st_size == fi->size;
+        if (same && file_mtime_ns(&st) != fi->mtime_ns) {
+            /* touched: only a content change counts */
+            uint64_t h;
+            same = file_content_hash(filename, &h) &&
+                   h == atomic_load(&fi->content);
+            if (same) fi->mtime_ns = file_mtime_ns(&st);
+        }
+        if (same) {
+            atomic_store(&fi->state, FR_INDEXED);
+            tp_log("→ File unchanged, skipping: %s\n", filename);
+            return false;
+        }
+        tp_log("→ File changed, re-indexing: %s\n", filename);
+        atomic_store(&fi->words, 0);    // before the removal is published
+        remove_file_postings(map, file_id);
+    }
+    fi->size     = have_st ? (uint64_t)st.st_size : 0;
+    fi->mtime_ns = have_st ? file_mtime_ns(&st) : -1;
+    atomic_store(&fi->content, 0);      // re-summed by the jobs
+
+    /* large files are cut into byte ranges so the whole pool shares them;
+     * tokenize_range snaps each edge to a sentence boundary.  Chunks
+     * start on content-hash blocks so their hashes add up. */
+    size_t n_chunks = 1, chunk = 0;
+    if (have_st && (size_t)st.st_size > CHUNK_MIN_BYTES) {
+        size_t size   = (size_t)st.st_size;
+        size_t target = pool->n * CHUNKS_PER_THREAD;
+        chunk    = (size + target - 1) / target;
+        if (chunk < CHUNK_MIN_BYTES) chunk = CHUNK_MIN_BYTES;
+        chunk    = (chunk + CONTENT_HASH_BLOCK - 1) / CONTENT_HASH_BLOCK
+                   * CONTENT_HASH_BLOCK;
+        n_chunks = (size + chunk - 1) / chunk;
+    }
+
+    atomic_size_t *pending = NULL;
+    if (n_chunks > 1) {
+        pending = malloc(sizeof *pending);
+        if (!pending) {
+            perror("tp_submit: malloc");
+            fi->size     = 0;           // not indexed: no version
+            fi->mtime_ns = -1;
+            atomic_store(&fi->state, FR_INDEXED);
+            return false;
+        }
+        atomic_init(pending, n_chunks);
+    }
+
+    /* the file goes into one segment, kept in memory until its jobs end */
+    segments_pin_file(map, fi, fi->size);
+
+    for (size_t i = 0; i < n_chunks; ++i) {
+        char *copy = strdup(filename);
+        if (!copy) {
+            perror("tp_submit: strdup");
+            /* the file is left without a version, as run_job leaves it
+             * when a range is dropped, so the next _index_ starts over */
+            atomic_store(&fi->dropped, true);
+            /* account for the chunks that will never run */
+            if (pending &&
+                atomic_fetch_sub(pending, n_chunks - i) != n_chunks - i) {
+                return true;            // the last one still running ends it
+            }
+            if (i > 0) fold_file_postings(map, file_id);
+            atomic_store(&fi->dropped, false);
+            fi->size     = 0;
+            fi->mtime_ns = -1;
+            free(pending);
+            segments_unpin_file(map, fi);
+            atomic_store(&fi->state, FR_INDEXED);
+            if (i > 0 && done) done(done_arg);  // the rest already ran
+            return i > 0;
+        }
 
-    Job j = {
-        .filename = copy,
-        .map      = map,
-        .censored = censored
-    };
-    jq_push(pool->queue, j);
+        Job j = {
+            .filename = copy,
+            .file_id  = file_id,
+            .off      = i * chunk,
+            .len      = chunk,
+            .pending  = pending,
+            .map      = map,
+            .censored = censored,
+            .done     = done,
+            .done_arg = done_arg
+        };
+        jq_push(pool->queue, j);
+    }
     return true;
 }
 
+void tp_run(ThreadPool *pool, void (*fn)(void *arg), void *arg)
+{
+    jq_push(pool->queue, (Job){ .run = fn, .arg = arg });
+}
+
 void tp_destroy(ThreadPool *pool)
 {
     jq_shutdown(pool->queue);
     for (size_t i = 0; i < pool->n; ++i) {
-        pthread_join(pool->workers[i], NULL);
+        pthread_join(pool->workers[i].thread, NULL);
     }
     free(pool->workers);
 }
@@ -1,21 +1,63 @@
 #define _POSIX_C_SOURCE 200809L  // for strndup, fileno, etc.
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>    // for strcasecmp
+#include <strings.h>    // for strncasecmp
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "util.h"
+#include "hash.h"
+#include "stats.h"
+#include "segment.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // --------------------------------------------------------------------------------
 // CENSORED SET (concrete definition for the opaque typedef in util.h)
 // --------------------------------------------------------------------------------
 struct CensoredSet {
-    char  **words;  // array of strdup’d, lowercase tokens
-    size_t  count;  // number of entries in `words[]`
+    char     **words;   // array of strdup’d, lowercase tokens
+    uint64_t  *hashes;  // hashes[i] = fold_hash(words[i])
+    size_t     count;   // number of distinct entries in `words[]`
+    uint32_t  *slots;   // open addressing over words: index+1, 0 ⇒ empty
+    size_t     mask;    // slots - 1 (slot count is a power of two)
 };
 
+// FNV-1a of the lowercased span: case is folded once, while hashing
+static inline uint64_t fold_hash(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)tolower((unsigned char)s[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Probe for word[0..len) (any case); returns its slot (occupied or empty)
+static size_t censored_probe(const CensoredSet *set, const char *word,
+                             size_t len, uint64_t h)
+{
+    for (size_t i = h & set->mask; ; i = (i + 1) & set->mask) {
+        uint32_t s = set->slots[i];
+        if (!s) return i;
+        const char *w = set->words[s - 1];
+        if (set->hashes[s - 1] == h &&
+            strncasecmp(w, word, len) == 0 && w[len] == '\0') {
+            return i;
+        }
+    }
+}
+
 CensoredSet *load_censored_set(const char *filepath) {
     FILE *f = fopen(filepath, "r");
     if (!f) {
@@ -29,6 +71,7 @@ CensoredSet *load_censored_set(const char *filepath) {
         return NULL;
     }
 
+    size_t cap = 0;
     char buf[256];
     while (fscanf(f, "%255s", buf) == 1) {
         // lowercase the token
@@ -40,29 +83,59 @@ CensoredSet *load_censored_set(const char *filepath) {
             perror("load_censored_set: strdup");
             break;
         }
-        char **tmp = realloc(set->words, (set->count + 1) * sizeof(*tmp));
-        if (!tmp) {
-            perror("load_censored_set: realloc");
-            free(token);
-            break;
+        if (set->count == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            char **tmp = realloc(set->words, new_cap * sizeof(*tmp));
+            if (!tmp) {
+                perror("load_censored_set: realloc");
+                free(token);
+                break;
+            }
+            set->words = tmp;
+            cap        = new_cap;
         }
-        set->words          = tmp;
         set->words[set->count++] = token;
     }
-
     fclose(f);
-    return set;
-}
 
-bool is_censored(const CensoredSet *set, const char *word) {
-    if (!set) return false;
-    // case-insensitive check
+    /* build the hash table at ≤ 50% load, dropping duplicate tokens */
+    size_t n_slots = 16;
+    while (n_slots < 2 * set->count) n_slots *= 2;
+    set->mask   = n_slots - 1;
+    set->slots  = calloc(n_slots, sizeof(*set->slots));
+    set->hashes = malloc((set->count ? set->count : 1) * sizeof(*set->hashes));
+    if (!set->slots || !set->hashes) {
+        perror("load_censored_set: calloc slots");
+        free_censored_set(set);
+        return NULL;
+    }
+    size_t n = 0;
     for (size_t i = 0; i < set->count; i++) {
-        if (strcasecmp(set->words[i], word) == 0) {
-            return true;
+        char    *w   = set->words[i];
+        size_t   len = strlen(w);
+        uint64_t h   = fold_hash(w, len);
+        size_t   at  = censored_probe(set, w, len, h);
+        if (set->slots[at]) {
+            free(w);
+            continue;
         }
+        set->words[n]  = w;
+        set->hashes[n] = h;
+        set->slots[at] = (uint32_t)++n;
     }
-    return false;
+    set->count = n;
+    return set;
+}
+
+bool is_censored(const CensoredSet *set, const char *word) {
+    return is_censored_span(set, word, strlen(word));
+}
+
+bool is_censored_span(const CensoredSet *set, const char *word, size_t len) {
+    if (!set || !set->count) return false;
+    // case-insensitive: folded hash, then one probe sequence
+    uint64_t h = fold_hash(word, len);
+    return set->slots[censored_probe(set, word, len, h)] != 0;
 }
 
 void free_censored_set(CensoredSet *set) {
@@ -71,6 +144,8 @@ void free_censored_set(CensoredSet *set) {
         free(set->words[i]);
     }
     free(set->words);
+    free(set->hashes);
+    free(set->slots);
     free(set);
 }
 
@@ -94,101 +169,305 @@ void trim_nl(char *s) {
 // ------------------------
 // TOKENIZATION
 // ------------------------
-void tokenize_file(const char        *filepath,
-                   HashMap           *map,
-                   const CensoredSet *censored)
+static inline bool is_terminator(int c) {
+    return c == '.' || c == '?' || c == '!';
+}
+
+// Byte classes for one 64-byte block: bit i describes p[i].
+// Bits at or past `n` are always clear.
+typedef struct {
+    uint64_t alpha;   // [A-Za-z] (isalpha in the C locale)
+    uint64_t term;    // sentence terminator . ? !
+} BlockClass;
+
+static inline uint64_t low_bits(size_t n) {
+    return n >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1);
+}
+
+static inline BlockClass classify_scalar(const char *p, size_t n)
 {
-    FILE *f = fopen(filepath, "r");
-    if (!f) {
-        perror("tokenize_file: fopen");
-        return;
+    BlockClass c = { 0, 0 };
+    for (size_t i = 0; i < n; i++) {
+        unsigned char ch = (unsigned char)p[i];
+        c.alpha |= (uint64_t)((unsigned char)((ch | 0x20) - 'a') < 26) << i;
+        c.term  |= (uint64_t)is_terminator(ch) << i;
     }
-    if (fseek(f, 0, SEEK_END) != 0) {
-        perror("tokenize_file: fseek");
-        fclose(f);
+    return c;
+}
+
+#if defined(__AVX2__)
+static inline BlockClass classify(const char *p, size_t n)
+{
+    if (n < 64) return classify_scalar(p, n);
+    BlockClass c = { 0, 0 };
+    const __m256i lo = _mm256_set1_epi8(0x20);
+    const __m256i sh = _mm256_set1_epi8((char)(0x80 - 'a'));
+    const __m256i lt = _mm256_set1_epi8((char)(0x80 + 26));
+    for (int k = 0; k < 2; k++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * k));
+        /* (v|0x20) - 'a' < 26, as a signed compare around 0x80 */
+        __m256i x = _mm256_add_epi8(_mm256_or_si256(v, lo), sh);
+        __m256i a = _mm256_cmpgt_epi8(lt, x);
+        __m256i t = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?'))),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('!')));
+        c.alpha |= (uint64_t)(uint32_t)_mm256_movemask_epi8(a) << (32 * k);
+        c.term  |= (uint64_t)(uint32_t)_mm256_movemask_epi8(t) << (32 * k);
+    }
+    return c;
+}
+#elif defined(__SSE2__)
+static inline BlockClass classify(const char *p, size_t n)
+{
+    if (n < 64) return classify_scalar(p, n);
+    BlockClass c = { 0, 0 };
+    const __m128i lo = _mm_set1_epi8(0x20);
+    const __m128i sh = _mm_set1_epi8((char)(0x80 - 'a'));
+    const __m128i lt = _mm_set1_epi8((char)(0x80 + 26));
+    for (int k = 0; k < 4; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+        /* (v|0x20) - 'a' < 26, as a signed compare around 0x80 */
+        __m128i x = _mm_add_epi8(_mm_or_si128(v, lo), sh);
+        __m128i a = _mm_cmplt_epi8(x, lt);
+        __m128i t = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('?'))),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('!')));
+        c.alpha |= (uint64_t)(uint16_t)_mm_movemask_epi8(a) << (16 * k);
+        c.term  |= (uint64_t)(uint16_t)_mm_movemask_epi8(t) << (16 * k);
+    }
+    return c;
+}
+#else
+#define classify classify_scalar
+#endif
+
+static inline const char *skip_space(const char *p, const char *end) {
+    while (p < end && isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+// Words of the sentence being scanned, held until its verdict is known
+typedef struct {
+    const char *p;
+    size_t      len;
+} WordSpan;
+
+// Walk bytes [first, end) once, sentence-by-sentence (terminators: . ? !),
+// and buffer every word of each non-censored sentence in `li`.  Each
+// 64-byte block is classified at once; only word starts, word ends and
+// terminators are visited.  Words are checked against `censored` as they
+// end and held as spans until the sentence closes, so a censored
+// sentence never reaches the index.  Nothing is copied.  Returns the
+// number of words buffered.
+static size_t index_sentences(const char        *first,
+                            const char        *end,
+                            LocalIndex        *li,
+                            const CensoredSet *censored)
+{
+    WordSpan   *words   = NULL;
+    size_t      n_words = 0, cap_words = 0, total = 0;
+    bool        skip    = false;          // current sentence is censored
+    const char *sent    = skip_space(first, end);
+    const char *ws      = NULL;           // start of the current word
+    uint64_t    carry   = 0;              // previous block ended in a word
+
+    for (const char *blk = first; blk < end; blk += 64) {
+        size_t     n    = (size_t)(end - blk) < 64 ? (size_t)(end - blk) : 64;
+        BlockClass c    = classify(blk, n);
+        uint64_t   prev = (c.alpha << 1) | carry;   // alpha bit of byte i-1
+        uint64_t   starts = c.alpha & ~prev;
+        uint64_t   ends   = ~c.alpha & prev & low_bits(n);
+        uint64_t   ev     = starts | ends | c.term;
+        carry = (n == 64) ? c.alpha >> 63 : 0;
+
+        while (ev) {
+            unsigned    i   = (unsigned)__builtin_ctzll(ev);
+            uint64_t    bit = (uint64_t)1 << i;
+            const char *q   = blk + i;
+            ev &= ev - 1;
+
+            if ((ends & bit) && !skip) {           // word [ws, q) complete
+                size_t len = (size_t)(q - ws);
+                if (is_censored_span(censored, ws, len)) {
+                    skip = true;
+                } else {
+                    if (n_words == cap_words) {
+                        size_t new_cap = cap_words ? cap_words * 2 : 64;
+                        WordSpan *tmp = realloc(words, new_cap * sizeof(*tmp));
+                        if (!tmp) {
+                            perror("tokenize_file: realloc words");
+                            free(words);
+                            return total;
+                        }
+                        words     = tmp;
+                        cap_words = new_cap;
+                    }
+                    words[n_words++] = (WordSpan){ ws, len };
+                }
+            }
+            if (starts & bit) ws = q;
+            if (c.term & bit) {                    // sentence [sent, q]
+                if (!skip) {
+                    size_t sent_len = (size_t)(q + 1 - sent);
+                    for (size_t k = 0; k < n_words; k++) {
+                        local_index_add(li, words[k].p, words[k].len,
+                                        sent, sent_len, (uint32_t)k);
+                    }
+                    total += n_words;
+                } else {
+                    STATS_ADD(ST_CENSORED_SENTENCES, 1);
+                }
+                n_words = 0;
+                skip    = false;
+                sent    = skip_space(q + 1, end);
+            }
+        }
+    }
+    /* a trailing sentence without a terminator is not indexed */
+    free(words);
+    return total;
+}
+
+void tokenize_range(const char        *filepath,
+                    uint32_t           file_id,
+                    size_t             off,
+                    size_t             len,
+                    HashMap           *map,
+                    const CensoredSet *censored,
+                    LocalIndex        *scratch)
+{
+    STATS_START(t_read);
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        perror("tokenize_file: open");
         return;
     }
-    long sz = ftell(f);
-    if (sz < 0) {
-        perror("tokenize_file: ftell");
-        fclose(f);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("tokenize_file: fstat");
+        close(fd);
         return;
     }
-    rewind(f);
+    size_t sz  = (size_t)st.st_size;
+    size_t end = (len == 0 || off + len > sz) ? sz : off + len;
+    if (off >= end) { close(fd); return; }
 
-    char *buf = malloc((size_t)sz + 1);
-    if (!buf) {
-        perror("tokenize_file: malloc");
-        fclose(f);
+    /* map from the page holding byte off-1 to EOF: pages are only faulted
+     * in as the scan reaches them, so the straddling last sentence is free */
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t base = off ? (off - 1) / page * page : 0;
+    size_t maplen = sz - base;
+    char *map_base = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, (off_t)base);
+    close(fd);
+    if (map_base == MAP_FAILED) {
+        perror("tokenize_file: mmap");
         return;
     }
-    size_t nread = fread(buf, 1, (size_t)sz, f);
-    buf[nread] = '\0';
-    if (nread < (size_t)sz) {
-        fprintf(stderr,
-                "tokenize_file: warning short read %zu of %ld bytes\n",
-                nread, sz);
-    }
-    fclose(f);
+    posix_madvise(map_base, maplen, POSIX_MADV_SEQUENTIAL);
 
-    // Walk buffer sentence-by-sentence (terminators: . ? !)
-    for (char *p = buf; *p; ) {
-        // skip whitespace
-        while (*p && isspace((unsigned char)*p)) p++;
-        if (!*p) break;
-
-        // start of sentence
-        char *sent_start = p;
-        while (*p && *p != '.' && *p != '?' && *p != '!') p++;
-        if (!*p) break;
-        p++;  // include terminator
-
-        size_t sent_len = (size_t)(p - sent_start);
-        char *ctx = malloc(sent_len + 1);
-        if (!ctx) {
-            perror("tokenize_file: malloc ctx");
-            break;
-        }
-        memcpy(ctx, sent_start, sent_len);
-        ctx[sent_len] = '\0';
-        // collapse newlines
-        for (char *q = ctx; *q; q++) {
-            if (*q == '\n' || *q == '\r') *q = ' ';
-        }
+    const char *data  = map_base - base;     // data[i] ⇔ file byte i
+    const char *first = data + off;
+    const char *last  = data + end;
+    const char *eof   = data + sz;
 
-        // check censored (case-insensitive)
-        bool skip = false;
-        for (char *w = ctx; *w && !skip; ) {
-            while (*w && !isalpha((unsigned char)*w)) w++;
-            if (!*w) break;
-            char *ws = w;
-            while (*w && isalpha((unsigned char)*w)) w++;
-            char saved = *w; *w = '\0';
-            if (is_censored(censored, ws)) skip = true;
-            *w = saved;
-        }
+    /* snap both edges forward: a sentence belongs to the range it begins in */
+    if (off > 0) {
+        const char *p = data + off - 1;
+        while (p < eof && !is_terminator(*p)) p++;
+        first = (p < eof) ? p + 1 : eof;
+    }
+    if (end < sz && !is_terminator(last[-1])) {
+        while (last < eof && !is_terminator(*last)) last++;
+        if (last < eof) last++;
+    }
 
-        // index words
-        if (!skip) {
-            for (char *w = ctx; *w; ) {
-                while (*w && !isalpha((unsigned char)*w)) w++;
-                if (!*w) break;
-                char *ws = w;
-                while (*w && isalpha((unsigned char)*w)) w++;
-                size_t wlen = (size_t)(w - ws);
-
-                char *word = strndup(ws, wlen);
-                if (!word) {
-                    perror("tokenize_file: strndup");
-                    continue;
-                }
-                add_word_occurrence(map, word, filepath, ctx);
-                free(word);
+    /* raw bytes of the range, for the file's change-detection hash */
+    FileInfo *fi = fr_get(&map->files, file_id);
+    if (fi) atomic_fetch_add(&fi->content, content_hash(data, off, end));
+    STATS_ADD(ST_FILES_READ, 1);            // the hash pulled the range in
+    STATS_STOP(ST_READ_NS, t_read);
+
+    if (first < last) {
+        LocalIndex *li = scratch ? scratch : local_index_create();
+        if (li) {
+            /* counted before the merge makes the change visible */
+            STATS_START(t_tok);
+            size_t n = index_sentences(first, last, li, censored);
+            STATS_STOP(ST_TOKENIZE_NS, t_tok);
+            STATS_ADD(ST_RANGES_TOKENIZED, 1);
+            STATS_ADD(ST_TOKENS, n);
+            if (fi) atomic_fetch_add(&fi->words, n);
+            /* part of a file: folded once all its ranges are in */
+            bool whole = off == 0 && end == sz;
+            if (!merge_local_index(map, li, file_id, data, whole) && fi) {
+                atomic_fetch_sub(&fi->words, n);
+                atomic_store(&fi->dropped, true);   // see run_job
             }
+            if (!scratch) local_index_free(li);
         }
+    }
+    munmap(map_base, maplen);
+}
+
+void tokenize_file(const char        *filepath,
+                   HashMap           *map,
+                   const CensoredSet *censored)
+{
+    uint32_t file_id;
+    bool     created;
+    if (!fr_intern(&map->files, filepath, &file_id, &created)) return;
+    if (!created) return;                 // re-indexing goes through tp_submit
 
-        free(ctx);
+    FileInfo   *fi = fr_get(&map->files, file_id);
+    struct stat st;
+    if (stat(filepath, &st) == 0) {
+        fi->size     = (uint64_t)st.st_size;
+        fi->mtime_ns = file_mtime_ns(&st);
+    }
+    segments_pin_file(map, fi, fi->size);
+    tokenize_range(filepath, file_id, 0, 0, map, censored, NULL);
+    segments_unpin_file(map, fi);
+    if (atomic_exchange(&fi->dropped, false)) {   // as run_job does
+        fi->size     = 0;
+        fi->mtime_ns = -1;
     }
+    atomic_store_explicit(&fi->state, FR_INDEXED, memory_order_release);
+}
+
+int64_t file_mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
 
-    free(buf);
+bool file_content_hash(const char *filepath, uint64_t *out)
+{
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        perror("file_content_hash: open");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("file_content_hash: fstat");
+        close(fd);
+        return false;
+    }
+    size_t sz = (size_t)st.st_size;
+    if (sz == 0) {
+        close(fd);
+        *out = 0;
+        return true;
+    }
+    char *data = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("file_content_hash: mmap");
+        return false;
+    }
+    posix_madvise(data, sz, POSIX_MADV_SEQUENTIAL);
+    *out = content_hash(data, 0, sz);
+    munmap(data, sz);
+    return true;
 }
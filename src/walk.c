@@ -0,0 +1,309 @@
+#define _POSIX_C_SOURCE 200809L  // for strdup, fstatat, dirfd
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "walk.h"
+#include "config.h"
+
+// A directory being read, or (dir == NULL) a path not looked at yet
+typedef struct {
+    DIR  *dir;
+    char *path;
+} Cursor;
+
+// One walk.  Every running walk task and every file still being indexed
+// holds a reference; the last one to drop it reports and frees the walk.
+// Work waits on two stacks: directories paused mid-read (taken first, so
+// few stay open) and paths not opened yet.
+typedef struct {
+    pthread_mutex_t  lock;      // guards the stacks and `walkers`
+    Cursor          *open;
+    size_t           n_open, cap_open;
+    Cursor          *todo;
+    size_t           n_todo, cap_todo;
+    size_t           walkers;   // walk tasks running
+
+    atomic_size_t    files;     // queued or being indexed
+    atomic_size_t    bytes;     // ... and their size
+    atomic_size_t    queued, skipped;
+    atomic_size_t    refs;
+
+    ThreadPool      *pool;
+    HashMap         *map;
+    CensoredSet     *censored;
+    char            *pattern;   // as typed, for the report
+} Walk;
+
+// A file of the walk in the pool, until its done callback
+typedef struct {
+    Walk     *w;
+    uint64_t  size;
+} WalkFile;
+
+static void walk_task(void *arg);
+
+static bool over_budget(Walk *w)
+{
+    return atomic_load(&w->files) >= WALK_MAX_FILES ||
+           atomic_load(&w->bytes) >= WALK_MAX_BYTES;
+}
+
+static bool cursor_push(Cursor **v, size_t *n, size_t *cap, Cursor c)
+{
+    if (*n == *cap) {
+        size_t  new_cap = *cap ? *cap * 2 : 16;
+        Cursor *tmp     = realloc(*v, new_cap * sizeof(*tmp));
+        if (!tmp) {
+            perror("walk_index: realloc");
+            return false;
+        }
+        *v   = tmp;
+        *cap = new_cap;
+    }
+    (*v)[(*n)++] = c;
+    return true;
+}
+
+static void walk_free(Walk *w)
+{
+    pthread_mutex_destroy(&w->lock);
+    free(w->open);
+    free(w->todo);
+    free(w->pattern);
+    free(w);
+}
+
+static void walk_put(Walk *w)
+{
+    if (atomic_fetch_sub(&w->refs, 1) != 1) return;
+
+    size_t queued = atomic_load(&w->queued);
+    tp_log("Worker finished walking: %s (%zu file%s queued, %zu already "
+           "known)\n", w->pattern, queued, queued == 1 ? "" : "s",
+           atomic_load(&w->skipped));
+    walk_free(w);
+}
+
+// Start another walk task if there is work for one.  Caller holds w->lock.
+static void maybe_spawn(Walk *w)
+{
+    if ((w->n_open || w->n_todo) && w->walkers < w->pool->n &&
+        !over_budget(w)) {
+        w->walkers++;
+        atomic_fetch_add(&w->refs, 1);
+        tp_run(w->pool, walk_task, w);
+    }
+}
+
+// A file of the walk is indexed: give its budget back and resume
+static void file_done(void *arg)
+{
+    WalkFile *f = arg;
+    Walk     *w = f->w;
+    atomic_fetch_sub(&w->bytes, f->size);
+    atomic_fetch_sub(&w->files, 1);
+    free(f);
+
+    pthread_mutex_lock(&w->lock);
+    maybe_spawn(w);
+    pthread_mutex_unlock(&w->lock);
+    walk_put(w);
+}
+
+static void submit_file(Walk *w, const char *path, uint64_t size)
+{
+    uint32_t id;
+    if (fr_lookup(&w->map->files, path, &id)) {
+        atomic_fetch_add(&w->skipped, 1);
+        return;
+    }
+    WalkFile *f = malloc(sizeof(*f));
+    if (!f) {
+        perror("walk_index: malloc");
+        return;
+    }
+    *f = (WalkFile){ .w = w, .size = size };
+    atomic_fetch_add(&w->files, 1);
+    atomic_fetch_add(&w->bytes, size);
+    atomic_fetch_add(&w->refs, 1);
+
+    if (tp_submit_cb(w->pool, path, w->map, w->censored, file_done, f)) {
+        atomic_fetch_add(&w->queued, 1);
+    } else {
+        atomic_fetch_sub(&w->bytes, size);
+        atomic_fetch_sub(&w->files, 1);
+        atomic_fetch_sub(&w->refs, 1);      // never the last: ours remains
+        free(f);
+    }
+}
+
+// Queue a directory found by the walk
+static void add_dir(Walk *w, char *path)
+{
+    pthread_mutex_lock(&w->lock);
+    if (!cursor_push(&w->todo, &w->n_todo, &w->cap_todo,
+                     (Cursor){ .path = path })) {
+        free(path);
+    } else {
+        maybe_spawn(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Read c's entries until the directory ends (true: closed and freed) or
+// the budget runs out (false: c stays open to resume)
+static bool read_dir(Walk *w, Cursor *c)
+{
+    size_t plen = strlen(c->path);
+    bool   slash = plen && c->path[plen - 1] == '/';
+
+    while (!over_budget(w)) {
+        errno = 0;
+        struct dirent *e = readdir(c->dir);
+        if (!e) {
+            if (errno) perror("walk_index: readdir");
+            closedir(c->dir);
+            free(c->path);
+            return true;
+        }
+        if (e->d_name[0] == '.') continue;      // ., .. and hidden entries
+
+        size_t nlen  = strlen(e->d_name);
+        char  *child = malloc(plen + nlen + 2);
+        if (!child) {
+            perror("walk_index: malloc");
+            continue;
+        }
+        memcpy(child, c->path, plen);
+        if (!slash) child[plen] = '/';
+        memcpy(child + plen + !slash, e->d_name, nlen + 1);
+
+        /* a symlink counts only if it leads to a file: linked
+         * directories could loop */
+        struct stat st;
+        if (fstatat(dirfd(c->dir), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            perror("walk_index: fstatat");
+            free(child);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            add_dir(w, child);
+            continue;                           // the stack owns it
+        }
+        if (S_ISLNK(st.st_mode) && stat(child, &st) != 0) st.st_mode = 0;
+        if (S_ISREG(st.st_mode)) submit_file(w, child, (uint64_t)st.st_size);
+        free(child);
+    }
+    return false;
+}
+
+// Look at a path not opened yet: index a file, or return true with
+// c->dir open for a directory
+static bool open_path(Walk *w, Cursor *c)
+{
+    struct stat st;
+    if (stat(c->path, &st) != 0) {
+        perror("walk_index: stat");
+    } else if (S_ISREG(st.st_mode)) {
+        submit_file(w, c->path, (uint64_t)st.st_size);
+    } else if (S_ISDIR(st.st_mode)) {
+        if ((c->dir = opendir(c->path))) return true;
+        perror("walk_index: opendir");
+    }
+    free(c->path);
+    return false;
+}
+
+// Walk task: read directories until the work or the budget runs out
+static void walk_task(void *arg)
+{
+    Walk *w = arg;
+
+    for (;;) {
+        Cursor c;
+        pthread_mutex_lock(&w->lock);
+        if (over_budget(w) || (!w->n_open && !w->n_todo)) {
+            w->walkers--;
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        c = w->n_open ? w->open[--w->n_open] : w->todo[--w->n_todo];
+        pthread_mutex_unlock(&w->lock);
+
+        if (!c.dir && !open_path(w, &c)) continue;
+        if (read_dir(w, &c)) continue;
+
+        /* out of budget: park the directory for whoever resumes */
+        pthread_mutex_lock(&w->lock);
+        if (!cursor_push(&w->open, &w->n_open, &w->cap_open, c)) {
+            closedir(c.dir);
+            free(c.path);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    walk_put(w);
+}
+
+bool walk_index(ThreadPool  *pool,
+                const char  *pattern,
+                HashMap     *map,
+                CensoredSet *censored)
+{
+    Walk *w = calloc(1, sizeof(*w));
+    if (!w) {
+        perror("walk_index: calloc");
+        return false;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    if (!(w->pattern = strdup(pattern))) {
+        perror("walk_index: strdup");
+        walk_free(w);
+        return false;
+    }
+    w->pool     = pool;
+    w->map      = map;
+    w->censored = censored;
+
+    /* the roots: the pattern's matches, or the path itself */
+    bool ok = true;
+    if (strpbrk(pattern, WALK_GLOB_CHARS)) {
+        glob_t g;
+        int rc = glob(pattern, 0, NULL, &g);
+        if (rc == 0) {
+            for (size_t i = 0; ok && i < g.gl_pathc; i++) {
+                Cursor c = { .path = strdup(g.gl_pathv[i]) };
+                ok = c.path &&
+                     cursor_push(&w->todo, &w->n_todo, &w->cap_todo, c);
+                if (!ok) free(c.path);
+            }
+        }
+        if (rc != GLOB_NOMATCH) globfree(&g);
+        if (rc != 0 && rc != GLOB_NOMATCH) {
+            fprintf(stderr, "walk_index: glob failed for '%s'\n", pattern);
+        }
+    } else {
+        Cursor c = { .path = strdup(pattern) };
+        ok = c.path && cursor_push(&w->todo, &w->n_todo, &w->cap_todo, c);
+        if (!ok) free(c.path);
+    }
+    if (!ok || !w->n_todo) {
+        if (ok) tp_log("→ Nothing matches: %s\n", pattern);
+        for (size_t i = 0; i < w->n_todo; i++) free(w->todo[i].path);
+        walk_free(w);
+        return false;
+    }
+
+    /* the first task holds the walk's first reference */
+    atomic_init(&w->refs, 1);
+    w->walkers = 1;
+    tp_run(pool, walk_task, w);
+    return true;
+}
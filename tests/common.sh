@@ -0,0 +1,77 @@
+# Helpers for the test scripts, sourced from the repository root.  The
+# engines run in a scratch directory holding a link to data/, so paths
+# in their output read data/... and activity.log stays out of the tree.
+
+ROOT=$(pwd)
+ENGINE=$ROOT/search_engine
+SEG_ENGINE=$ROOT/tests/search_engine_seg    # tiny segments (makefile)
+QUERIES=$ROOT/tests/queries.txt
+EXPECTED=$ROOT/tests/expected/queries.out
+FILES="data/file1.txt data/file2.txt data/file3.txt data/file4.txt data/file5.txt data/file6.txt"
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/mwf-test.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' EXIT
+ln -s "$ROOT/data" "$TMP/data"
+FAILED=0
+
+pass() { echo "  ok    $*"; }
+fail() { echo "  FAIL  $*"; FAILED=$((FAILED + 1)); }
+
+# Colourless output, from the first search on
+results() { sed 's/\x1b\[[0-9;]*m//g' | sed -n '/^_search_/,$p'; }
+
+# Run the queries of tests/queries.txt against index file $1 in batch mode
+# (not into a pipeline ending in pass or fail: its count would be lost)
+batch() {
+    (cd "$TMP" && "$ENGINE" data/censored.txt -l "$1" -b "$QUERIES" 2>/dev/null) | results
+}
+
+# Check that file $2 holds the expected query results; $1 names the check
+expect_queries() {
+    if diff -u "$EXPECTED" "$2" > "$TMP/diff"; then
+        pass "$1"
+    else
+        fail "$1"
+        head -40 "$TMP/diff"
+    fi
+}
+
+# REPL session of engine $1 with extra arguments $2 (word-split), output
+# in $TMP/repl.out: index the remaining arguments all at once, wait until
+# every one is done, then send the commands on stdin and _stop_
+session() {
+    engine=$1 args=$2
+    shift 2
+    rm -f "$TMP/in" && mkfifo "$TMP/in" || return 1
+    : > "$TMP/repl.out"             # there before the engine opens its input
+    (cd "$TMP" && exec "$engine" $args -S "$TMP" data/censored.txt > repl.out 2>&1 < in) &
+    pid=$!
+    exec 3> "$TMP/in"
+    for f in "$@"; do echo "_index_ $f" >&3; done
+    tries=0
+    while [ "$(grep -c 'Worker finished indexing' "$TMP/repl.out")" -lt $# ]; do
+        tries=$((tries + 1))
+        if [ $tries -gt 1200 ] || ! kill -0 $pid 2>/dev/null; then
+            echo "  (indexing did not finish)"
+            break
+        fi
+        sleep 0.1
+    done
+    cat >&3
+    echo "_stop_" >&3
+    exec 3>&-
+    wait $pid
+}
+
+# The queries as REPL commands
+search_commands() { grep -v '^#' "$QUERIES" | grep . | sed 's/^/_search_ /'; }
+
+# Exit with the verdict of script $1
+finish() {
+    if [ $FAILED -eq 0 ]; then
+        echo "$1: all passed"
+        exit 0
+    fi
+    echo "$1: $FAILED failed"
+    exit 1
+}
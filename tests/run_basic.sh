@@ -0,0 +1,57 @@
+#!/bin/sh
+# The query language against known results over data/, and the index
+# file format: save, load, save again, and damaged files.
+cd "$(dirname "$0")/.." || exit 1
+. tests/common.sh
+echo "run_basic:"
+
+# Index data/ and save it; the queries run against the file
+echo "_save_ a.idx" | session "$ENGINE" "" $FILES
+if grep -q "Index saved" "$TMP/repl.out"; then
+    pass "index data/ and save it"
+else
+    fail "index data/ and save it"
+fi
+batch a.idx > "$TMP/a.out"
+expect_queries "queries against the saved index" "$TMP/a.out"
+
+# What was loaded is saved again byte for byte
+(cd "$TMP" && printf '_load_ a.idx\n_save_ b.idx\n_stop_\n' |
+    "$ENGINE" data/censored.txt > /dev/null 2>&1)
+if cmp -s "$TMP/a.idx" "$TMP/b.idx"; then
+    pass "load and save again: same file"
+else
+    fail "load and save again: same file"
+fi
+
+# A truncated file and a text file are refused
+head -c 4096 "$TMP/a.idx" > "$TMP/short.idx"
+for f in short.idx data/file5.txt; do
+    if batch "$f" | grep -q "No results for 'dinosaur'"; then
+        pass "refuse $f"
+    else
+        fail "refuse $f"
+    fi
+done
+
+# Damage anywhere may lose results, but never crashes a search
+size=$(wc -c < "$TMP/a.idx")
+crashed=0
+for tenth in 0 1 2 3 4 5 6 7 8 9; do
+    at=$((size * tenth / 10 + 64))
+    cp "$TMP/a.idx" "$TMP/bad.idx"
+    printf '\377\377\377\377\000\000\000\000\377\177' |
+        dd of="$TMP/bad.idx" bs=1 seek=$at conv=notrunc 2>/dev/null
+    (cd "$TMP" && "$ENGINE" data/censored.txt -l bad.idx -b "$QUERIES" > /dev/null 2>&1)
+    if [ $? -ge 128 ]; then
+        crashed=$((crashed + 1))
+        echo "  (crashed with damage at byte $at)"
+    fi
+done
+if [ $crashed -eq 0 ]; then
+    pass "damaged index files"
+else
+    fail "damaged index files"
+fi
+
+finish run_basic
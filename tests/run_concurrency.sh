@@ -0,0 +1,72 @@
+#!/bin/sh
+# Indexing on the whole pool: files indexed in small chunks, written out
+# as tiny segments and merged while they are indexed must search exactly
+# like one in-memory index, under a memory budget too; the ingest
+# benchmark must index the same tokens at every worker count.
+cd "$(dirname "$0")/.." || exit 1
+. tests/common.sh
+echo "run_concurrency:"
+
+# Searches of a REPL session up to _mem_, without the workers' reports
+searches() { results < "$TMP/repl.out" | sed '/^_mem_/,$d' | grep -v 'Worker finished'; }
+
+# The reference: one in-memory index
+{ search_commands; echo "_mem_"; } | session "$ENGINE" "" $FILES
+searches > "$TMP/mem.out"
+
+# Segments: searched live, then saved from them
+{ search_commands; echo "_mem_"; echo "_save_ s.idx"; } | session "$SEG_ENGINE" "" $FILES
+if grep -Eq "[1-9][0-9]* on disk" "$TMP/repl.out"; then
+    pass "files written out as segments"
+else
+    fail "files written out as segments"
+fi
+if searches | diff -u "$TMP/mem.out" - > "$TMP/diff"; then
+    pass "searches over segments"
+else
+    fail "searches over segments"
+    head -40 "$TMP/diff"
+fi
+batch s.idx > "$TMP/s.out"
+expect_queries "index saved from segments" "$TMP/s.out"
+
+# A memory budget far below the index: write-outs make room, nothing is
+# refused or dropped
+{ search_commands; echo "_mem_"; } | session "$SEG_ENGINE" "-M 4" $FILES
+if grep -q "not indexing" "$TMP/repl.out"; then
+    fail "memory budget: files refused"
+elif searches | diff -u "$TMP/mem.out" - > "$TMP/diff"; then
+    pass "searches under a memory budget"
+else
+    fail "searches under a memory budget"
+    head -40 "$TMP/diff"
+fi
+
+# A file in many chunks, with the same sentences over and over across
+# their edges, indexes as in one pass: the reference reads it whole
+awk 'BEGIN { r = 1; for (i = 0; i < 24000; i++) {
+                 r = (r * 75 + 74) % 65537
+                 printf "%s%s", (r % 3 ? "Yes. " : "Yes no. "), (i % 8 == 7 ? "\n" : "") } }' \
+    > "$TMP/yes.txt"
+printf '_search_ Yes 0\n_search_ no 0\n' | session "$ENGINE" "" yes.txt
+results < "$TMP/repl.out" | grep -v 'Worker finished' > "$TMP/whole.out"
+printf '_search_ Yes 0\n_search_ no 0\n' | session "$SEG_ENGINE" "" yes.txt
+if results < "$TMP/repl.out" | grep -v 'Worker finished' |
+   diff -u "$TMP/whole.out" - > "$TMP/diff"; then
+    pass "a file in chunks"
+else
+    fail "a file in chunks"
+    head -40 "$TMP/diff"
+fi
+
+# The benchmark, briefly: every worker count indexes the same tokens
+if bench/ingest_bench -m 1 -n 2 -t 2 -i 1 > "$TMP/bench.tsv" 2>/dev/null &&
+   awk -F'\t' '!/^#/ && $1 != "corpus" { rows++; if ($1 in t && t[$1] != $5) bad = 1; t[$1] = $5 }
+               END { exit !(rows == 4 && !bad) }' "$TMP/bench.tsv"; then
+    pass "ingest benchmark"
+else
+    fail "ingest benchmark"
+    cat "$TMP/bench.tsv"
+fi
+
+finish run_concurrency